@@ -145,6 +145,8 @@ struct StMessage
     QString sender;
     QString recipient;
     OptionalAttachment attachment;
+    // UTC epoch milliseconds of archived message, 0 if message is received now
+    qint64 timestamp = 0;
 };
 Q_DECLARE_METATYPE(StMessage);
 
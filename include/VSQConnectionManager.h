@@ -0,0 +1,125 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_CONNECTIONMANAGER_H
+#define VSQ_CONNECTIONMANAGER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include <functional>
+
+#include <qxmpp/QXmppClient.h>
+#include <qxmpp/QXmppConfiguration.h>
+#include <qxmpp/QXmppGlobal.h>
+
+#include "VSQCommon.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcConnection);
+
+// Connection of XMPP client, driven by client signals in the client thread.
+// Only one connection attempt is in flight. Failed attempts are retried with exponential backoff,
+// network that is online again is retried at once. Lost connection is retried at once if it was up
+// for a while, otherwise it counts as a failed attempt, so connect-then-drop loops are backed off.
+// With QXmpp 1.4+ the client negotiates stream management (XEP-0198), so a lost connection that is
+// retried before the server drops the session is resumed and unacknowledged stanzas are resent by the client.
+// Older QXmpp starts a new session every time, the build warns about it
+class VSQConnectionManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum class State
+    {
+        // Not connected and no attempt is planned
+        Idle,
+        // Previous connection is closed before a new attempt
+        Disconnecting,
+        Connecting,
+        Connected,
+        // Attempt is planned after backoff or when network is online
+        Waiting
+    };
+
+    // Called in the client thread with result of the first attempt
+    using FinishedCallback = std::function<void (bool connected)>;
+
+    VSQConnectionManager(QXmppClient *client, QObject *parent);
+
+    // Thread-safe. Connects with new configuration, current connection is closed first
+    void connectToServer(const QXmppConfiguration &configuration, const FinishedCallback &finished = {});
+
+    // Starts an attempt if client isn't connected and nothing is planned. Called by heartbeats
+    void reconnect();
+
+    // Going online resets backoff and retries at once, offline postpones retries
+    void setNetworkOnline(bool online);
+
+    // Closes connection, it's retried after backoff
+    void disconnectFromServer();
+
+    // Closes connection and cancels retries until connectToServer is called
+    void stop();
+
+    State state() const;
+
+    // True if the last connection resumed the previous session, its carbons and subscriptions are kept
+    static bool isStreamResumed(const QXmppClient *client);
+
+private:
+    void setState(State state);
+    void attempt();
+    void fail();
+    void finishAttempt(bool connected);
+    void onConnected();
+    void onDisconnected();
+    void onError(QXmppClient::Error error);
+    void onAttemptTimeout();
+    static int retryDelay(int failureCount);
+
+    QXmppClient *m_client;
+    QXmppConfiguration m_configuration;
+    State m_state = State::Idle;
+    bool m_networkOnline = true;
+    int m_failureCount = 0;
+    QTimer m_attemptTimer;
+    QTimer m_retryTimer;
+    // Active while connection is young, its timeout resets backoff
+    QTimer m_stableTimer;
+    // Callers of connectToServer waiting for the attempt
+    QVector<FinishedCallback> m_finishedCallbacks;
+};
+
+#endif // VSQ_CONNECTIONMANAGER_H
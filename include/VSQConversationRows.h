@@ -0,0 +1,120 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_CONVERSATIONROWS_H
+#define VSQ_CONVERSATIONROWS_H
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include "VSQCommon.h"
+
+// Loaded rows of a conversation, stored column by column.
+// Author and recipient are interned, attachment fields are stored only for rows that have an attachment.
+class VSQConversationRows
+{
+public:
+    struct AttachmentFields
+    {
+        QString id;
+        DataSize bytesTotal = 0;
+        int type = 0;
+        QString filePath;
+        QString remoteUrl;
+        QString thumbnailPath;
+        int thumbnailWidth = 0;
+        int thumbnailHeight = 0;
+        QString remoteThumbnailUrl;
+        int status = 0;
+    };
+
+    // Single row, used to load rows into the store
+    struct RowData
+    {
+        qint64 rowId = 0;
+        QString author;
+        QString recipient;
+        qint64 timestamp = 0;
+        QString message;
+        int status = 0;
+        QString messageId;
+        bool hasAttachment = false;
+        AttachmentFields attachment;
+    };
+    using RowsData = QVector<RowData>;
+
+    int size() const { return m_rowIds.size(); }
+    bool isEmpty() const { return m_rowIds.isEmpty(); }
+
+    void clear();
+    void append(const RowData &row);
+    void prepend(const RowsData &rows);
+    void removeFirst(int count);
+
+    qint64 rowId(int row) const { return m_rowIds[row]; }
+    qint64 timestamp(int row) const { return m_timestamps[row]; }
+    const QString &author(int row) const { return m_strings[m_authors[row]]; }
+    const QString &recipient(int row) const { return m_strings[m_recipients[row]]; }
+    bool hasSameAuthor(int row, int otherRow) const { return m_authors[row] == m_authors[otherRow]; }
+    const QString &message(int row) const { return m_messages[row]; }
+    const QString &messageId(int row) const { return m_messageIds[row]; }
+
+    int status(int row) const { return m_statuses[row]; }
+    void setStatus(int row, int status) { m_statuses[row] = static_cast<qint8>(status); }
+
+    // Returns nullptr if row has no attachment
+    const AttachmentFields *attachment(int row) const;
+    AttachmentFields *attachment(int row);
+
+private:
+    quint32 intern(const QString &string);
+    int addAttachment(const RowData &row);
+
+    QVector<qint64> m_rowIds;
+    QVector<qint64> m_timestamps;
+    QVector<quint32> m_authors;
+    QVector<quint32> m_recipients;
+    QVector<qint8> m_statuses;
+    QVector<QString> m_messageIds;
+    QVector<QString> m_messages;
+    // Index in m_attachments or -1
+    QVector<int> m_attachmentIndices;
+    QVector<AttachmentFields> m_attachments;
+
+    QVector<QString> m_strings;
+    QHash<QString, quint32> m_stringIds;
+};
+
+#endif // VSQ_CONVERSATIONROWS_H
@@ -0,0 +1,100 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_CRYPTOBUFFERPOOL_H
+#define VSQ_CRYPTOBUFFERPOOL_H
+
+#include <QMutex>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Thread-safe pool of buffers for plaintext and ciphertext of messages.
+// Buffers are rounded up to a power of two size class and reused, so messages of any length
+// don't allocate after warm-up. Buffers are wiped when they are returned to the pool
+class VSQCryptoBufferPool
+{
+public:
+    // Pooled buffer, returned to the pool on destruction
+    class Buffer
+    {
+    public:
+        Buffer(Buffer &&other) noexcept;
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+        Buffer &operator=(Buffer &&) = delete;
+        ~Buffer();
+
+        uint8_t *data() { return m_bytes.data(); }
+        const uint8_t *data() const { return m_bytes.data(); }
+        // Requested size, capacity of the buffer can be bigger
+        size_t size() const { return m_size; }
+
+    private:
+        friend class VSQCryptoBufferPool;
+        Buffer(VSQCryptoBufferPool *pool, std::vector<uint8_t> &&bytes, size_t size);
+
+        VSQCryptoBufferPool *m_pool;
+        std::vector<uint8_t> m_bytes;
+        size_t m_size;
+    };
+
+    VSQCryptoBufferPool() = default;
+    VSQCryptoBufferPool(const VSQCryptoBufferPool &) = delete;
+    VSQCryptoBufferPool &operator=(const VSQCryptoBufferPool &) = delete;
+
+    Buffer acquire(size_t size);
+
+    // Upper bound of encrypted message size, same estimate as for attachments
+    static size_t encryptedSize(size_t plaintextSize) { return 5 * plaintextSize + 5000; }
+    // Plaintext is never bigger than its encoded ciphertext
+    static size_t decryptedSize(size_t ciphertextSize) { return ciphertextSize + 1; }
+
+private:
+    // 4 KB, 8 KB, ..., 1 MB. Bigger buffers are allocated per message and aren't kept
+    static const int kMinClassShift = 12;
+    static const int kClassCount = 9;
+    static const int kMaxFreeBuffers = 4;
+
+    static int sizeClass(size_t size);
+    static void wipe(std::vector<uint8_t> &bytes, size_t size);
+    // Only the requested size is wiped, the rest of the buffer isn't written to
+    void release(std::vector<uint8_t> &&bytes, size_t size);
+
+    QMutex m_mutex;
+    std::vector<std::vector<uint8_t>> m_free[kClassCount];
+};
+
+#endif // VSQ_CRYPTOBUFFERPOOL_H
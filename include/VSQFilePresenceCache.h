@@ -0,0 +1,96 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_FILEPRESENCECACHE_H
+#define VSQ_FILEPRESENCECACHE_H
+
+#include <QDir>
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QVector>
+
+#include "VSQCommon.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcFilePresence);
+
+// Cache of file presence, so the UI thread never touches the disk.
+// Files are checked in the thread pool and re-checked when watched directories change.
+class VSQFilePresenceCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit VSQFilePresenceCache(QObject *parent = nullptr);
+
+    void watchDirectory(const QDir &dir);
+
+    // Returns cached presence of the key file. Unknown file is reported as absent and checked in background
+    bool exists(const QString &key, const QString &filePath);
+    // Sets new file path of the key and checks it in background
+    void setFilePath(const QString &key, const QString &filePath);
+
+    void clear();
+
+signals:
+    void presenceChanged(const QString &key, bool exists);
+
+private:
+    struct Entry
+    {
+        QString filePath;
+        bool exists = false;
+    };
+
+    struct Check
+    {
+        QString key;
+        QString filePath;
+        bool exists = false;
+    };
+    using Checks = QVector<Check>;
+
+    void scheduleCheck(const QString &key);
+    void runChecks();
+    void onChecked(const Checks &checks);
+    void onDirectoryChanged(const QString &path);
+
+    QHash<QString, Entry> m_entries;
+    QSet<QString> m_pendingKeys;
+    QFileSystemWatcher m_watcher;
+    bool m_checkScheduled = false;
+};
+
+#endif // VSQ_FILEPRESENCECACHE_H
@@ -0,0 +1,151 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_HISTORYSYNC_H
+#define VSQ_HISTORYSYNC_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <deque>
+
+#include "VSQReceivePipeline.h"
+
+class QXmppClient;
+class QXmppMamManager;
+class QXmppMessage;
+class QXmppResultSetReply;
+class VSQSqlConversationModel;
+class VSQSqlWriteQueue;
+class VSQStorage;
+
+Q_DECLARE_LOGGING_CATEGORY(lcHistorySync);
+
+// Catches up with messages archived by the server (XEP-0313) while the client was offline.
+// Archive is fetched in pages after the stored checkpoint, the next page is requested while the
+// previous one is decrypted in worker threads. Pages are delivered in order, one signal per page,
+// and the checkpoint is queued to the database after messages of the page
+class VSQHistorySync : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(bool active READ isActive NOTIFY activeChanged)
+    Q_PROPERTY(int receivedCount READ receivedCount NOTIFY progressChanged)
+    Q_PROPERTY(int totalCount READ totalCount NOTIFY progressChanged)
+
+public:
+    using Decryptor = VSQReceivePipeline::Decryptor;
+
+    VSQHistorySync(QXmppClient *client, VSQStorage *storage, VSQSqlConversationModel *conversations,
+                   const Decryptor &decryptor, QObject *parent);
+    ~VSQHistorySync() override;
+
+    // Loads checkpoint of the user
+    void setUser(const QString &user);
+
+    // Starts sync after the checkpoint, called when a new stream is connected
+    void start();
+
+    // Stops sync, called on disconnection. Checkpoint is moved to now if sync was finished
+    void stop();
+
+    bool isActive() const;
+    // Archived messages processed by the current sync, including skipped ones that are known or have no body
+    int receivedCount() const;
+    // Messages archived after the checkpoint, -1 if server doesn't report it
+    int totalCount() const;
+
+signals:
+    // Decrypted page of archived messages, that aren't stored yet
+    void received(const QList<StMessage> &messages);
+
+    void activeChanged(bool active);
+    void progressChanged();
+
+private:
+    struct ArchivedMessage
+    {
+        QString messageId;
+        QString sender;
+        QString recipient;
+        QString body;
+        qint64 timestamp = 0;
+    };
+    struct Page
+    {
+        // Messages with body
+        QVector<ArchivedMessage> messages;
+        // All archived messages of the page, including ones without body
+        int archivedCount = 0;
+    };
+
+    QString tableName() const;
+    void setActive(bool active);
+    void requestPage();
+    void decryptNextPage();
+    void finish();
+    void onArchivedMessageReceived(const QString &queryId, const QXmppMessage &message);
+    void onResultsReceived(const QString &queryId, const QXmppResultSetReply &reply, bool complete);
+    void onPageDecrypted(int generation, const QList<StMessage> &messages, int archivedCount, qint64 lastTimestamp);
+    void onPageTimeout();
+    void saveCheckpoint(qint64 checkpoint);
+
+    QXmppClient *m_client;
+    QXmppMamManager *m_mamManager;
+    VSQStorage *m_storage;
+    VSQSqlWriteQueue *m_writeQueue;
+    VSQSqlConversationModel *m_conversations;
+    Decryptor m_decryptor;
+    QString m_user;
+    // UTC epoch milliseconds, archive is fetched after it
+    qint64 m_checkpoint = 0;
+    bool m_active = false;
+    // Results of pages requested before stop are ignored
+    int m_generation = 0;
+    QString m_queryId;
+    QString m_lastArchiveId;
+    bool m_complete = false;
+    // Sync was finished and messages are received live, checkpoint is moved to now on stop
+    bool m_live = false;
+    Page m_receivingPage;
+    // Received pages waiting for decryption, only one page is decrypted at a time
+    std::deque<Page> m_pendingPages;
+    bool m_decrypting = false;
+    int m_receivedCount = 0;
+    int m_totalCount = -1;
+    QTimer m_pageTimer;
+    QThreadPool m_pool;
+};
+
+#endif // VSQ_HISTORYSYNC_H
@@ -0,0 +1,170 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_LRUCACHE_H
+#define VSQ_LRUCACHE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <list>
+#include <utility>
+
+#include "VSQCommon.h"
+
+// Thread-safe cache of values with bounded size. Least recently used value is evicted first.
+// Missing values are filled with beginFill() and endFill(), a filled value isn't cached
+// if the key was changed while the value was read
+template <class Key, class Value>
+class VSQLruCache
+{
+public:
+    explicit VSQLruCache(int capacity)
+        : m_capacity(capacity)
+    {}
+
+    Optional<Value> get(const Key &key)
+    {
+        QMutexLocker locker(&m_mutex);
+        const auto it = m_index.constFind(key);
+        if (it == m_index.constEnd()) {
+            return NullOptional;
+        }
+        m_entries.splice(m_entries.begin(), m_entries, it.value());
+        return it.value()->second;
+    }
+
+    void insert(const Key &key, const Value &value)
+    {
+        QMutexLocker locker(&m_mutex);
+        markChanged(key);
+        insertLocked(key, value);
+    }
+
+    // Applies function to the cached value, does nothing if value isn't cached
+    template <class Function>
+    void update(const Key &key, Function function)
+    {
+        QMutexLocker locker(&m_mutex);
+        markChanged(key);
+        const auto it = m_index.constFind(key);
+        if (it != m_index.constEnd()) {
+            function(it.value()->second);
+        }
+    }
+
+    void remove(const Key &key)
+    {
+        QMutexLocker locker(&m_mutex);
+        markChanged(key);
+        const auto it = m_index.find(key);
+        if (it != m_index.end()) {
+            m_entries.erase(it.value());
+            m_index.erase(it);
+        }
+    }
+
+    void clear()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_clearedAt = ++m_changeCount;
+        m_index.clear();
+        m_entries.clear();
+    }
+
+    // Called before a missing value is read. Returned ticket is passed to endFill()
+    quint64 beginFill()
+    {
+        QMutexLocker locker(&m_mutex);
+        ++m_fillCount;
+        return m_changeCount;
+    }
+
+    // Caches the read value unless the key was changed or the cache was cleared since beginFill().
+    // Must be called for every beginFill(), with an empty value if nothing was read
+    void endFill(const Key &key, const Optional<Value> &value, quint64 ticket)
+    {
+        QMutexLocker locker(&m_mutex);
+        const bool changed = m_changes.value(key, 0) > ticket || m_clearedAt > ticket;
+        if (value && !changed && !m_index.contains(key)) {
+            insertLocked(key, *value);
+        }
+        if (--m_fillCount == 0) {
+            m_changes.clear();
+        }
+    }
+
+private:
+    using Entries = std::list<std::pair<Key, Value>>;
+
+    void insertLocked(const Key &key, const Value &value)
+    {
+        const auto it = m_index.constFind(key);
+        if (it != m_index.constEnd()) {
+            it.value()->second = value;
+            m_entries.splice(m_entries.begin(), m_entries, it.value());
+            return;
+        }
+        m_entries.emplace_front(key, value);
+        m_index.insert(key, m_entries.begin());
+        if (m_index.size() > m_capacity) {
+            m_index.remove(m_entries.back().first);
+            m_entries.pop_back();
+        }
+    }
+
+    // Changes are tracked only while values are filled
+    void markChanged(const Key &key)
+    {
+        ++m_changeCount;
+        if (m_fillCount > 0) {
+            m_changes.insert(key, m_changeCount);
+        }
+    }
+
+    const int m_capacity;
+    QMutex m_mutex;
+    // Most recently used entry is the first
+    Entries m_entries;
+    QHash<Key, typename Entries::iterator> m_index;
+    // Counter of changes, tickets of fills are its values
+    quint64 m_changeCount = 0;
+    quint64 m_clearedAt = 0;
+    int m_fillCount = 0;
+    // Key => counter value of its last change, kept while fills are in progress
+    QHash<Key, quint64> m_changes;
+};
+
+#endif // VSQ_LRUCACHE_H
@@ -0,0 +1,74 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_MESSAGEENVELOPE_H
+#define VSQ_MESSAGEENVELOPE_H
+
+#include <QByteArray>
+
+#include "VSQCommon.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcMessageEnvelope);
+
+// Plaintext layout of a message before encryption.
+// Peers of older versions understand JSON only. Newer peers advertise CBOR support in every message,
+// so CBOR is sent to a peer once every known device of the peer and of the user advertised it.
+// Big CBOR envelopes are compressed and wrapped into an outer map with the compressed flag
+class VSQMessageEnvelope
+{
+public:
+    enum class Format
+    {
+        Json,
+        Cbor
+    };
+
+    // Version of CBOR envelope, readers ignore unknown keys of newer versions
+    static const int kCborVersion = 1;
+
+    // Encodes text and attachment of the message
+    static QByteArray encode(const StMessage &message, Format format);
+
+    // Decodes text and attachment of the message. Format understood by the sender is written to peerFormat
+    static Optional<StMessage> decode(const QByteArray &bytes, Format *peerFormat = nullptr);
+
+private:
+    static QByteArray encodeJson(const StMessage &message);
+    static QByteArray encodeCbor(const StMessage &message);
+    static Optional<StMessage> decodeJson(const QByteArray &bytes, Format *peerFormat);
+    static QByteArray compressCbor(const QByteArray &bytes);
+    static Optional<StMessage> decodeCbor(const QByteArray &bytes, bool allowCompressed = true);
+};
+
+#endif // VSQ_MESSAGEENVELOPE_H
@@ -48,8 +48,18 @@
 
 #include <virgil/iot/messenger/messenger.h>
 
+#include "VSQConnectionManager.h"
+#include "VSQCryptoBufferPool.h"
+#include "VSQHistorySync.h"
+#include "VSQMessageEnvelope.h"
+#include "VSQOutbox.h"
+#include "VSQPeerCapabilities.h"
+#include "VSQReceivePipeline.h"
 #include "VSQSqlConversationModel.h"
 #include "VSQSqlChatModel.h"
+#include "VSQSqlSearchModel.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
 #include "VSQLogging.h"
 #include <VSQNetworkAnalyzer.h>
 #include <VSQAttachmentBuilder.h>
@@ -93,6 +103,7 @@ public:
     };
 
     Q_PROPERTY(QString currentUser READ currentUser NOTIFY fireCurrentUserChanged)
+    Q_PROPERTY(VSQHistorySync *historySync READ historySync CONSTANT)
 
     VSQMessenger(QNetworkAccessManager *networkAccessManager, VSQSettings *settings);
     VSQMessenger() = default; // QML engine requires default constructor
@@ -103,8 +114,12 @@ public:
 
     VSQSqlConversationModel &modelConversations();
     VSQSqlChatModel &getChatModel();
+    VSQSqlSearchModel &getSearchModel();
+    // Progress of server history sync
+    VSQHistorySync *historySync() const;
 
-    Optional<StMessage> decryptMessage(const QString &sender, const QString &message);
+    // Thread-safe. Envelope format of the sender device is learned if the device is known
+    Optional<StMessage> decryptMessage(const QString &sender, const QString &device, const QString &message);
 
 public slots:
 
@@ -199,6 +214,8 @@ private slots:
     void onDisconnected();
     void onError(QXmppClient::Error);
     void onMessageReceived(const QXmppMessage &message);
+    void onMessagesDecrypted(const QList<StMessage> &messages);
+    void onHistoryReceived(const QList<StMessage> &messages);
     void onPresenceReceived(const QXmppPresence &presence);
     void onIqReceived(const QXmppIq &iq);
     void onSslErrors(const QList<QSslError> &errors);
@@ -207,8 +224,8 @@ private slots:
     void onReadyToUpload();
     void onAddContactToDB(QString contact);
     void onDownloadThumbnail(const StMessage message, const QString sender);
-    void onAttachmentStatusChanged(const QString &uploadId, const Enums::AttachmentStatus status);
-    void onAttachmentProgressChanged(const QString &uploadId, const DataSize bytesReceived, const DataSize bytesTotal);
+    void onAttachmentStatusChanged(const TransferId &id, const Enums::AttachmentStatus status);
+    void onAttachmentProgressChanged(const TransferId &id, const DataSize bytesReceived, const DataSize bytesTotal);
     void onAttachmentDecrypted(const QString &uploadId, const QString &filePath);
 
     Q_INVOKABLE void onSubscribePushNotifications(bool enable);
@@ -218,16 +235,25 @@ private:
     QXmppMessageReceiptManager* m_xmppReceiptManager;
     QXmppCarbonManager* m_xmppCarbonManager;
     VSQDiscoveryManager* m_xmppDiscoveryManager;
+    VSQStorage *m_storage = nullptr;
     VSQSqlConversationModel *m_sqlConversations;
     VSQSqlChatModel *m_sqlChatModel;
+    VSQSqlSearchModel *m_sqlSearchModel;
+    VSQOutbox *m_outbox = nullptr;
+    VSQConnectionManager *m_connection = nullptr;
+    VSQReceivePipeline *m_receivePipeline = nullptr;
+    VSQHistorySync *m_historySync = nullptr;
     VSQLogging *m_logging;
     VSQNetworkAnalyzer m_networkAnalyzer;
     VSQSettings *m_settings;
     VSQCryptoTransferManager *m_transferManager;
     VSQAttachmentBuilder m_attachmentBuilder;
+    // Buffers of message encryption and decryption, shared by worker threads
+    VSQCryptoBufferPool m_cryptoBuffers;
+    VSQPeerCapabilities *m_peerCapabilities = nullptr;
+    // Set at destruction, worker threads stop waiting for the messenger thread
+    QAtomicInt m_stopping;
 
-    QMutex m_connectGuard;
-    QMutex m_messageGuard;
     QString m_user;
     QString m_userId;
     QString m_deviceId;
@@ -249,14 +275,16 @@ private:
     static const QString kPushNotificationsDeviceID;
     static const QString kPushNotificationsFormType;
     static const QString kPushNotificationsFormTypeVal;
+    // Upper bound of the first connection attempt made at sign in
     static const int kConnectionWaitMs;
     static const int kKeepAliveTimeSec;
+    static const int kStopPollIntervalMs;
 
     void
     _connectToDatabase();
 
     bool
-    _connect(QString userWithEnv, QString deviceId, QString userId, bool forced = false);
+    _connect(QString userWithEnv, QString deviceId, QString userId);
 
     QString
     _xmppPass();
@@ -288,20 +316,35 @@ private:
     QString
     _prepareLogin(const QString &user);
 
+    // Called by login in background. Migrates storage of the user, then switches models
+    // to the user in the GUI thread
+    void
+    _loadUser(const QString &userId);
+
     QString
     _caBundleFile();
 
-    void _sendFailedMessages();
+    OptionalAttachment uploadAttachment(const QString messageId, const QString recipient, const Attachment &attachment);
+    void setFailedAttachmentStatus(const QString &messageId);
+
+    // Saves a new message and queues it to the outbox
+    VSQMessenger::EnResult _queueMessage(const QString &messageId, const QString &to, const QString &message,
+                                         const OptionalAttachment &attachment);
 
-    QString createJson(const QString &message, const OptionalAttachment &attachment);
+    // Uploads attachment, encrypts and sends a queued message. Called by the outbox in a worker thread
+    VSQOutbox::Result _sendQueuedMessage(const QString &messageId);
 
-    StMessage parseJson(const QJsonDocument &json);
+    // Encrypts message for the recipient. Thread-safe, library calls are serialized
+    Optional<QString> _encryptMessage(const QString &recipient, const QByteArray &plaintext);
 
-    OptionalAttachment uploadAttachment(const QString messageId, const QString recipient, const Attachment &attachment);
-    void setFailedAttachmentStatus(const QString &messageId);
+    // Stores decrypted messages received live or from the archive, the system is informed if notify is true
+    void _ingestMessages(const QList<StMessage> &messages, bool notify);
+
+    // Hands the packet to XMPP client in its thread, blocks until it's written or messenger stops
+    bool _sendPacket(const QXmppMessage &packet);
 
-    VSQMessenger::EnResult _sendMessageInternal(bool createNew, const QString &messageId, const QString &to, const QString &message,
-                                                const OptionalAttachment &attachment);
+    // Runs event loop of a worker thread until it's quit or messenger stops
+    void _execWorkerLoop(QEventLoop &loop);
 
     using Function = std::function<void (const StMessage &message)>;
     void downloadAndProcess(StMessage message, const Function &func);
@@ -0,0 +1,151 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_OUTBOX_H
+#define VSQ_OUTBOX_H
+
+#include <QHash>
+#include <QObject>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVector>
+
+#include <deque>
+#include <functional>
+
+#include "VSQCommon.h"
+
+class VSQSqlConversationModel;
+class VSQSqlWriteQueue;
+class VSQStorage;
+
+Q_DECLARE_LOGGING_CATEGORY(lcOutbox);
+
+// Persistent queue of outgoing messages.
+// Every recipient has two lanes, text messages and messages with attachments. Messages of a lane are sent
+// one at a time and in order, the text lane goes first when both are ready, so a text can overtake an earlier
+// attachment. Different recipients and lanes are sent to concurrently, but their encryption takes turns
+// under the Virgil library lock, see bench_outbox_scaling.
+// Failed lane is retried with exponential backoff of its own, so a failing attachment doesn't hold text
+// messages, all lanes are retried when messenger is online again. Message that failed too many times is
+// marked as failed and parked, so it doesn't hold its lane. It stays in the outbox, parked messages are
+// queued again when messenger is online again and when the user is loaded
+class VSQOutbox : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum class Priority
+    {
+        Text,
+        Attachment
+    };
+
+    enum class Result
+    {
+        Sent,
+        // Message is retried later
+        Failed,
+        // Message can't be sent, it's removed from the outbox
+        Dropped
+    };
+
+    // Sends message with a given id. Called in a worker thread.
+    // Must not wait for the outbox thread once the outbox is being destroyed
+    using Sender = std::function<Result (const QString &messageId)>;
+
+    VSQOutbox(VSQStorage *storage, VSQSqlConversationModel *conversations, const Sender &sender, QObject *parent);
+    ~VSQOutbox() override;
+
+    // Loads queued messages of the user. Unsent messages of older versions are queued by migration
+    void setUser(const QString &user);
+
+    // Thread-safe
+    void enqueue(const QString &messageId, const QString &recipient, Priority priority);
+
+    // Messages are sent only while online, going online retries all recipients
+    void setOnline(bool online);
+
+private:
+    struct Lane
+    {
+        std::deque<QString> messageIds;
+        bool inFlight = false;
+        // Failures in a row, reset when messenger is online again
+        int failureCount = 0;
+        // Failed attempts of the first message
+        int attemptCount = 0;
+        // UTC epoch milliseconds
+        qint64 nextAttemptTime = 0;
+        // Lane that was served earlier is preferred
+        quint64 servedSequence = 0;
+    };
+
+    struct Recipient
+    {
+        // Lanes by priority
+        Lane lanes[2];
+    };
+
+    struct ParkedMessage
+    {
+        QString messageId;
+        QString recipient;
+        int laneIndex = 0;
+    };
+
+    QString tableName() const;
+    void schedule();
+    void start(const QString &recipient, int laneIndex);
+    void onSendFinished(int generation, const QString &recipient, int laneIndex, const QString &messageId, Result result);
+    static qint64 retryDelay(int failureCount);
+
+    VSQStorage *m_storage;
+    VSQSqlWriteQueue *m_writeQueue;
+    VSQSqlConversationModel *m_conversations;
+    Sender m_sender;
+    QString m_user;
+    bool m_online = false;
+    // Results of sends started for another user are ignored
+    int m_generation = 0;
+    int m_inFlightCount = 0;
+    quint64 m_servedSequence = 0;
+    QHash<QString, Recipient> m_recipients;
+    // Messages that failed too many times, in order of parking
+    QVector<ParkedMessage> m_parkedMessages;
+    QTimer m_retryTimer;
+    QThreadPool m_pool;
+};
+
+#endif // VSQ_OUTBOX_H
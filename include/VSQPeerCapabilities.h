@@ -0,0 +1,86 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_PEERCAPABILITIES_H
+#define VSQ_PEERCAPABILITIES_H
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+
+#include "VSQMessageEnvelope.h"
+
+class VSQSqlWriteQueue;
+class VSQStorage;
+
+// Envelope formats understood by devices of peers, learned from received messages and stored per user.
+// Message to a peer reaches every device of the peer and, through carbons, other devices of the user,
+// so CBOR is sent only when all devices of both that were seen recently advertise it.
+// Devices are XMPP resources, a device that didn't send anything for a while is forgotten
+class VSQPeerCapabilities : public QObject
+{
+    Q_OBJECT
+
+public:
+    VSQPeerCapabilities(VSQStorage *storage, QObject *parent);
+
+    void setUser(const QString &user);
+
+    // Thread-safe. JSON is used unless every known device of the peer and of the user advertised CBOR
+    VSQMessageEnvelope::Format envelopeFormat(const QString &peer) const;
+    // Thread-safe. Records format of a device that sent a message
+    void setEnvelopeFormat(const QString &peer, const QString &device, VSQMessageEnvelope::Format format);
+
+private:
+    struct Device
+    {
+        VSQMessageEnvelope::Format format = VSQMessageEnvelope::Format::Json;
+        // Seconds since epoch
+        qint64 seenAt = 0;
+    };
+    using Devices = QHash<QString, Device>;
+
+    // Devices that weren't seen for too long aren't taken into account
+    static bool understandCbor(const Devices &devices, qint64 now, bool withoutDevices);
+    QString tableName() const;
+
+    VSQStorage *m_storage;
+    VSQSqlWriteQueue *m_writeQueue;
+    QString m_user;
+    mutable QMutex m_mutex;
+    // Devices by peer, including devices of the user
+    QHash<QString, Devices> m_devices;
+};
+
+#endif // VSQ_PEERCAPABILITIES_H
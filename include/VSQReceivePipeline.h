@@ -0,0 +1,96 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_RECEIVE_PIPELINE_H
+#define VSQ_RECEIVE_PIPELINE_H
+
+#include <QHash>
+#include <QMap>
+#include <QObject>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <functional>
+
+#include "VSQCommon.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcReceivePipeline);
+
+// Decrypts incoming messages in worker threads, one per core.
+// Messages of a sender are delivered in order of arrival, even if a later one is decrypted first.
+// Delivered messages are collected into batches, so a burst of messages updates models once
+class VSQReceivePipeline : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Decrypts message body. Called in a worker thread, so it must be thread-safe.
+    // Device is the XMPP resource of the sender, it's empty if unknown
+    using Decryptor = std::function<Optional<StMessage> (const QString &sender, const QString &device, const QString &body)>;
+
+    VSQReceivePipeline(const Decryptor &decryptor, QObject *parent);
+    ~VSQReceivePipeline() override;
+
+    void submit(const QString &messageId, const QString &sender, const QString &device, const QString &recipient,
+                const QString &body);
+
+    // Drops submitted and undelivered messages, e.g. when user is changed
+    void reset();
+
+signals:
+    // Decrypted messages with id, sender and recipient. Messages that can't be decrypted are skipped
+    void received(const QList<StMessage> &messages);
+
+private:
+    struct Sender
+    {
+        quint64 nextSequence = 0;
+        quint64 deliveredSequence = 0;
+        // Decrypted messages waiting for earlier ones, null if decryption failed
+        QMap<quint64, Optional<StMessage>> completed;
+    };
+
+    void onDecrypted(int generation, const QString &sender, quint64 sequence, const Optional<StMessage> &message);
+    void flush();
+
+    Decryptor m_decryptor;
+    // Results of messages submitted before reset are ignored
+    int m_generation = 0;
+    QHash<QString, Sender> m_senders;
+    QList<StMessage> m_batch;
+    QTimer m_flushTimer;
+    QThreadPool m_pool;
+};
+
+#endif // VSQ_RECEIVE_PIPELINE_H
@@ -35,17 +35,36 @@
 #ifndef VIRGIL_IOTKIT_QT_SQL_CHAT_MODEL_H
 #define VIRGIL_IOTKIT_QT_SQL_CHAT_MODEL_H
 
-#include <QSqlTableModel>
+#include <QAbstractListModel>
+#include <QHash>
+#include <QVector>
 
-class VSQSqlChatModel : public QSqlTableModel {
+class VSQSqlWriteQueue;
+class VSQStorage;
+
+// Chat list is kept in memory and ordered by the last message time.
+// Changes are applied to the loaded rows and written behind through the write queue
+class VSQSqlChatModel : public QAbstractListModel {
     Q_OBJECT
 
+    enum Roles
+    {
+        IdRole = Qt::UserRole,
+        NameRole,
+        LastMessageRole,
+        LastMessageTimeRole,
+        UnreadMessageCountRole
+    };
+
 public:
-    VSQSqlChatModel(QObject *parent = nullptr);
+    VSQSqlChatModel(VSQStorage *storage, QObject *parent = nullptr);
 
     void
     init(const QString &userId);
 
+    int
+    rowCount(const QModelIndex &parent = QModelIndex()) const override;
+
     QVariant
     data(const QModelIndex &index, int role) const override;
 
@@ -55,8 +74,17 @@ public:
     void
     createPrivateChat(const QString &recipientId);
 
+    // Called for messages received while chat isn't opened
+    void
+    incrementUnreadMessageCount(const QString &chatId, int count = 1);
+
+    // Marks all received messages of the chat as read
     Q_INVOKABLE void
-    updateUnreadMessageCount(QString chatId);
+    resetUnreadMessageCount(const QString &chatId);
+
+    // Recalculates unread message counts from messages received after the last read cursor
+    Q_INVOKABLE void
+    reconcileUnreadMessageCounts();
 
     Q_INVOKABLE void
     applyFilter(const QString &filter);
@@ -71,10 +99,44 @@ signals:
     void updateLastMessage(QString chatId, QString message);
 
 private:
-    void onUpdateLastMessage(QString chatId, QString message);
+    struct Chat
+    {
+        qint64 id = 0;
+        QString name;
+        QString lastMessage;
+        // UTC epoch milliseconds, 0 if chat has no messages
+        qint64 lastMessageTime = 0;
+        int unreadMessageCount = 0;
+    };
 
+    void onUpdateLastMessage(QString chatId, QString message);
+    void onFlushed();
+
+    // Reads chats matching the filter, newest first. Reading is postponed until
+    // queued mutations are written, loaded rows are kept meanwhile
+    void _load();
+    void _read();
+    // Chat mutation that is queued while reading is postponed
+    void _queued();
+    bool _matchesFilter(const QString &name) const;
+    // Returns row of the loaded chat or -1
+    int _findRow(const QString &name) const;
+    void _moveToTop(int row);
+    void _emitRowChanged(int row, const QVector<int> &roles);
+    QString _conversationsTableName() const;
+    QString _quotedTableName() const;
+
+    VSQStorage *m_storage;
+    VSQSqlWriteQueue *m_writeQueue;
     QString m_userId;
     QString m_tableName;
+    QString m_filter;
+    QVector<Chat> m_chats;
+    // name => row in m_chats
+    QHash<QString, int> m_rows;
+    qint64 m_lastId = 0;
+    // Sequence number of the write queue that postponed reading waits for, 0 if reading isn't postponed
+    quint64 m_loadSequence = 0;
 };
 
 #endif // VIRGIL_IOTKIT_QT_SQL_CHAT_MODEL_H
@@ -35,13 +35,24 @@
 #ifndef VIRGIL_IOTKIT_QT_SQL_CONVERSATION_MODEL_H
 #define VIRGIL_IOTKIT_QT_SQL_CONVERSATION_MODEL_H
 
-#include <QSqlTableModel>
+#include <QAbstractListModel>
+#include <QDate>
+#include <QMutex>
+#include <QSet>
+#include <QSqlRecord>
+#include <QVector>
 
 #include "VSQCommon.h"
+#include "VSQConversationRows.h"
+#include "VSQFilePresenceCache.h"
+#include "VSQLruCache.h"
 
 class VSQCryptoTransferManager;
+class VSQSettings;
+class VSQSqlWriteQueue;
+class VSQStorage;
 
-class VSQSqlConversationModel : public QSqlTableModel
+class VSQSqlConversationModel : public QAbstractListModel
 {
     Q_OBJECT
     Q_PROPERTY(QString recipient READ recipient WRITE setRecipient NOTIFY recipientChanged)
@@ -75,7 +86,7 @@ class VSQSqlConversationModel : public QSqlTableModel
     };
 
 public:
-    VSQSqlConversationModel(QObject *parent = nullptr);
+    VSQSqlConversationModel(VSQStorage *storage, VSQSettings *settings, QObject *parent = nullptr);
 
     QString
     user() const;
@@ -83,6 +94,11 @@ public:
     Q_INVOKABLE void
     setUser(const QString &user);
 
+    // Migrates tables of the user. Blocks until they are written, can be called from any thread.
+    // Login migrates in background, so setUser() finds the tables up to date
+    bool
+    migrate(const QString &user) const;
+
     Q_INVOKABLE int
     getCountOfUnread(const QString &user);
 
@@ -98,9 +114,30 @@ public:
     Q_INVOKABLE void
     setRecipient(const QString &recipient);
 
+    int
+    rowCount(const QModelIndex &parent = QModelIndex()) const override;
+
     QVariant
     data(const QModelIndex &index, int role) const override;
 
+    bool
+    canFetchMore(const QModelIndex &parent) const override;
+
+    void
+    fetchMore(const QModelIndex &parent) override;
+
+    // Older history for the view, independent of how QML passes the root index
+    Q_INVOKABLE bool
+    hasOlderRows() const;
+
+    Q_INVOKABLE void
+    fetchOlderRows();
+
+    // Drops loaded history above the newest page (plus a prefetch margin).
+    // Called when the view returns to the latest messages.
+    Q_INVOKABLE void
+    releaseOlderRows();
+
     QHash<int, QByteArray>
     roleNames() const override;
 
@@ -110,14 +147,23 @@ public:
     int
     getMessageCount(const QString &user, const StMessage::Status status);
 
-    QList<StMessage> getMessages(const QString &user, const StMessage::Status status);
+    // Returns ids of stored messages among the given ones. Can be called from any thread
+    QSet<QString> existingMessageIds(const QStringList &messageIds) const;
 
     Optional<StMessage> getMessage(const QString &messageId) const;
     StMessage getMessage(const QSqlRecord &record) const;
 
+    QString tableName() const;
+    QString attachmentsTableName() const;
+    // Full-text index of messages, empty if search is not available
+    QString searchTableName() const;
+
 signals:
     void createMessage(const QString recipient, const QString message, const QString messageId, const OptionalAttachment attachment);
     void receiveMessage(const QString messageId, const QString author, const QString message, const OptionalAttachment attachment);
+    // Messages received at once, the opened conversation is notified once.
+    // Messages of the user are ones sent by other clients, they are stored as sent
+    void receiveMessages(const QList<StMessage> messages);
     void setMessageStatus(const QString messageId, const StMessage::Status status);
     void setAttachmentFilePath(const QString &messageId, const QString &filePath);
     void setAttachmentProgress(const QString &messageId, const DataSize bytesReceived, const DataSize bytesTotal);
@@ -136,11 +182,69 @@ private:
         Attachment::Status status = Attachment::Status::Loading;
     };
 
-    QString escapedUserName() const;
+    // Queued mutations of a message that readers don't see yet
+    struct UnwrittenMessage
+    {
+        // Sequence number of the last mutation in the write queue
+        quint64 sequence = 0;
+        // Inserted row
+        Optional<VSQConversationRows::RowData> row;
+        // Updated columns of the messages and attachments tables
+        QVariantMap values;
+    };
+
+    // Queued marking of received messages of the author as read
+    struct UnwrittenRead
+    {
+        quint64 sequence = 0;
+        // Messages inserted later are not marked
+        qint64 lastRowId = 0;
+    };
+
+    struct Unwritten
+    {
+        // Message id => mutations
+        QHash<QString, UnwrittenMessage> messages;
+        // Author => marking
+        QHash<QString, UnwrittenRead> reads;
+    };
 
+    // Derived roles of a loaded row, computed when rows are loaded or appended
+    struct Grouping
+    {
+        QDate day;
+        bool firstInRow = true;
+        bool inRow = false;
+    };
+
+    VSQStorage *m_storage;
+    VSQSqlWriteQueue *m_writeQueue;
     QString m_user;
     QString m_recipient;
     std::map<QString, TransferInfo> m_transferMap;
+    // Loaded window of the conversation. Rows are ordered by (timestamp, rowid)
+    VSQConversationRows m_rows;
+    // Same size as m_rows
+    QVector<Grouping> m_grouping;
+    // message_id => absolute position, row = position - m_firstPosition
+    QHash<QString, qint64> m_positions;
+    qint64 m_firstPosition = 0;
+    QSqlRecord m_recordTemplate;
+    bool m_hasOlderRows = false;
+    qint64 m_lastRowId = 0;
+    bool m_searchAvailable = false;
+    // Attachments are being moved from the messages table to the attachments table
+    bool m_attachmentsPending = false;
+    // Presence of attachment files by message id
+    mutable VSQFilePresenceCache m_filePresence;
+    // Recently used messages by message id, mutations are written through
+    mutable VSQLruCache<QString, StMessage> m_messageCache;
+    // Message ids of attachment insertions rejected by the current write batch
+    QSet<QString> m_rejectedAttachments;
+    // Reads don't wait for the write queue, queued mutations are applied to read rows instead.
+    // Entries are dropped when the write queue has written them
+    mutable QMutex m_unwrittenMutex;
+    Unwritten m_unwritten;
 
     void
     _createTable();
@@ -151,11 +255,119 @@ private:
     QString
     _tableName() const;
 
+    static QString
+    _tableName(const QString &user);
+
+    static QString
+    _contactsTableName(const QString &user);
+
     QString
-    _contactsTableName() const;
+    _attachmentsTableName() const;
+
+    static QString
+    _attachmentsTableName(const QString &user);
+
+    // Selects rowid and columns of messages joined with attachments, to be followed by a WHERE clause
+    QString
+    _selectMessagesQuery() const;
+
+    QString
+    _searchTableName() const;
+
+    bool
+    _createSearchIndex();
+
+    // Reads a row from a query or a record, the first column of the messages table is at offset
+    template <class Values>
+    static VSQConversationRows::RowData
+    _readRow(qint64 rowId, const Values &values, int offset);
+
+    // Selects rows older than the first loaded row if before is true, otherwise the newest rows
+    VSQConversationRows::RowsData
+    _selectPage(bool before, int limit) const;
+
+    // Selects stored rows of the given messages, unwritten mutations aren't applied
+    QHash<QString, VSQConversationRows::RowData>
+    _selectRows(const QStringList &messageIds) const;
+
+    // Newest message sent to the recipient, unwritten rows included
+    Optional<VSQConversationRows::RowData>
+    _selectLastRow(const QString &recipient) const;
+
+    // Copy of unwritten mutations. It's taken before rows are read, so written mutations aren't missed
+    Unwritten
+    _unwrittenMutations() const;
+
+    void
+    _addUnwrittenMutation(const QString &messageId, const Optional<VSQConversationRows::RowData> &row,
+                          const QVariantMap &values);
+
+    void
+    _dropWrittenMutations();
+
+    // Applies unwritten markings as read and updates to the read row
+    static void
+    _applyUnwritten(const Unwritten &unwritten, VSQConversationRows::RowData &row);
+
+    static void
+    _applyUnwrittenReads(const Unwritten &unwritten, VSQConversationRows::RowData &row);
+
+    static StMessage
+    _messageFromRow(const VSQConversationRows::RowData &row);
+
+    void
+    _resetWindow();
+
+    bool
+    _isCurrentConversation(const QString &author, const QString &recipient) const;
+
+    // Zero timestamp is the current time
+    QSqlRecord
+    _createRecord(const QString &author, const QString &recipient, const QString &messageId, const QString &message,
+                  StMessage::Status status, const OptionalAttachment &attachment, qint64 timestamp = 0) const;
+
+    bool
+    _insertMessage(const QSqlRecord &record);
+
+    // Returns count of inserted messages. Rows of the opened conversation are appended at once,
+    // the window is reloaded if any of them is older than the last loaded row
+    int
+    _insertMessages(const QVector<QSqlRecord> &records);
+
+    void
+    _updateMessage(const QString &messageId, const QString &column, const QVariant &value);
+
+    void
+    _updateAttachment(const QString &messageId, const QString &column, const QVariant &value);
+
+    void
+    _indexRows(int first, int last);
+
+    // Recalculates grouping of rows [first, last], out of range rows are skipped
+    void
+    _updateGrouping(int first, int last);
+
+    void
+    _checkFilePresence(int first, int last);
+
+    int
+    _findRow(const QString &messageId) const;
+
+    void
+    _setCachedValue(const QString &messageId, int role, const QVariant &value, const QVector<int> &roles = {});
+
+    void
+    _emitRowChanged(const QString &messageId, const QVector<int> &roles);
+
+    template <class Function>
+    void
+    _updateCachedAttachment(const QString &messageId, Function function);
 
     void onCreateMessage(const QString recipient, const QString message, const QString messageId, const OptionalAttachment attachment);
     void onReceiveMessage(const QString messageId, const QString author, const QString message, const OptionalAttachment attachment);
+    void onReceiveMessages(const QList<StMessage> messages);
+    // Rejected insertion of a message, the model and the cache drop it
+    void onInsertFailed(const QString &table, const QVariantMap &values);
     void onSetMessageStatus(const QString messageId, const StMessage::Status status);
     void onSetAttachmentStatus(const QString messageId, const Enums::AttachmentStatus status);
     void onSetAttachmentFilePath(const QString messageId, const QString filePath);
@@ -0,0 +1,78 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_SQLMIGRATOR_H
+#define VSQ_SQLMIGRATOR_H
+
+#include <QMap>
+#include <QStringList>
+
+#include "VSQCommon.h"
+#include "VSQSqlWriteQueue.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcSqlMigrator);
+
+// Versioned schema of a table.
+// Version of every table is stored in the SchemaVersions table, steps newer than the stored
+// version are applied in order, in a single savepoint. Long data copies are split into batches
+// that are written in the background, between other queued mutations.
+class VSQSqlMigrator
+{
+public:
+    using Step = VSQSqlWriteQueue::Function;
+
+    VSQSqlMigrator(VSQSqlWriteQueue *writeQueue, const QString &table);
+
+    void addStep(int version, const QStringList &statements);
+    void addStep(int version, const Step &step);
+
+    // Applies steps newer than the stored version. Blocks until they are written
+    bool migrate();
+
+    // Queues batch statements repeatedly, one batch per write transaction, while the last of them
+    // changes rows. Then runs finish statements and calls finished in the queue thread
+    static void runBatches(VSQSqlWriteQueue *writeQueue, const QStringList &batchStatements,
+                           const QStringList &finishStatements, const std::function<void ()> &finished = {});
+
+    static bool execStatements(QSqlDatabase &database, const QStringList &statements, int *lastRowsAffected = nullptr);
+
+private:
+    bool applySteps(QSqlDatabase &database);
+
+    VSQSqlWriteQueue *m_writeQueue;
+    const QString m_table;
+    QMap<int, Step> m_steps;
+};
+
+#endif // VSQ_SQLMIGRATOR_H
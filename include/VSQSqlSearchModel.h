@@ -0,0 +1,125 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_SQLSEARCHMODEL_H
+#define VSQ_SQLSEARCHMODEL_H
+
+#include <QAbstractListModel>
+#include <QDateTime>
+#include <QTimer>
+#include <QVector>
+
+#include "VSQCommon.h"
+
+class VSQSqlConversationModel;
+class VSQStorage;
+
+Q_DECLARE_LOGGING_CATEGORY(lcSqlSearch);
+
+// Ranked full-text search over messages of the current user.
+// Results are loaded page by page, queries run in the thread pool on read-only connections.
+class VSQSqlSearchModel : public QAbstractListModel
+{
+    Q_OBJECT
+    Q_PROPERTY(QString query READ query WRITE setQuery NOTIFY queryChanged)
+    Q_PROPERTY(bool searching READ searching NOTIFY searchingChanged)
+
+public:
+    enum Roles
+    {
+        MessageIdRole = Qt::UserRole,
+        ChatRole,
+        SnippetRole,
+        TimestampRole
+    };
+
+    VSQSqlSearchModel(VSQStorage *storage, VSQSqlConversationModel *conversations, QObject *parent = nullptr);
+
+    QString query() const;
+    void setQuery(const QString &query);
+
+    bool searching() const;
+
+    Q_INVOKABLE void clear();
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
+
+signals:
+    void queryChanged(const QString &query);
+    void searchingChanged(bool searching);
+
+private:
+    struct Result
+    {
+        QString messageId;
+        QString chat;
+        // Rich text with highlighted matches
+        QString snippet;
+        QDateTime timestamp;
+    };
+    using Results = QVector<Result>;
+
+    struct Request
+    {
+        QString user;
+        QString table;
+        QString searchTable;
+        QString matchExpression;
+        int offset = 0;
+    };
+
+    void loadPage();
+    void setSearching(bool searching);
+    void onPageLoaded(quint64 generation, const Results &results);
+
+    static QString toMatchExpression(const QString &query);
+    static Results selectPage(VSQStorage *storage, const Request &request);
+
+    VSQStorage *m_storage;
+    VSQSqlConversationModel *m_conversations;
+    QString m_query;
+    Results m_results;
+    QTimer m_debounceTimer;
+    bool m_hasMoreResults = false;
+    bool m_searching = false;
+    // Incremented by every new query, results of outdated queries are dropped
+    quint64 m_generation = 0;
+};
+
+#endif // VSQ_SQLSEARCHMODEL_H
@@ -0,0 +1,78 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_SQLSTATEMENTCACHE_H
+#define VSQ_SQLSTATEMENTCACHE_H
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include <list>
+#include <utility>
+
+// Cache of prepared queries of a single database connection.
+// Statement is parsed and planned once, then reused with new bound values.
+// Cache is bounded, least recently used query is finalized first.
+// Must be used from the thread that owns the connection.
+class VSQSqlStatementCache
+{
+public:
+    explicit VSQSqlStatementCache(const QString &connectionName = QLatin1String(QSqlDatabase::defaultConnection));
+    ~VSQSqlStatementCache();
+
+    // Returns query prepared for the statement with positional values bound.
+    // Query is implicitly shared with the cache, so it stays valid if other statements evict it
+    QSqlQuery query(const QString &statement, const QVariantList &bindValues = {});
+
+    // Releases results of all queries, e.g. before the connection is used by another thread
+    void finishAll();
+
+    void clear();
+
+    QString connectionName() const;
+
+private:
+    Q_DISABLE_COPY(VSQSqlStatementCache)
+
+    using Entries = std::list<std::pair<QString, QSqlQuery>>;
+
+    const QString m_connectionName;
+    // Most recently used query is the first
+    Entries m_entries;
+    QHash<QString, Entries::iterator> m_index;
+};
+
+#endif // VSQ_SQLSTATEMENTCACHE_H
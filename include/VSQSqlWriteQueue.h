@@ -0,0 +1,138 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_SQLWRITEQUEUE_H
+#define VSQ_SQLWRITEQUEUE_H
+
+#include <QAtomicInteger>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QSqlDatabase>
+#include <QTimer>
+#include <QVariant>
+#include <QVector>
+
+#include <functional>
+
+#include "VSQCommon.h"
+#include "VSQSqlStatementCache.h"
+
+Q_DECLARE_LOGGING_CATEGORY(lcSqlWriteQueue);
+
+// Write-behind queue for table mutations.
+// Mutations are collected and written in a single transaction per flush interval or batch size.
+// Repeated inserts/updates of the same row (table + key) are merged before flushing.
+// Each mutation is atomic, a failed one is rolled back alone and the rest of the batch is committed.
+class VSQSqlWriteQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Custom write on the queue connection. Returns false on failure
+    using Function = std::function<bool (QSqlDatabase &database)>;
+
+    explicit VSQSqlWriteQueue(const QString &connectionName = QLatin1String(QSqlDatabase::defaultConnection),
+                              QObject *parent = nullptr);
+    ~VSQSqlWriteQueue() override;
+
+    // Queues insertion of a row identified by values[keyColumn]
+    void insert(const QString &table, const QString &keyColumn, const QVariantMap &values);
+    // Queues update of a row identified by keyColumn = key
+    void update(const QString &table, const QString &keyColumn, const QVariant &key, const QVariantMap &values);
+    // Queues arbitrary statement. Statements are executed in order and never merged
+    void exec(const QString &statement, const QVariantList &bindValues = {});
+    // Queues function that is called in the queue thread. Functions are never merged
+    void call(const Function &function);
+
+    // Writes all queued mutations. Blocks until they are committed.
+    // Returns false if any of them failed
+    bool flush();
+
+    bool hasPending() const;
+
+    // Sequence number of the last queued mutation, numbers start from 1
+    quint64 lastSequence() const;
+    // Mutations up to this sequence number are written or rolled back
+    quint64 writtenSequence() const;
+
+signals:
+    void flushed();
+    // Queued insertion was rolled back, e.g. because of a unique constraint. Emitted in the queue thread
+    void insertFailed(const QString &table, const QVariantMap &values);
+
+private:
+    enum class OperationType
+    {
+        Insert,
+        Update,
+        Statement,
+        Function
+    };
+
+    struct Operation
+    {
+        OperationType type = OperationType::Statement;
+        QString table;
+        QString keyColumn;
+        QVariant key;
+        QVariantMap values;
+        QString statement;
+        QVariantList bindValues;
+        Function function;
+    };
+
+    using Operations = QVector<Operation>;
+
+    void enqueue(const Operation &operation);
+    void scheduleFlush(int pendingCount);
+    bool writePending();
+    bool writeOperation(const Operation &operation);
+    bool execStatement(const QString &statement);
+
+    static QString mergeKey(const QString &table, const QString &keyColumn, const QVariant &key);
+
+    const QString m_connectionName;
+    VSQSqlStatementCache m_statements;
+    QTimer m_timer;
+    mutable QMutex m_mutex;
+    Operations m_operations;
+    // Merge key => index in m_operations. Cleared by statements that are merge barriers
+    QHash<QString, int> m_mergeIndices;
+    bool m_flushScheduled = false;
+    quint64 m_lastSequence = 0;
+    QAtomicInteger<quint64> m_writtenSequence;
+};
+
+#endif // VSQ_SQLWRITEQUEUE_H
@@ -0,0 +1,133 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef VSQ_STORAGE_H
+#define VSQ_STORAGE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QSqlDatabase>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "VSQCommon.h"
+
+class VSQSqlStatementCache;
+class VSQSqlWriteQueue;
+
+Q_DECLARE_LOGGING_CATEGORY(lcStorage);
+
+// SQLite storage service.
+// All writes go through a single writer connection that lives in its own thread,
+// reads use a small pool of read-only connections that are lent to reading threads.
+// Database runs in WAL mode, so readers are never blocked by the writer.
+class VSQStorage : public QObject
+{
+    Q_OBJECT
+
+    struct Connection;
+
+public:
+    // Read-only connection lent from the pool for the lifetime of the object.
+    // Nested readers of a thread share its connection
+    class Reader
+    {
+    public:
+        explicit Reader(VSQStorage *storage);
+        ~Reader();
+
+        QSqlDatabase database() const;
+        // Prepared statements of the connection
+        VSQSqlStatementCache &statements() const;
+
+    private:
+        Q_DISABLE_COPY(Reader)
+
+        VSQStorage *m_storage;
+        Connection *m_connection;
+    };
+
+    explicit VSQStorage(QObject *parent);
+    ~VSQStorage() override;
+
+    bool open(const QString &fileName);
+    void close();
+
+    VSQSqlWriteQueue *writeQueue() const;
+
+    // Read connections are reopened when they are lent next time. Called on open, close and user change
+    void resetReaders();
+
+private:
+    struct Connection
+    {
+        ~Connection();
+
+        QString name;
+        // Handle is kept, because lookup by name is refused while the driver belongs to another thread
+        QSqlDatabase database;
+        VSQSqlStatementCache *statements = nullptr;
+        int generation = 0;
+    };
+
+    struct Lease
+    {
+        Connection *connection = nullptr;
+        int depth = 0;
+    };
+
+    Connection *acquireConnection();
+    void releaseConnection(Connection *connection);
+    void openConnection(Connection *connection, int generation);
+    bool openWriter();
+    void closeWriter();
+
+    QString m_fileName;
+    QThread m_writerThread;
+    VSQSqlWriteQueue *m_writeQueue = nullptr;
+
+    // Guards the file name and the pool
+    mutable QMutex m_readersMutex;
+    QWaitCondition m_connectionReleased;
+    // Connections of older generations are reopened
+    int m_readersGeneration = 0;
+    int m_connectionCount = 0;
+    QVector<Connection *> m_freeConnections;
+    // Connections lent to threads
+    QHash<Qt::HANDLE, Lease> m_leases;
+};
+
+#endif // VSQ_STORAGE_H
@@ -35,6 +35,7 @@
 #ifndef VSQ_TRANSFER_H
 #define VSQ_TRANSFER_H
 
+#include <QElapsedTimer>
 #include <QNetworkReply>
 #include <QObject>
 #include <QMutex>
@@ -45,6 +46,43 @@ class QNetworkAccessManager;
 
 Q_DECLARE_LOGGING_CATEGORY(lcTransferManager);
 
+// Id of a transfer: id of the message and whether the file or its thumbnail is transferred.
+// Transfers keep the string form, the typed value is parsed once per transfer
+struct TransferId
+{
+    enum class Type
+    {
+        File,
+        Thumbnail
+    };
+
+    TransferId() = default;
+    TransferId(const QString &messageId, const Type type)
+        : messageId(messageId)
+        , type(type)
+    {}
+    ~TransferId() = default;
+
+    static TransferId parse(const QString &rawTransferId)
+    {
+        const int separatorPos = rawTransferId.lastIndexOf(QLatin1Char(';'));
+        if (separatorPos < 0) {
+            return TransferId(rawTransferId, Type::File);
+        }
+        const bool isThumbnail = rawTransferId.midRef(separatorPos + 1) == QLatin1String("thumb");
+        return TransferId(rawTransferId.left(separatorPos), isThumbnail ? Type::Thumbnail : Type::File);
+    }
+
+    operator QString() const
+    {
+        return messageId + ((type == Type::Thumbnail) ? QLatin1String(";thumb") : QLatin1String(";file"));
+    }
+
+    QString messageId;
+    Type type = Type::File;
+};
+Q_DECLARE_METATYPE(TransferId)
+
 class VSQTransfer : public QObject
 {
     Q_OBJECT
@@ -54,6 +92,7 @@ public:
     virtual ~VSQTransfer();
 
     QString id() const;
+    TransferId transferId() const;
     bool isRunning() const;
     bool isFailed() const;
 
@@ -63,6 +102,7 @@ public:
     void setStatus(const Attachment::Status status);
 
 signals:
+    // Emitted at most every few frames, the last progress of a transfer is always emitted
     void progressChanged(const DataSize bytesReceived, const DataSize bytesTotal);
     void statusChanged(const Enums::AttachmentStatus status);
     void ended(bool failed);
@@ -70,6 +110,8 @@ signals:
 
 protected:
     QList<QMetaObject::Connection> connectReply(QNetworkReply *reply, QMutex *guard);
+    // Called for every chunk of the reply
+    void updateProgress(const DataSize bytesReceived, const DataSize bytesTotal);
 
     QNetworkAccessManager *networkAccessManager();
     QFile *createFileHandle(const QString &filePath);
@@ -79,9 +121,11 @@ private:
 
     QNetworkAccessManager *m_networkAccessManager;
     QString m_id;
+    TransferId m_transferId;
     Attachment::Status m_status;
     DataSize m_bytesReceived = 0;
     DataSize m_bytesTotal = 0;
+    QElapsedTimer m_progressTimer;
     QFile *m_fileHandle = nullptr;
 };
 
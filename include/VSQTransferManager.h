@@ -69,8 +69,8 @@ public:
     bool hasTransfer(const QString &id) const;
 
 signals:
-    void progressChanged(const QString id, const DataSize bytesReceived, const DataSize bytesTotal);
-    void statusChanged(const QString id, const Enums::AttachmentStatus status);
+    void progressChanged(const TransferId &id, const DataSize bytesReceived, const DataSize bytesTotal);
+    void statusChanged(const TransferId &id, const Enums::AttachmentStatus status);
     void connectionChanged();
     void fireReadyToUpload();
 
@@ -35,6 +35,8 @@
 #ifndef VSQ_UTILS_H
 #define VSQ_UTILS_H
 
+#include <QMutex>
+
 #include "VSQCommon.h"
 
 namespace VSQUtils
@@ -54,6 +56,10 @@ namespace VSQUtils
     QString urlToLocalFile(const QUrl &url);
 
     QUrl localFileToUrl(const QString &filePath);
+
+    // Virgil messenger library keeps global state and isn't thread-safe,
+    // its encryption and decryption are made under this lock
+    QMutex &virgilCryptoMutex();
 }
 
 #endif // VSQ_UTILS_H
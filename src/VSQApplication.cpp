@@ -110,6 +110,7 @@ VSQApplication::run(const QString &basePath) {
     context->setContextProperty("settings", &m_settings);
     context->setContextProperty("ConversationsModel", &m_messenger.modelConversations());
     context->setContextProperty("ChatModel", &m_messenger.getChatModel());
+    context->setContextProperty("SearchModel", &m_messenger.getSearchModel());
 
     QFont fon(QGuiApplication::font());
     fon.setPointSize(1.5 * QGuiApplication::font().pointSize());
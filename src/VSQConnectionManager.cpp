@@ -0,0 +1,268 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQConnectionManager.h"
+
+#include <QRandomGenerator>
+#include <QThread>
+
+Q_LOGGING_CATEGORY(lcConnection, "connection");
+
+static const int kConnectTimeoutMs = 10000;
+static const int kDisconnectTimeoutMs = 2000;
+// First retry delay, it's doubled for every next failure
+static const int kRetryBaseDelayMs = 1000;
+static const int kRetryMaxDelayMs = 2 * 60 * 1000;
+// Connection that is up for this time resets backoff, shorter one is lost as a failed attempt
+static const int kStableConnectionMs = 30000;
+
+VSQConnectionManager::VSQConnectionManager(QXmppClient *client, QObject *parent)
+    : QObject(parent)
+    , m_client(client)
+    , m_attemptTimer(this)
+    , m_retryTimer(this)
+    , m_stableTimer(this)
+{
+    m_attemptTimer.setSingleShot(true);
+    m_retryTimer.setSingleShot(true);
+    m_stableTimer.setSingleShot(true);
+    m_stableTimer.setInterval(kStableConnectionMs);
+    connect(&m_attemptTimer, &QTimer::timeout, this, &VSQConnectionManager::onAttemptTimeout);
+    connect(&m_retryTimer, &QTimer::timeout, this, &VSQConnectionManager::attempt);
+    connect(&m_stableTimer, &QTimer::timeout, this, [this]() { m_failureCount = 0; });
+    connect(client, &QXmppClient::connected, this, &VSQConnectionManager::onConnected);
+    connect(client, &QXmppClient::disconnected, this, &VSQConnectionManager::onDisconnected);
+    connect(client, &QXmppClient::error, this, &VSQConnectionManager::onError);
+}
+
+void VSQConnectionManager::connectToServer(const QXmppConfiguration &configuration, const FinishedCallback &finished)
+{
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [=]() { connectToServer(configuration, finished); }, Qt::QueuedConnection);
+        return;
+    }
+    if (finished) {
+        // Callers of a cancelled attempt get result of the new one
+        m_finishedCallbacks.push_back(finished);
+    }
+    m_configuration = configuration;
+    m_failureCount = 0;
+    m_retryTimer.stop();
+    if (m_client->state() == QXmppClient::DisconnectedState) {
+        attempt();
+        return;
+    }
+    setState(State::Disconnecting);
+    m_attemptTimer.start(kDisconnectTimeoutMs);
+    m_client->disconnectFromServer();
+}
+
+void VSQConnectionManager::reconnect()
+{
+    if (m_state == State::Connected && !m_client->isConnected()) {
+        // Disconnection wasn't reported
+        attempt();
+    }
+    else if (m_state == State::Waiting && !m_retryTimer.isActive() && m_networkOnline) {
+        attempt();
+    }
+}
+
+void VSQConnectionManager::setNetworkOnline(bool online)
+{
+    m_networkOnline = online;
+    if (!online) {
+        m_retryTimer.stop();
+        return;
+    }
+    m_failureCount = 0;
+    if (m_state == State::Waiting) {
+        m_retryTimer.stop();
+        attempt();
+    }
+}
+
+void VSQConnectionManager::disconnectFromServer()
+{
+    if (m_state == State::Idle || m_state == State::Waiting) {
+        return;
+    }
+    m_attemptTimer.stop();
+    m_stableTimer.stop();
+    // Disconnection is expected, so it isn't handled as a lost connection
+    setState(State::Waiting);
+    m_client->disconnectFromServer();
+    m_retryTimer.start(retryDelay(++m_failureCount));
+    finishAttempt(false);
+}
+
+void VSQConnectionManager::stop()
+{
+    m_attemptTimer.stop();
+    m_retryTimer.stop();
+    m_stableTimer.stop();
+    m_failureCount = 0;
+    setState(State::Idle);
+    if (m_client->state() != QXmppClient::DisconnectedState) {
+        m_client->disconnectFromServer();
+    }
+    finishAttempt(false);
+}
+
+VSQConnectionManager::State VSQConnectionManager::state() const
+{
+    return m_state;
+}
+
+bool VSQConnectionManager::isStreamResumed(const QXmppClient *client)
+{
+#if QXMPP_VERSION >= QT_VERSION_CHECK(1, 4, 0)
+    return client->streamManagementState() == QXmppClient::ResumedStream;
+#else
+    Q_UNUSED(client)
+    return false;
+#endif
+}
+
+void VSQConnectionManager::setState(State state)
+{
+    if (state != m_state) {
+        qCDebug(lcConnection) << "State:" << static_cast<int>(m_state) << "=>" << static_cast<int>(state);
+        m_state = state;
+    }
+}
+
+void VSQConnectionManager::attempt()
+{
+    if (m_state == State::Connecting || m_configuration.jid().isEmpty()) {
+        return;
+    }
+    qCDebug(lcConnection) << "Connection attempt, failures:" << m_failureCount;
+    setState(State::Connecting);
+    m_attemptTimer.start(kConnectTimeoutMs);
+    m_client->connectToServer(m_configuration);
+}
+
+void VSQConnectionManager::fail()
+{
+    m_attemptTimer.stop();
+    setState(State::Waiting);
+    if (m_networkOnline) {
+        const int delay = retryDelay(++m_failureCount);
+        qCDebug(lcConnection) << "Connection failed, retry in" << delay << "ms";
+        m_retryTimer.start(delay);
+    }
+    finishAttempt(false);
+}
+
+void VSQConnectionManager::finishAttempt(bool connected)
+{
+    const auto callbacks = std::move(m_finishedCallbacks);
+    m_finishedCallbacks.clear();
+    for (const auto &callback : callbacks) {
+        callback(connected);
+    }
+}
+
+void VSQConnectionManager::onConnected()
+{
+    if (m_state != State::Connecting) {
+        return;
+    }
+    m_attemptTimer.stop();
+    m_stableTimer.start();
+    setState(State::Connected);
+    qCDebug(lcConnection) << "Connected, stream is resumed:" << isStreamResumed(m_client);
+    finishAttempt(true);
+}
+
+void VSQConnectionManager::onDisconnected()
+{
+    switch (m_state) {
+    case State::Disconnecting:
+        m_attemptTimer.stop();
+        attempt();
+        break;
+    case State::Connecting:
+        fail();
+        break;
+    case State::Connected:
+        qCDebug(lcConnection) << "Connection is lost";
+        if (m_stableTimer.isActive()) {
+            // Connection was dropped soon after connecting, so it's retried with backoff like a failed attempt
+            m_stableTimer.stop();
+            fail();
+            break;
+        }
+        // Lost connection is retried at once, handshake is the only delay and with QXmpp 1.4+ the session is resumed
+        setState(State::Waiting);
+        if (m_networkOnline) {
+            attempt();
+        }
+        break;
+    case State::Idle:
+    case State::Waiting:
+        break;
+    }
+}
+
+void VSQConnectionManager::onError(QXmppClient::Error error)
+{
+    qCDebug(lcConnection) << "Client error:" << error;
+    if (m_state == State::Connecting && m_client->state() == QXmppClient::DisconnectedState) {
+        fail();
+    }
+}
+
+void VSQConnectionManager::onAttemptTimeout()
+{
+    if (m_state == State::Disconnecting) {
+        qCDebug(lcConnection) << "Disconnection timed out";
+        attempt();
+    }
+    else if (m_state == State::Connecting) {
+        qCDebug(lcConnection) << "Connection timed out";
+        // Attempt is failed before the client reports disconnection, so the report is ignored
+        fail();
+        m_client->disconnectFromServer();
+    }
+}
+
+int VSQConnectionManager::retryDelay(int failureCount)
+{
+    const int exponent = qBound(0, failureCount - 1, 7);
+    const int delay = qMin(kRetryBaseDelayMs << exponent, kRetryMaxDelayMs);
+    // Half of the delay is random, so clients aren't reconnected at once after server restart
+    return delay / 2 + QRandomGenerator::global()->bounded(delay / 2 + 1);
+}
@@ -0,0 +1,149 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQConversationRows.h"
+
+void VSQConversationRows::clear()
+{
+    m_rowIds.clear();
+    m_timestamps.clear();
+    m_authors.clear();
+    m_recipients.clear();
+    m_statuses.clear();
+    m_messageIds.clear();
+    m_messages.clear();
+    m_attachmentIndices.clear();
+    m_attachments.clear();
+    m_strings.clear();
+    m_stringIds.clear();
+}
+
+void VSQConversationRows::append(const RowData &row)
+{
+    m_rowIds.push_back(row.rowId);
+    m_timestamps.push_back(row.timestamp);
+    m_authors.push_back(intern(row.author));
+    m_recipients.push_back(intern(row.recipient));
+    m_statuses.push_back(static_cast<qint8>(row.status));
+    m_messageIds.push_back(row.messageId);
+    m_messages.push_back(row.message);
+    m_attachmentIndices.push_back(addAttachment(row));
+}
+
+void VSQConversationRows::prepend(const RowsData &rows)
+{
+    const int count = rows.size();
+    QVector<qint64> rowIds(count);
+    QVector<qint64> timestamps(count);
+    QVector<quint32> authors(count);
+    QVector<quint32> recipients(count);
+    QVector<qint8> statuses(count);
+    QVector<QString> messageIds(count);
+    QVector<QString> messages(count);
+    QVector<int> attachmentIndices(count);
+    for (int i = 0; i < count; ++i) {
+        const auto &row = rows[i];
+        rowIds[i] = row.rowId;
+        timestamps[i] = row.timestamp;
+        authors[i] = intern(row.author);
+        recipients[i] = intern(row.recipient);
+        statuses[i] = static_cast<qint8>(row.status);
+        messageIds[i] = row.messageId;
+        messages[i] = row.message;
+        attachmentIndices[i] = addAttachment(row);
+    }
+    m_rowIds = rowIds + m_rowIds;
+    m_timestamps = timestamps + m_timestamps;
+    m_authors = authors + m_authors;
+    m_recipients = recipients + m_recipients;
+    m_statuses = statuses + m_statuses;
+    m_messageIds = messageIds + m_messageIds;
+    m_messages = messages + m_messages;
+    m_attachmentIndices = attachmentIndices + m_attachmentIndices;
+}
+
+void VSQConversationRows::removeFirst(int count)
+{
+    m_rowIds.remove(0, count);
+    m_timestamps.remove(0, count);
+    m_authors.remove(0, count);
+    m_recipients.remove(0, count);
+    m_statuses.remove(0, count);
+    m_messageIds.remove(0, count);
+    m_messages.remove(0, count);
+    m_attachmentIndices.remove(0, count);
+
+    // Attachments of the remaining rows are compacted
+    QVector<AttachmentFields> attachments;
+    for (auto &index : m_attachmentIndices) {
+        if (index >= 0) {
+            attachments.push_back(m_attachments[index]);
+            index = attachments.size() - 1;
+        }
+    }
+    m_attachments.swap(attachments);
+}
+
+const VSQConversationRows::AttachmentFields *VSQConversationRows::attachment(int row) const
+{
+    const int index = m_attachmentIndices[row];
+    return (index < 0) ? nullptr : &m_attachments[index];
+}
+
+VSQConversationRows::AttachmentFields *VSQConversationRows::attachment(int row)
+{
+    const int index = m_attachmentIndices[row];
+    return (index < 0) ? nullptr : &m_attachments[index];
+}
+
+quint32 VSQConversationRows::intern(const QString &string)
+{
+    const auto it = m_stringIds.constFind(string);
+    if (it != m_stringIds.constEnd()) {
+        return it.value();
+    }
+    const auto id = static_cast<quint32>(m_strings.size());
+    m_strings.push_back(string);
+    m_stringIds.insert(string, id);
+    return id;
+}
+
+int VSQConversationRows::addAttachment(const RowData &row)
+{
+    if (!row.hasAttachment) {
+        return -1;
+    }
+    m_attachments.push_back(row.attachment);
+    return m_attachments.size() - 1;
+}
@@ -0,0 +1,109 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQCryptoBufferPool.h"
+
+#include <QMutexLocker>
+
+#include <utility>
+
+VSQCryptoBufferPool::Buffer::Buffer(VSQCryptoBufferPool *pool, std::vector<uint8_t> &&bytes, size_t size)
+    : m_pool(pool)
+    , m_bytes(std::move(bytes))
+    , m_size(size)
+{}
+
+VSQCryptoBufferPool::Buffer::Buffer(Buffer &&other) noexcept
+    : m_pool(other.m_pool)
+    , m_bytes(std::move(other.m_bytes))
+    , m_size(other.m_size)
+{
+    other.m_pool = nullptr;
+    other.m_size = 0;
+}
+
+VSQCryptoBufferPool::Buffer::~Buffer()
+{
+    if (m_pool) {
+        m_pool->release(std::move(m_bytes), m_size);
+    }
+}
+
+VSQCryptoBufferPool::Buffer VSQCryptoBufferPool::acquire(size_t size)
+{
+    const int index = sizeClass(size);
+    if (index < kClassCount) {
+        QMutexLocker locker(&m_mutex);
+        auto &freeBuffers = m_free[index];
+        if (!freeBuffers.empty()) {
+            auto bytes = std::move(freeBuffers.back());
+            freeBuffers.pop_back();
+            return Buffer(this, std::move(bytes), size);
+        }
+    }
+    const size_t capacity = (index < kClassCount) ? (size_t(1) << (kMinClassShift + index)) : size;
+    return Buffer(this, std::vector<uint8_t>(capacity), size);
+}
+
+int VSQCryptoBufferPool::sizeClass(size_t size)
+{
+    int index = 0;
+    while (index < kClassCount && (size_t(1) << (kMinClassShift + index)) < size) {
+        ++index;
+    }
+    return index;
+}
+
+void VSQCryptoBufferPool::wipe(std::vector<uint8_t> &bytes, size_t size)
+{
+    // Volatile writes aren't removed by the optimizer
+    volatile uint8_t *data = bytes.data();
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = 0;
+    }
+}
+
+void VSQCryptoBufferPool::release(std::vector<uint8_t> &&bytes, size_t size)
+{
+    wipe(bytes, size);
+    const int index = sizeClass(bytes.size());
+    if (index >= kClassCount || (size_t(1) << (kMinClassShift + index)) != bytes.size()) {
+        return;
+    }
+    QMutexLocker locker(&m_mutex);
+    auto &freeBuffers = m_free[index];
+    if (static_cast<int>(freeBuffers.size()) < kMaxFreeBuffers) {
+        freeBuffers.push_back(std::move(bytes));
+    }
+}
@@ -125,10 +125,12 @@ bool VSQCryptoTransferManager::ecnryptFile(const QString &path, const QString &e
     // Encrypt
     std::vector<char> encBytes(5 * bytes.size() + 5000);
     size_t encBytesSize = 0;
+    QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
     const auto code = vs_messenger_virgil_encrypt_msg(
                 recipient.toStdString().c_str(),
                 reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(),
                 reinterpret_cast<uint8_t*>(encBytes.data()), encBytes.size(), &encBytesSize);
+    locker.unlock();
     if (VS_CODE_OK != code)
     {
         qCCritical(lcTransferManager) << "Cannot encrypt file:" << path << "code:" << code;
@@ -178,10 +180,12 @@ bool VSQCryptoTransferManager::decryptFile(const QString &encPath, const QString
     // Decrypt
     std::vector<char> bytes(encBytes.size());
     size_t bytesSize = 0;
+    QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
     const auto code = vs_messenger_virgil_decrypt_msg(
                 recipient.toStdString().c_str(),
                 encBytes.data(),
                 reinterpret_cast<uint8_t*>(bytes.data()), bytes.size(), &bytesSize);
+    locker.unlock();
     if (VS_CODE_OK != code)
     {
         qCCritical(lcTransferManager) << "Cannot decrypt file:" << encPath << "code:" << code;
@@ -37,6 +37,8 @@
 #include <qxmpp/QXmppClient.h>
 #include <qxmpp/QXmppCarbonManager.h>
 
+#include "VSQConnectionManager.h"
+
 Q_LOGGING_CATEGORY(lcDiscoveryManager, "discoman");
 
 VSQDiscoveryManager::VSQDiscoveryManager(QXmppClient *client, QObject *parent)
@@ -67,7 +69,8 @@ void VSQDiscoveryManager::onInfoReceived(const QXmppDiscoveryIq &info)
     if (info.from() != m_client->configuration().domain())
         return;
 
-    if (info.features().contains("urn:xmpp:carbons:2")) {
+    // Carbons of a resumed stream are still enabled
+    if (info.features().contains("urn:xmpp:carbons:2") && !VSQConnectionManager::isStreamResumed(m_client)) {
         auto carbonManager = m_client->findExtension<QXmppCarbonManager>();
         if (!carbonManager) {
             qCDebug(lcDiscoveryManager) << "Carbon manager is not found";
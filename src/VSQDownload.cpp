@@ -78,7 +78,7 @@ void VSQDownload::start()
     auto reply = networkAccessManager()->get(request);
     m_connections = connectReply(reply, &m_guard);
     m_connections << connect(reply, &QNetworkReply::downloadProgress, [=](qint64 bytesReceived, qint64 bytesTotal) {
-        emit progressChanged(bytesReceived, bytesTotal);
+        updateProgress(bytesReceived, bytesTotal);
     });
     m_connections << connect(reply, &QNetworkReply::readyRead, [=]() {
         const auto bytes = reply->readAll();
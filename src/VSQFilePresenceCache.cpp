@@ -0,0 +1,145 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQFilePresenceCache.h"
+
+#include <QFileInfo>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+
+Q_LOGGING_CATEGORY(lcFilePresence, "filepresence");
+
+VSQFilePresenceCache::VSQFilePresenceCache(QObject *parent)
+    : QObject(parent)
+    , m_watcher(this)
+{
+    connect(&m_watcher, &QFileSystemWatcher::directoryChanged, this, &VSQFilePresenceCache::onDirectoryChanged);
+}
+
+void VSQFilePresenceCache::watchDirectory(const QDir &dir)
+{
+    const auto path = dir.absolutePath();
+    if (!m_watcher.addPath(path)) {
+        qCWarning(lcFilePresence) << "Unable to watch directory:" << path;
+    }
+}
+
+bool VSQFilePresenceCache::exists(const QString &key, const QString &filePath)
+{
+    auto it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        it = m_entries.insert(key, Entry());
+        it->filePath = filePath;
+        scheduleCheck(key);
+    }
+    else if (it->filePath != filePath) {
+        it->filePath = filePath;
+        scheduleCheck(key);
+    }
+    return it->exists;
+}
+
+void VSQFilePresenceCache::setFilePath(const QString &key, const QString &filePath)
+{
+    m_entries[key].filePath = filePath;
+    scheduleCheck(key);
+}
+
+void VSQFilePresenceCache::clear()
+{
+    m_entries.clear();
+    m_pendingKeys.clear();
+}
+
+void VSQFilePresenceCache::scheduleCheck(const QString &key)
+{
+    m_pendingKeys.insert(key);
+    if (!m_checkScheduled) {
+        // Checks requested during the same event loop iteration are done together
+        m_checkScheduled = true;
+        QMetaObject::invokeMethod(this, &VSQFilePresenceCache::runChecks, Qt::QueuedConnection);
+    }
+}
+
+void VSQFilePresenceCache::runChecks()
+{
+    m_checkScheduled = false;
+    Checks checks;
+    checks.reserve(m_pendingKeys.size());
+    for (const auto &key : m_pendingKeys) {
+        const auto it = m_entries.constFind(key);
+        if (it != m_entries.constEnd()) {
+            checks.push_back({ key, it->filePath, false });
+        }
+    }
+    m_pendingKeys.clear();
+    if (checks.isEmpty()) {
+        return;
+    }
+
+    auto watcher = new QFutureWatcher<Checks>(this);
+    connect(watcher, &QFutureWatcher<Checks>::finished, this, [this, watcher]() {
+        onChecked(watcher->result());
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run([checks]() mutable {
+        for (auto &check : checks) {
+            check.exists = !check.filePath.isEmpty() && QFileInfo::exists(check.filePath);
+        }
+        return checks;
+    }));
+}
+
+void VSQFilePresenceCache::onChecked(const Checks &checks)
+{
+    for (const auto &check : checks) {
+        auto it = m_entries.find(check.key);
+        // Skip results of outdated paths, they are checked again
+        if (it == m_entries.end() || it->filePath != check.filePath || it->exists == check.exists) {
+            continue;
+        }
+        it->exists = check.exists;
+        emit presenceChanged(check.key, check.exists);
+    }
+}
+
+void VSQFilePresenceCache::onDirectoryChanged(const QString &path)
+{
+    const QString prefix = QDir(path).absolutePath() + QLatin1Char('/');
+    for (auto it = m_entries.cbegin(); it != m_entries.cend(); ++it) {
+        if (it->filePath.startsWith(prefix)) {
+            scheduleCheck(it.key());
+        }
+    }
+}
@@ -0,0 +1,397 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQHistorySync.h"
+
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QRegExp>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+#include <QtConcurrent>
+
+#include <qxmpp/QXmppClient.h>
+#include <qxmpp/QXmppMamManager.h>
+#include <qxmpp/QXmppMessage.h>
+#include <qxmpp/QXmppResultSet.h>
+
+#include <memory>
+#include <vector>
+
+#include "VSQSqlConversationModel.h"
+#include "VSQSqlMigrator.h"
+#include "VSQSqlStatementCache.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+
+Q_LOGGING_CATEGORY(lcHistorySync, "historysync");
+
+// Page of archive, it's below the batch size of the write queue, so a page is committed at once
+static const int kPageSize = 100;
+// Received pages waiting for decryption, fetching is paused above it
+static const int kMaxPendingPages = 2;
+static const int kPageTimeoutMs = 30000;
+// Clocks of server and client can differ, archive is fetched with a margin, known messages are skipped
+static const qint64 kCheckpointMarginMs = 5 * 60 * 1000;
+static const int kMinDecryptThreads = 2;
+static const int kMaxDecryptThreads = 8;
+
+VSQHistorySync::VSQHistorySync(QXmppClient *client, VSQStorage *storage, VSQSqlConversationModel *conversations,
+                               const Decryptor &decryptor, QObject *parent)
+    : QObject(parent)
+    , m_client(client)
+    , m_mamManager(new QXmppMamManager())
+    , m_storage(storage)
+    , m_writeQueue(storage->writeQueue())
+    , m_conversations(conversations)
+    , m_decryptor(decryptor)
+    , m_pageTimer(this)
+{
+    client->addExtension(m_mamManager);
+    connect(m_mamManager, &QXmppMamManager::archivedMessageReceived, this, &VSQHistorySync::onArchivedMessageReceived);
+    connect(m_mamManager, &QXmppMamManager::resultsRecieved, this, &VSQHistorySync::onResultsReceived);
+
+    m_pool.setMaxThreadCount(qBound(kMinDecryptThreads, QThread::idealThreadCount(), kMaxDecryptThreads));
+    m_pageTimer.setSingleShot(true);
+    m_pageTimer.setInterval(kPageTimeoutMs);
+    connect(&m_pageTimer, &QTimer::timeout, this, &VSQHistorySync::onPageTimeout);
+}
+
+VSQHistorySync::~VSQHistorySync()
+{
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+void VSQHistorySync::setUser(const QString &user)
+{
+    if (user == m_user) {
+        return;
+    }
+    stop();
+    m_user = user;
+    m_live = false;
+
+    const QString table = tableName();
+    VSQSqlMigrator migrator(m_writeQueue, table);
+    migrator.addStep(1, {
+        QString("CREATE TABLE %1 ("
+                "id INTEGER NOT NULL PRIMARY KEY,"
+                "checkpoint INTEGER NOT NULL"
+                ")").arg(table)
+    });
+    if (!migrator.migrate()) {
+        qCCritical(lcHistorySync) << "Failed to migrate table" << table;
+        return;
+    }
+
+    // The first sync starts from the newest stored message
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(
+            QString("SELECT checkpoint FROM %1 WHERE id = 1 UNION ALL SELECT MAX(timestamp) FROM %2")
+                .arg(table, m_conversations->tableName()));
+    m_checkpoint = 0;
+    if (query.exec()) {
+        while (query.next() && m_checkpoint == 0) {
+            m_checkpoint = query.value(0).toLongLong();
+        }
+    }
+    else {
+        qCWarning(lcHistorySync) << "Failed to load checkpoint:" << query.lastError().text();
+    }
+    query.finish();
+    if (m_checkpoint == 0) {
+        m_checkpoint = QDateTime::currentMSecsSinceEpoch();
+    }
+    saveCheckpoint(m_checkpoint);
+    qCDebug(lcHistorySync) << "Checkpoint:" << QDateTime::fromMSecsSinceEpoch(m_checkpoint, Qt::UTC);
+}
+
+void VSQHistorySync::start()
+{
+    if (m_active || m_user.isEmpty()) {
+        return;
+    }
+    ++m_generation;
+    m_live = false;
+    m_lastArchiveId.clear();
+    m_complete = false;
+    m_receivingPage = Page();
+    m_pendingPages.clear();
+    m_receivedCount = 0;
+    m_totalCount = -1;
+    setActive(true);
+    emit progressChanged();
+    requestPage();
+}
+
+void VSQHistorySync::stop()
+{
+    if (m_live) {
+        // Messages were received live until now
+        m_live = false;
+        saveCheckpoint(QDateTime::currentMSecsSinceEpoch());
+    }
+    if (!m_active) {
+        return;
+    }
+    ++m_generation;
+    m_queryId.clear();
+    m_pageTimer.stop();
+    m_receivingPage = Page();
+    m_pendingPages.clear();
+    m_decrypting = false;
+    setActive(false);
+}
+
+bool VSQHistorySync::isActive() const
+{
+    return m_active;
+}
+
+int VSQHistorySync::receivedCount() const
+{
+    return m_receivedCount;
+}
+
+int VSQHistorySync::totalCount() const
+{
+    return m_totalCount;
+}
+
+QString VSQHistorySync::tableName() const
+{
+    QString name(m_user);
+    name.remove(QRegExp("[^a-z0-9_]"));
+    return QString("HistorySync_") + name;
+}
+
+void VSQHistorySync::setActive(bool active)
+{
+    if (active != m_active) {
+        m_active = active;
+        emit activeChanged(active);
+    }
+}
+
+void VSQHistorySync::requestPage()
+{
+    QXmppResultSetQuery resultSetQuery;
+    resultSetQuery.setMax(kPageSize);
+    if (!m_lastArchiveId.isEmpty()) {
+        resultSetQuery.setAfter(m_lastArchiveId);
+    }
+    const auto start = QDateTime::fromMSecsSinceEpoch(m_checkpoint - kCheckpointMarginMs, Qt::UTC);
+    m_receivingPage = Page();
+    m_queryId = m_mamManager->retrieveArchivedMessages(QString(), QString(), QString(), start, QDateTime(),
+                                                       resultSetQuery);
+    m_pageTimer.start();
+    qCDebug(lcHistorySync) << "Page requested after:" << m_lastArchiveId << "id:" << m_queryId;
+}
+
+void VSQHistorySync::onArchivedMessageReceived(const QString &queryId, const QXmppMessage &message)
+{
+    if (queryId != m_queryId) {
+        return;
+    }
+    ++m_receivingPage.archivedCount;
+    if (message.body().isEmpty()) {
+        return;
+    }
+    ArchivedMessage archivedMessage;
+    archivedMessage.messageId = message.id();
+    archivedMessage.sender = message.from().split("@").first();
+    archivedMessage.recipient = message.to().split("@").first();
+    archivedMessage.body = message.body();
+    archivedMessage.timestamp = message.stamp().isValid() ? message.stamp().toMSecsSinceEpoch() : 0;
+    m_receivingPage.messages.push_back(archivedMessage);
+}
+
+void VSQHistorySync::onResultsReceived(const QString &queryId, const QXmppResultSetReply &reply, bool complete)
+{
+    if (queryId != m_queryId) {
+        return;
+    }
+    m_pageTimer.stop();
+    m_queryId.clear();
+    if (m_totalCount < 0 && reply.count() >= 0) {
+        m_totalCount = reply.count();
+        emit progressChanged();
+    }
+    m_lastArchiveId = reply.last();
+    m_complete = complete || m_receivingPage.archivedCount == 0 || m_lastArchiveId.isEmpty();
+    if (!m_receivingPage.messages.isEmpty()) {
+        m_pendingPages.push_back(m_receivingPage);
+    }
+    else if (m_receivingPage.archivedCount > 0) {
+        // Nothing to deliver, skipped messages are counted at once
+        m_receivedCount += m_receivingPage.archivedCount;
+        emit progressChanged();
+    }
+    m_receivingPage = Page();
+
+    // Next page is fetched while this one is decrypted
+    if (!m_complete && static_cast<int>(m_pendingPages.size()) < kMaxPendingPages) {
+        requestPage();
+    }
+    decryptNextPage();
+    if (m_complete && !m_decrypting && m_pendingPages.empty()) {
+        finish();
+    }
+}
+
+void VSQHistorySync::decryptNextPage()
+{
+    if (m_decrypting || m_pendingPages.empty()) {
+        return;
+    }
+    m_decrypting = true;
+    const Page page = m_pendingPages.front();
+    m_pendingPages.pop_front();
+    const auto &archivedMessages = page.messages;
+    const int archivedCount = page.archivedCount;
+
+    // Page is split between worker threads, the last finished chunk delivers the page in order
+    struct Job
+    {
+        std::vector<Optional<StMessage>> messages;
+        QAtomicInt remainingChunks;
+    };
+    const auto job = std::make_shared<Job>();
+    job->messages.resize(static_cast<size_t>(archivedMessages.size()));
+    const int chunkCount = qMin(m_pool.maxThreadCount(), archivedMessages.size());
+    const int chunkSize = (archivedMessages.size() + chunkCount - 1) / chunkCount;
+    job->remainingChunks.store(chunkCount);
+
+    qint64 lastTimestamp = 0;
+    for (const auto &message : archivedMessages) {
+        lastTimestamp = qMax(lastTimestamp, message.timestamp);
+    }
+    const int generation = m_generation;
+    const Decryptor decryptor = m_decryptor;
+    VSQSqlConversationModel *conversations = m_conversations;
+    for (int first = 0; first < archivedMessages.size(); first += chunkSize) {
+        const int last = qMin(first + chunkSize, archivedMessages.size());
+        QtConcurrent::run(&m_pool, [=]() {
+            // Messages that were received live or by earlier sync are skipped
+            QStringList messageIds;
+            for (int i = first; i < last; ++i) {
+                messageIds << archivedMessages[i].messageId;
+            }
+            const auto existingIds = conversations->existingMessageIds(messageIds);
+            for (int i = first; i < last; ++i) {
+                const auto &archivedMessage = archivedMessages[i];
+                if (existingIds.contains(archivedMessage.messageId)) {
+                    continue;
+                }
+                // Archived messages may come from devices that are gone, so their formats aren't learned
+                auto message = decryptor(archivedMessage.sender, QString(), archivedMessage.body);
+                if (message) {
+                    message->messageId = archivedMessage.messageId;
+                    message->sender = archivedMessage.sender;
+                    message->recipient = archivedMessage.recipient;
+                    message->timestamp = archivedMessage.timestamp;
+                }
+                job->messages[static_cast<size_t>(i)] = message;
+            }
+            if (job->remainingChunks.fetchAndSubAcquire(1) != 1) {
+                return;
+            }
+            QList<StMessage> messages;
+            for (const auto &message : job->messages) {
+                if (message) {
+                    messages.push_back(*message);
+                }
+            }
+            QMetaObject::invokeMethod(this, [=]() {
+                onPageDecrypted(generation, messages, archivedCount, lastTimestamp);
+            }, Qt::QueuedConnection);
+        });
+    }
+}
+
+void VSQHistorySync::onPageDecrypted(int generation, const QList<StMessage> &messages, int archivedCount,
+                                     qint64 lastTimestamp)
+{
+    if (generation != m_generation) {
+        return;
+    }
+    m_decrypting = false;
+    if (!messages.isEmpty()) {
+        emit received(messages);
+    }
+    // Checkpoint is queued after messages of the page
+    if (lastTimestamp > m_checkpoint) {
+        saveCheckpoint(lastTimestamp);
+    }
+    // Skipped messages are counted too, so progress reaches the total
+    m_receivedCount += archivedCount;
+    emit progressChanged();
+    qCDebug(lcHistorySync) << "Page is delivered, messages:" << messages.size() << "of" << archivedCount
+                           << "processed:" << m_receivedCount;
+
+    if (!m_complete && m_queryId.isEmpty()) {
+        requestPage();
+    }
+    decryptNextPage();
+    if (m_complete && !m_decrypting && m_pendingPages.empty()) {
+        finish();
+    }
+}
+
+void VSQHistorySync::finish()
+{
+    qCDebug(lcHistorySync) << "Sync is finished, messages:" << m_receivedCount;
+    // Count reported by server is approximate (XEP-0059)
+    if (m_totalCount >= 0 && m_totalCount != m_receivedCount) {
+        m_totalCount = m_receivedCount;
+        emit progressChanged();
+    }
+    m_live = true;
+    setActive(false);
+}
+
+void VSQHistorySync::onPageTimeout()
+{
+    qCWarning(lcHistorySync) << "Archive page timed out, sync is retried with the next connection";
+    stop();
+}
+
+void VSQHistorySync::saveCheckpoint(qint64 checkpoint)
+{
+    m_checkpoint = checkpoint;
+    m_writeQueue->exec(QString("INSERT OR REPLACE INTO %1 (id, checkpoint) VALUES (1, ?)").arg(tableName()),
+                       { checkpoint });
+}
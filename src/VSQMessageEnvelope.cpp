@@ -0,0 +1,266 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQMessageEnvelope.h"
+
+#include <QCborMap>
+#include <QCborValue>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+
+#include "VSQUtils.h"
+
+Q_LOGGING_CATEGORY(lcMessageEnvelope, "envelope");
+
+namespace
+{
+    enum class PayloadType
+    {
+        Text,
+        Picture,
+        File
+    };
+
+    // CBOR keys are short integers, they replace JSON key names
+    enum CborKey
+    {
+        VersionKey = 0,
+        TypeKey,
+        BodyKey,
+        UrlKey,
+        BytesTotalKey,
+        ThumbnailUrlKey,
+        ThumbnailWidthKey,
+        ThumbnailHeightKey,
+        // Byte string with compressed inner envelope, other keys except version are absent
+        CompressedKey
+    };
+
+    // Smaller envelopes don't gain from compression
+    const int kCompressionThreshold = 512;
+    // Fast zlib level, messages are short and compressed in the send path
+    const int kCompressionLevel = 1;
+    // Limit of decompressed envelope, a bigger declared size isn't decompressed
+    const quint32 kMaxDecompressedSize = 16 * 1024 * 1024;
+
+    // JSON key that advertises CBOR support, older peers ignore it
+    const QString kJsonEnvelopeKey = QLatin1String("envelope");
+
+    PayloadType payloadType(const StMessage &message)
+    {
+        if (!message.attachment) {
+            return PayloadType::Text;
+        }
+        return (message.attachment->type == Attachment::Type::Picture) ? PayloadType::Picture : PayloadType::File;
+    }
+
+    // Attachment of a received message, fields that aren't sent are filled here
+    Attachment createAttachment(PayloadType type)
+    {
+        Attachment attachment;
+        attachment.id = VSQUtils::createUuid();
+        attachment.type = (type == PayloadType::Picture) ? Attachment::Type::Picture : Attachment::Type::File;
+        return attachment;
+    }
+}
+
+QByteArray VSQMessageEnvelope::encode(const StMessage &message, Format format)
+{
+    return (format == Format::Cbor) ? encodeCbor(message) : encodeJson(message);
+}
+
+Optional<StMessage> VSQMessageEnvelope::decode(const QByteArray &bytes, Format *peerFormat)
+{
+    if (bytes.isEmpty()) {
+        return NullOptional;
+    }
+    // JSON envelope is an object, CBOR envelope is a map (major type 5)
+    if ((static_cast<quint8>(bytes[0]) & 0xE0) == 0xA0) {
+        if (peerFormat) {
+            *peerFormat = Format::Cbor;
+        }
+        return decodeCbor(bytes);
+    }
+    return decodeJson(bytes, peerFormat);
+}
+
+QByteArray VSQMessageEnvelope::encodeJson(const StMessage &message)
+{
+    QJsonObject mainObject;
+    QJsonObject payloadObject;
+    const auto &attachment = message.attachment;
+    switch (payloadType(message)) {
+    case PayloadType::Text:
+        mainObject.insert("type", "text");
+        payloadObject.insert("body", message.message);
+        break;
+    case PayloadType::Picture:
+        mainObject.insert("type", "picture");
+        payloadObject.insert("url", attachment->remoteUrl.toString());
+        payloadObject.insert("displayName", attachment->displayName);
+        payloadObject.insert("thumbnailUrl", attachment->remoteThumbnailUrl.toString());
+        payloadObject.insert("thumbnailWidth", attachment->thumbnailSize.width());
+        payloadObject.insert("thumbnailHeight", attachment->thumbnailSize.height());
+        payloadObject.insert("bytesTotal", attachment->bytesTotal);
+        break;
+    case PayloadType::File:
+        mainObject.insert("type", "file");
+        payloadObject.insert("url", attachment->remoteUrl.toString());
+        payloadObject.insert("displayName", attachment->displayName);
+        payloadObject.insert("bytesTotal", attachment->bytesTotal);
+        break;
+    }
+    mainObject.insert("payload", payloadObject);
+    mainObject.insert(kJsonEnvelopeKey, kCborVersion);
+    return QJsonDocument(mainObject).toJson(QJsonDocument::Compact);
+}
+
+QByteArray VSQMessageEnvelope::encodeCbor(const StMessage &message)
+{
+    QCborMap map;
+    map.insert(VersionKey, kCborVersion);
+    const auto type = payloadType(message);
+    map.insert(TypeKey, static_cast<int>(type));
+    const auto &attachment = message.attachment;
+    if (type == PayloadType::Text) {
+        map.insert(BodyKey, message.message);
+        return compressCbor(map.toCborValue().toCbor());
+    }
+    map.insert(BodyKey, attachment->displayName);
+    map.insert(UrlKey, attachment->remoteUrl.toString());
+    map.insert(BytesTotalKey, attachment->bytesTotal);
+    if (type == PayloadType::Picture) {
+        map.insert(ThumbnailUrlKey, attachment->remoteThumbnailUrl.toString());
+        map.insert(ThumbnailWidthKey, attachment->thumbnailSize.width());
+        map.insert(ThumbnailHeightKey, attachment->thumbnailSize.height());
+    }
+    return compressCbor(map.toCborValue().toCbor());
+}
+
+QByteArray VSQMessageEnvelope::compressCbor(const QByteArray &bytes)
+{
+    if (bytes.size() < kCompressionThreshold) {
+        return bytes;
+    }
+    QCborMap map;
+    map.insert(VersionKey, kCborVersion);
+    map.insert(CompressedKey, qCompress(bytes, kCompressionLevel));
+    const auto compressedBytes = map.toCborValue().toCbor();
+    if (compressedBytes.size() >= bytes.size()) {
+        return bytes;
+    }
+    qCDebug(lcMessageEnvelope) << "Envelope is compressed from" << bytes.size() << "to" << compressedBytes.size() << "bytes";
+    return compressedBytes;
+}
+
+Optional<StMessage> VSQMessageEnvelope::decodeJson(const QByteArray &bytes, Format *peerFormat)
+{
+    QJsonParseError error;
+    const auto json = QJsonDocument::fromJson(bytes, &error);
+    if (!json.isObject()) {
+        qCWarning(lcMessageEnvelope) << "Invalid JSON envelope:" << error.errorString();
+        return NullOptional;
+    }
+    if (peerFormat) {
+        *peerFormat = (json[kJsonEnvelopeKey].toInt() >= kCborVersion) ? Format::Cbor : Format::Json;
+    }
+
+    const auto type = json["type"].toString();
+    const auto payload = json["payload"];
+    StMessage message;
+    if (type == QLatin1String("text")) {
+        message.message = payload["body"].toString();
+        return message;
+    }
+    auto attachment = createAttachment((type == QLatin1String("picture")) ? PayloadType::Picture : PayloadType::File);
+    attachment.remoteUrl = payload["url"].toString();
+    attachment.displayName = payload["displayName"].toString();
+    attachment.bytesTotal = payload["bytesTotal"].toInt();
+    if (attachment.type == Attachment::Type::Picture) {
+        attachment.remoteThumbnailUrl = payload["thumbnailUrl"].toString();
+        attachment.thumbnailSize = QSize(payload["thumbnailWidth"].toInt(), payload["thumbnailHeight"].toInt());
+    }
+    message.message = attachment.displayName;
+    message.attachment = attachment;
+    return message;
+}
+
+Optional<StMessage> VSQMessageEnvelope::decodeCbor(const QByteArray &bytes, bool allowCompressed)
+{
+    QCborParserError error;
+    const auto value = QCborValue::fromCbor(bytes, &error);
+    if (error.error != QCborError::NoError || !value.isMap()) {
+        qCWarning(lcMessageEnvelope) << "Invalid CBOR envelope:" << error.errorString();
+        return NullOptional;
+    }
+    const auto map = value.toMap();
+    if (map.value(VersionKey).toInteger() < kCborVersion) {
+        qCWarning(lcMessageEnvelope) << "Unsupported CBOR envelope version";
+        return NullOptional;
+    }
+    if (map.contains(CompressedKey)) {
+        // Compressed envelope is never nested
+        const auto compressedBytes = map.value(CompressedKey).toByteArray();
+        if (!allowCompressed || compressedBytes.size() < 4) {
+            qCWarning(lcMessageEnvelope) << "Invalid compressed CBOR envelope";
+            return NullOptional;
+        }
+        // qCompress prepends big-endian size of uncompressed data
+        const auto size = qFromBigEndian<quint32>(compressedBytes.constData());
+        if (size > kMaxDecompressedSize) {
+            qCWarning(lcMessageEnvelope) << "Compressed CBOR envelope is too big:" << size;
+            return NullOptional;
+        }
+        return decodeCbor(qUncompress(compressedBytes), false);
+    }
+
+    const auto type = static_cast<PayloadType>(map.value(TypeKey).toInteger());
+    StMessage message;
+    message.message = map.value(BodyKey).toString();
+    if (type == PayloadType::Text) {
+        return message;
+    }
+    auto attachment = createAttachment(type);
+    attachment.displayName = message.message;
+    attachment.remoteUrl = map.value(UrlKey).toString();
+    attachment.bytesTotal = map.value(BytesTotalKey).toInteger();
+    if (attachment.type == Attachment::Type::Picture) {
+        attachment.remoteThumbnailUrl = map.value(ThumbnailUrlKey).toString();
+        attachment.thumbnailSize = QSize(static_cast<int>(map.value(ThumbnailWidthKey).toInteger()),
+                                         static_cast<int>(map.value(ThumbnailHeightKey).toInteger()));
+    }
+    message.attachment = attachment;
+    return message;
+}
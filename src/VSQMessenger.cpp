@@ -35,6 +35,7 @@
 #include <android/VSQAndroid.h>
 #include <cstring>
 #include <cstdlib>
+#include <memory>
 
 #include <VSQDownload.h>
 #include <VSQMessenger.h>
@@ -82,43 +83,12 @@ const QString VSQMessenger::kPushNotificationsFCM = "fcm";
 const QString VSQMessenger::kPushNotificationsDeviceID = "device_id";
 const QString VSQMessenger::kPushNotificationsFormType = "FORM_TYPE";
 const QString VSQMessenger::kPushNotificationsFormTypeVal = "http://jabber.org/protocol/pubsub#publish-options";
-const int VSQMessenger::kConnectionWaitMs = 10000;
+const int VSQMessenger::kConnectionWaitMs = 15000;
 const int VSQMessenger::kKeepAliveTimeSec = 10;
+const int VSQMessenger::kStopPollIntervalMs = 50;
 
 Q_LOGGING_CATEGORY(lcMessenger, "messenger")
 
-// Helper struct to categorize transfers
-struct TransferId
-{
-    enum class Type
-    {
-        File,
-        Thumbnail
-    };
-
-    TransferId() = default;
-    TransferId(const QString &messageId, const Type type)
-        : messageId(messageId)
-        , type(type)
-    {}
-    ~TransferId() = default;
-
-    static TransferId parse(const QString &rawTransferId)
-    {
-        const auto parts = rawTransferId.split(';');
-        return TransferId(parts.front(), (parts.back() == "thumb") ? Type::Thumbnail : Type::File);
-    }
-
-    operator QString() const
-    {
-        return messageId + ((type == Type::Thumbnail) ? QLatin1String(";thumb") : QLatin1String(";file"));
-    }
-
-    QString messageId;
-    Type type = Type::File;
-};
-
-
 /******************************************************************************/
 VSQMessenger::VSQMessenger(QNetworkAccessManager *networkAccessManager, VSQSettings *settings)
     : QObject()
@@ -136,9 +106,24 @@ VSQMessenger::VSQMessenger(QNetworkAccessManager *networkAccessManager, VSQSetti
     qRegisterMetaType<QXmppClient::Error>();
 
     // Connect to Database
+    m_storage = new VSQStorage(this);
     _connectToDatabase();
-    m_sqlConversations = new VSQSqlConversationModel(this);
-    m_sqlChatModel = new VSQSqlChatModel(this);
+    m_sqlConversations = new VSQSqlConversationModel(m_storage, m_settings, this);
+    m_sqlChatModel = new VSQSqlChatModel(m_storage, this);
+    m_sqlSearchModel = new VSQSqlSearchModel(m_storage, m_sqlConversations, this);
+    m_peerCapabilities = new VSQPeerCapabilities(m_storage, this);
+    m_outbox = new VSQOutbox(m_storage, m_sqlConversations, [this](const QString &messageId) {
+        return _sendQueuedMessage(messageId);
+    }, this);
+    m_receivePipeline = new VSQReceivePipeline([this](const QString &sender, const QString &device, const QString &body) {
+        return decryptMessage(sender, device, body);
+    }, this);
+    connect(m_receivePipeline, &VSQReceivePipeline::received, this, &VSQMessenger::onMessagesDecrypted);
+    m_historySync = new VSQHistorySync(&m_xmpp, m_storage, m_sqlConversations,
+                                       [this](const QString &sender, const QString &device, const QString &body) {
+        return decryptMessage(sender, device, body);
+    }, this);
+    connect(m_historySync, &VSQHistorySync::received, this, &VSQMessenger::onHistoryReceived);
 
     // Add receipt messages extension
     m_xmppReceiptManager = new QXmppMessageReceiptManager();
@@ -147,6 +132,7 @@ VSQMessenger::VSQMessenger(QNetworkAccessManager *networkAccessManager, VSQSetti
 
     m_xmpp.addExtension(m_xmppReceiptManager);
     m_xmpp.addExtension(m_xmppCarbonManager);
+    m_connection = new VSQConnectionManager(&m_xmpp, this);
 
     // Signal connection
     connect(this, SIGNAL(fireReadyToAddContact(QString)), this, SLOT(onAddContactToDB(QString)));
@@ -188,6 +174,20 @@ VSQMessenger::VSQMessenger(QNetworkAccessManager *networkAccessManager, VSQSetti
 
 VSQMessenger::~VSQMessenger()
 {
+    // Outbox sends and decryption use members of the messenger, so they are finished first.
+    // Sends stop waiting for this thread, so outbox doesn't wait for them forever
+    m_stopping.storeRelease(1);
+    delete m_outbox;
+    m_outbox = nullptr;
+    delete m_receivePipeline;
+    m_receivePipeline = nullptr;
+    delete m_historySync;
+    m_historySync = nullptr;
+
+    // Write pending database mutations before shutdown
+    if (m_storage) {
+        m_storage->close();
+    }
 }
 
 void
@@ -205,13 +205,6 @@ VSQMessenger::onMessageDelivered(const QString& to, const QString& messageId) {
 /******************************************************************************/
 void
 VSQMessenger::_connectToDatabase() {
-    QSqlDatabase database = QSqlDatabase::database();
-    if (!database.isValid()) {
-        database = QSqlDatabase::addDatabase("QSQLITE");
-        if (!database.isValid())
-            qFatal("Cannot add database: %s", qPrintable(database.lastError().text()));
-    }
-
     const QDir writeDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
     if (!writeDir.mkpath("."))
         qFatal("Failed to create writable directory at %s", qPrintable(writeDir.absolutePath()));
@@ -219,10 +212,9 @@ VSQMessenger::_connectToDatabase() {
     // Ensure that we have a writable location on all devices.
     const QString fileName = writeDir.absolutePath() + "/chat-database.sqlite3";
     // When using the SQLite driver, open() will create the SQLite database if it doesn't exist.
-    database.setDatabaseName(fileName);
-    if (!database.open()) {
+    if (!m_storage->open(fileName)) {
         QFile::remove(fileName);
-        qFatal("Cannot open database: %s", qPrintable(database.lastError().text()));
+        qFatal("Cannot open database: %s", qPrintable(fileName));
     }
 }
 
@@ -248,20 +240,9 @@ VSQMessenger::_xmppPass() {
 }
 
 /******************************************************************************/
-Q_DECLARE_METATYPE(QXmppConfiguration)
 bool
-VSQMessenger::_connect(QString userWithEnv, QString deviceId, QString userId, bool forced) {
-    if (forced) {
-        m_connectGuard.lock();
-    } else if (!m_connectGuard.tryLock()) {
-        return false;
-    }
-
-    static int cnt = 0;
-
-    const int cur_val = cnt++;
-
-    qCDebug(lcNetwork) << ">>>>>>>>>>> _connect: START " << cur_val;
+VSQMessenger::_connect(QString userWithEnv, QString deviceId, QString userId) {
+    qCDebug(lcNetwork) << "Connect:" << userId;
 
     // Update users list
     _addToUsersList(userWithEnv);
@@ -291,52 +272,29 @@ VSQMessenger::_connect(QString userWithEnv, QString deviceId, QString userId, bo
 
     m_xmpp.setLogger(logger);
 #endif
-    if (m_xmpp.isConnected()) {
-        // Wait for disconnection
-        QTimer timer;
-        timer.setSingleShot(true);
-        QEventLoop loop;
-        connect(&m_xmpp, &QXmppClient::connected, &loop, &QEventLoop::quit);
-        connect(&m_xmpp, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
-        connect(&m_xmpp, &QXmppClient::error, &loop, &QEventLoop::quit);
-        connect( &timer, &QTimer::timeout, &loop, &QEventLoop::quit);
-
-        QMetaObject::invokeMethod(&m_xmpp, "disconnectFromServer", Qt::QueuedConnection);
-
-        timer.start(2000);
-        loop.exec();
-    }
 
-    // Wait for connection
-    QTimer timer;
-    timer.setSingleShot(true);
-    QEventLoop loop;
-    connect(&m_xmpp, &QXmppClient::connected, &loop, &QEventLoop::quit);
-    connect(&m_xmpp, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
-    connect(&m_xmpp, &QXmppClient::error, &loop, &QEventLoop::quit);
-    connect( &timer, &QTimer::timeout, &loop, &QEventLoop::quit);
-
-    qRegisterMetaType<QXmppConfiguration>("QXmppConfiguration");
-    QMetaObject::invokeMethod(&m_xmpp, "connectToServer", Qt::QueuedConnection, Q_ARG(QXmppConfiguration, conf));
-
-    timer.start(kConnectionWaitMs);
-    loop.exec();
-
-    const bool connected = m_xmpp.isConnected();
-    qCDebug(lcNetwork) << "<<<<<<<<<<< _connect: FINISH connected = " << connected << "  " << cur_val;
-
-    qDebug() << "Carbons " << (connected ? "enable" : "disable");
-    m_xmppCarbonManager->setCarbonsEnabled(connected);
-    m_connectGuard.unlock();
+    // Connection manager drives the attempt in the client thread, this thread only waits for its result.
+    // Failed attempt is retried by connection manager
+    struct Attempt
+    {
+        QSemaphore finished;
+        bool connected = false;
+    };
+    const auto attempt = std::make_shared<Attempt>();
+    m_connection->connectToServer(conf, [attempt](bool connected) {
+        attempt->connected = connected;
+        attempt->finished.release();
+    });
+    const bool connected = attempt->finished.tryAcquire(1, kConnectionWaitMs) && attempt->connected;
+    qCDebug(lcNetwork) << "Connect finished, connected:" << connected;
     return connected;
 }
 
 /******************************************************************************/
 void
 VSQMessenger::onProcessNetworkState(bool online) {
-    if (online) {
-        _reconnect();
-    } else {
+    m_connection->setNetworkOnline(online);
+    if (!online) {
         emit fireError("No internet connection");
     }
 }
@@ -372,10 +330,14 @@ VSQMessenger::_prepareLogin(const QString &user) {
         }
     }
 
-    vs_messenger_virgil_logout();
     char *cCABundle = strdup(_caBundleFile().toStdString().c_str());
-    if (VS_CODE_OK != vs_messenger_virgil_init(_virgilURL().toStdString().c_str(), cCABundle)) {
-        qCritical() << "Cannot initialize low level messenger";
+    {
+        // Messages of the previous user can still be encrypted or decrypted by workers
+        QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
+        vs_messenger_virgil_logout();
+        if (VS_CODE_OK != vs_messenger_virgil_init(_virgilURL().toStdString().c_str(), cCABundle)) {
+            qCritical() << "Cannot initialize low level messenger";
+        }
     }
     free(cCABundle);
 
@@ -383,17 +345,33 @@ VSQMessenger::_prepareLogin(const QString &user) {
     m_logging->setkApp(kApp);
     m_logging->setkOrganization(kOrganization);
 
-    // Set current user
+    // Set current user, models are switched by _loadUser()
     m_user = userId;
-    m_sqlConversations->setUser(userId);
-    m_sqlChatModel->init(userId);
-
-    // Inform about user activation
-    emit fireCurrentUserChanged();
 
     return userId;
 }
 
+/******************************************************************************/
+void
+VSQMessenger::_loadUser(const QString &userId) {
+    // Long migrations of messages don't block the GUI thread, models find the tables up to date
+    if (!m_sqlConversations->migrate(userId)) {
+        qCritical() << "Failed to migrate messages of user:" << userId;
+    }
+
+    QMetaObject::invokeMethod(this, [this, userId]() {
+        m_sqlConversations->setUser(userId);
+        m_sqlChatModel->init(userId);
+        m_outbox->setUser(userId);
+        m_peerCapabilities->setUser(userId);
+        m_receivePipeline->reset();
+        m_historySync->setUser(userId);
+
+        // Inform about user activation
+        emit fireCurrentUserChanged();
+    }, Qt::BlockingQueuedConnection);
+}
+
 /******************************************************************************/
 QString VSQMessenger::currentUser() const {
     return m_user;
@@ -425,6 +403,7 @@ QFuture<VSQMessenger::EnResult>
 VSQMessenger::signInWithBackupKey(QString username, QString password) {
     m_userId = _prepareLogin(username);
     return QtConcurrent::run([=]() -> EnResult {
+        _loadUser(m_userId);
 
         vs_messenger_virgil_user_creds_t creds;
         memset(&creds, 0, sizeof (creds));
@@ -440,7 +419,7 @@ VSQMessenger::signInWithBackupKey(QString username, QString password) {
         // Save credentials
         _saveCredentials(username, m_deviceId, creds);
 
-        return _connect(m_user, m_deviceId, m_userId, true) ? MRES_OK : MRES_ERR_SIGNIN;;
+        return _connect(m_user, m_deviceId, m_userId) ? MRES_OK : MRES_ERR_SIGNIN;;
     });
 }
 
@@ -449,6 +428,7 @@ QFuture<VSQMessenger::EnResult>
 VSQMessenger::signIn(QString user) {
     m_userId = _prepareLogin(user);
     return QtConcurrent::run([=]() -> EnResult {
+        _loadUser(m_userId);
         qDebug() << "Trying to Sign In: " << m_userId;
 
         vs_messenger_virgil_user_creds_t creds;
@@ -472,7 +452,7 @@ VSQMessenger::signIn(QString user) {
         m_logging->checkAppCrash();
 
         // Connect over XMPP
-        return _connect(m_user, m_deviceId, m_userId, true) ? MRES_OK : MRES_ERR_SIGNIN;
+        return _connect(m_user, m_deviceId, m_userId) ? MRES_OK : MRES_ERR_SIGNIN;
     });
 }
 
@@ -483,6 +463,7 @@ QFuture<VSQMessenger::EnResult>
 VSQMessenger::signUp(QString user) {
     m_userId = _prepareLogin(user);
     return QtConcurrent::run([=]() -> EnResult {
+        _loadUser(m_userId);
         qInfo() << "Trying to sign up: " << m_userId;
 
         vs_messenger_virgil_user_creds_t creds;
@@ -503,7 +484,7 @@ VSQMessenger::signUp(QString user) {
         _saveCredentials(m_userId, m_deviceId, creds);
 
         // Connect over XMPP
-        return _connect(m_user, m_deviceId, m_userId, true) ? MRES_OK : MRES_ERR_SIGNUP;
+        return _connect(m_user, m_deviceId, m_userId) ? MRES_OK : MRES_ERR_SIGNUP;
     });
 }
 
@@ -554,17 +535,16 @@ void VSQMessenger::onDownloadThumbnail(const StMessage message, const QString se
     });
 }
 
-void VSQMessenger::onAttachmentStatusChanged(const QString &uploadId, const Enums::AttachmentStatus status)
+void VSQMessenger::onAttachmentStatusChanged(const TransferId &id, const Enums::AttachmentStatus status)
 {
-    const auto id = TransferId::parse(uploadId);
     if (id.type == TransferId::Type::File) {
         m_sqlConversations->setAttachmentStatus(id.messageId, status);
     }
 }
 
-void VSQMessenger::onAttachmentProgressChanged(const QString &uploadId, const DataSize bytesReceived, const DataSize bytesTotal)
+void VSQMessenger::onAttachmentProgressChanged(const TransferId &id, const DataSize bytesReceived, const DataSize bytesTotal)
 {
-    const auto id = TransferId::parse(uploadId);
+    // Transfers rate-limit progress themselves, the last progress goes before the status
     if (id.type == TransferId::Type::File) {
         m_sqlConversations->setAttachmentProgress(id.messageId, bytesReceived, bytesTotal);
     }
@@ -721,11 +701,13 @@ QFuture<VSQMessenger::EnResult>
 VSQMessenger::logout() {
     return QtConcurrent::run([=]() -> EnResult {
         qDebug() << "Logout";
+        m_storage->writeQueue()->flush();
         m_user = "";
         m_userId = "";
         m_xmppPass = "";
         QMetaObject::invokeMethod(this, "onSubscribePushNotifications", Qt::BlockingQueuedConnection, Q_ARG(bool, false));
-        QMetaObject::invokeMethod(&m_xmpp, "disconnectFromServer", Qt::BlockingQueuedConnection);
+        QMetaObject::invokeMethod(m_connection, &VSQConnectionManager::stop, Qt::BlockingQueuedConnection);
+        QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
         vs_messenger_virgil_logout();
         return MRES_OK;
     });
@@ -737,7 +719,7 @@ QFuture<VSQMessenger::EnResult> VSQMessenger::disconnect() {
     return QtConcurrent::run([=]() -> EnResult {
         qDebug() << "Disconnect";
         if (connected) {
-            QMetaObject::invokeMethod(&m_xmpp, "disconnectFromServer", Qt::BlockingQueuedConnection);
+            QMetaObject::invokeMethod(m_connection, &VSQConnectionManager::disconnectFromServer, Qt::BlockingQueuedConnection);
         }
         return MRES_OK;
     });
@@ -764,6 +746,16 @@ VSQMessenger::getChatModel() {
     return *m_sqlChatModel;
 }
 
+VSQSqlSearchModel &
+VSQMessenger::getSearchModel() {
+    return *m_sqlSearchModel;
+}
+
+VSQHistorySync *
+VSQMessenger::historySync() const {
+    return m_historySync;
+}
+
 void VSQMessenger::setLogging(VSQLogging *loggingPtr) {
     m_logging = loggingPtr;
 }
@@ -816,6 +808,15 @@ VSQMessenger::onSubscribePushNotifications(bool enable) {
 /******************************************************************************/
 void
 VSQMessenger::onConnected() {
+    if (VSQConnectionManager::isStreamResumed(&m_xmpp)) {
+        // Server kept carbons and push subscription of the session
+        qCDebug(lcNetwork) << "Stream is resumed";
+        return;
+    }
+    // Messages archived while the client was offline
+    m_historySync->start();
+    qDebug() << "Carbons enable";
+    m_xmppCarbonManager->setCarbonsEnabled(true);
     onSubscribePushNotifications(true);
 }
 
@@ -823,77 +824,8 @@ VSQMessenger::onConnected() {
 void
 VSQMessenger::onReadyToUpload() {
     emit fireReady();
-    _sendFailedMessages();
-}
-
-/******************************************************************************/
-void
-VSQMessenger::_sendFailedMessages() {
-   auto messages = m_sqlConversations->getMessages(m_user, StMessage::Status::MST_FAILED);
-   QtConcurrent::run([=]() {
-       for (int i = 0; i < messages.length(); i++) {
-           const auto &msg = messages[i];
-           if (MRES_OK != _sendMessageInternal(false, msg.messageId, msg.recipient, msg.message, msg.attachment)) {
-               break;
-           }
-       }
-   });
-}
-
-QString VSQMessenger::createJson(const QString &message, const OptionalAttachment &attachment)
-{
-    QJsonObject mainObject;
-    QJsonObject payloadObject;
-    if (!attachment) {
-        mainObject.insert("type", "text");
-        payloadObject.insert("body", message);
-    }
-    else if (attachment->type == Attachment::Type::Picture) {
-        mainObject.insert("type", "picture");
-        payloadObject.insert("url", attachment->remoteUrl.toString());
-        payloadObject.insert("displayName", attachment->displayName);
-        payloadObject.insert("thumbnailUrl", attachment->remoteThumbnailUrl.toString());
-        payloadObject.insert("thumbnailWidth", attachment->thumbnailSize.width());
-        payloadObject.insert("thumbnailHeight", attachment->thumbnailSize.height());
-        payloadObject.insert("bytesTotal", attachment->bytesTotal);
-    }
-    else {
-        mainObject.insert("type", "file");
-        payloadObject.insert("url", attachment->remoteUrl.toString());
-        payloadObject.insert("displayName", attachment->displayName);
-        payloadObject.insert("bytesTotal", attachment->bytesTotal);
-    }
-    mainObject.insert("payload", payloadObject);
-
-    QJsonDocument doc(mainObject);
-    return doc.toJson(QJsonDocument::Compact);
-}
-
-StMessage VSQMessenger::parseJson(const QJsonDocument &json)
-{
-    const auto type = json["type"].toString();
-    const auto payload = json["payload"];
-    StMessage message;
-    if (type == QLatin1String("text")) {
-        message.message = payload["body"].toString();
-        return message;
-    }
-    Attachment attachment;
-    attachment.id = VSQUtils::createUuid();
-    attachment.remoteUrl = payload["url"].toString();
-    attachment.displayName = payload["displayName"].toString();
-    attachment.bytesTotal = payload["bytesTotal"].toInt();
-    message.message = attachment.displayName;
-    if (type == QLatin1String("picture")) {
-        attachment.type = Attachment::Type::Picture;
-        attachment.remoteThumbnailUrl = payload["thumbnailUrl"].toString();
-        attachment.thumbnailSize = QSize(payload["thumbnailWidth"].toInt(), payload["thumbnailHeight"].toInt());
-    }
-    else {
-        attachment.type = Attachment::Type::File;
-    }
-    message.attachment = attachment;
-    return message;
+    // Queued messages are sent once uploads are possible
+    m_outbox->setOnline(true);
 }
 
 OptionalAttachment VSQMessenger::uploadAttachment(const QString messageId, const QString recipient, const Attachment &attachment)
@@ -932,7 +864,7 @@ OptionalAttachment VSQMessenger::uploadAttachment(const QString messageId, const
             });
             connect(upload, &VSQUpload::connectionChanged, &loop, &QEventLoop::quit);
             qCDebug(lcMessenger) << "Upload waiting: start";
-            loop.exec();
+            _execWorkerLoop(loop);
             QObject::disconnect(con);
             QMutexLocker l(&guard);
             qCDebug(lcMessenger) << "Upload waiting: end";
@@ -974,8 +906,8 @@ OptionalAttachment VSQMessenger::uploadAttachment(const QString messageId, const
                 loop.quit();
             });
             connect(upload, &VSQUpload::connectionChanged, &loop, &QEventLoop::quit);
-            qCDebug(lcMessenger) << ": start";
-            loop.exec();
+            qCDebug(lcMessenger) << "Upload waiting: start";
+            _execWorkerLoop(loop);
             QObject::disconnect(con);
             QMutexLocker locker(&guard);
             qCDebug(lcMessenger) << "Upload waiting: end";
@@ -1026,9 +958,8 @@ VSQMessenger::checkState() {
 void
 VSQMessenger::_reconnect() {
     if (!m_user.isEmpty() && !m_userId.isEmpty() && vs_messenger_virgil_is_signed_in()) {
-        QtConcurrent::run([=]() {
-            _connect(m_user, m_deviceId, m_userId);
-        });
+        // No-op while an attempt is in flight or planned
+        m_connection->reconnect();
     }
 }
 
@@ -1039,6 +970,9 @@ VSQMessenger::onDisconnected() {
 
     qDebug() << "Carbons disable";
     m_xmppCarbonManager->setCarbonsEnabled(false);
+
+    m_outbox->setOnline(false);
+    m_historySync->stop();
 }
 
 /******************************************************************************/
@@ -1050,35 +984,41 @@ VSQMessenger::onError(QXmppClient::Error err) {
 }
 
 /******************************************************************************/
-Optional<StMessage> VSQMessenger::decryptMessage(const QString &sender, const QString &message) {
-    static const size_t _decryptedMsgSzMax = 10 * 1024;
-    uint8_t decryptedMessage[_decryptedMsgSzMax];
-    size_t decryptedMessageSz = 0;
-
+Optional<StMessage> VSQMessenger::decryptMessage(const QString &sender, const QString &device, const QString &message) {
     qDebug() << "Sender            : " << sender;
     qDebug() << "Encrypted message : " << message.length() << " bytes";
 
-    // Decrypt message
-    // DECRYPTED_MESSAGE_SZ_MAX - 1  - This is required for a Zero-terminated string
-    if (VS_CODE_OK != vs_messenger_virgil_decrypt_msg(
-                sender.toStdString().c_str(),
-                message.toStdString().c_str(),
-                decryptedMessage, decryptedMessageSz - 1,
-                &decryptedMessageSz)) {
-        VS_LOG_WARNING("Received message cannot be decrypted");
-        return NullOptional;
+    // Ciphertext is base64, so it's converted without decoding and is zero-terminated
+    const QByteArray ciphertext = message.toLatin1();
+    auto decryptedMessage = m_cryptoBuffers.acquire(VSQCryptoBufferPool::decryptedSize(ciphertext.size()));
+    size_t decryptedMessageSz = 0;
+
+    // Decrypt message, one byte is reserved for zero termination
+    {
+        QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
+        if (VS_CODE_OK != vs_messenger_virgil_decrypt_msg(
+                    sender.toUtf8().constData(),
+                    ciphertext.constData(),
+                    decryptedMessage.data(), decryptedMessage.size() - 1,
+                    &decryptedMessageSz)) {
+            VS_LOG_WARNING("Received message cannot be decrypted");
+            return NullOptional;
+        }
     }
 
     // Add Zero termination
-    decryptedMessage[decryptedMessageSz] = 0;
-
-    // Get message from JSON
-    QByteArray baDecr(reinterpret_cast<char *> (decryptedMessage), static_cast<int> (decryptedMessageSz));
-    QJsonDocument jsonMsg(QJsonDocument::fromJson(baDecr));
-
-    qCDebug(lcMessenger) << "JSON for parsing:" << jsonMsg;
-    auto msg = parseJson(jsonMsg);
-    qCDebug(lcMessenger) << "Received message: " << msg.message;
+    decryptedMessage.data()[decryptedMessageSz] = 0;
+
+    // Get message from envelope, pooled buffer is parsed in place
+    const auto envelope = QByteArray::fromRawData(reinterpret_cast<const char *>(decryptedMessage.data()),
+                                                  static_cast<int>(decryptedMessageSz));
+    auto peerFormat = VSQMessageEnvelope::Format::Json;
+    auto msg = VSQMessageEnvelope::decode(envelope, &peerFormat);
+    if (!msg) {
+        return NullOptional;
+    }
+    m_peerCapabilities->setEnvelopeFormat(sender, device, peerFormat);
+    qCDebug(lcMessenger) << "Received message: " << msg->message;
     return msg;
 }
 
@@ -1088,105 +1028,223 @@ VSQMessenger::onMessageReceived(const QXmppMessage &message) {
 
     QString sender = message.from().split("@").first();
     QString recipient = message.to().split("@").first();
+    // Formats are learned per device of the sender
+    QString device = QXmppUtils::jidToResource(message.from());
 
     qInfo() << "Sender: " << sender << " Recipient: " << recipient;
 
-    // Decrypt message
-    auto msg = decryptMessage(sender, message.body());
-    if (!msg)
-        return;
+    // Decrypt message in background, messages of the sender are delivered in order
+    m_receivePipeline->submit(message.id(), sender, device, recipient, message.body());
+}
 
-    msg->messageId = message.id();
-    if (sender == currentUser()) {
-        QString recipient = message.to().split("@").first();
-        m_sqlConversations->createMessage(recipient, msg->message, msg->messageId, msg->attachment);
-        m_sqlConversations->setMessageStatus(msg->messageId, StMessage::Status::MST_SENT);
-        // ensure private chat with recipient exists
-        m_sqlChatModel->createPrivateChat(recipient);
-        emit fireNewMessage(sender, msg->message);
-        return;
-    }
+/******************************************************************************/
+void
+VSQMessenger::onMessagesDecrypted(const QList<StMessage> &messages) {
+    _ingestMessages(messages, true);
+}
+
+/******************************************************************************/
+void
+VSQMessenger::onHistoryReceived(const QList<StMessage> &messages) {
+    // System isn't notified about messages of the past
+    _ingestMessages(messages, false);
+}
+
+/******************************************************************************/
+void
+VSQMessenger::_ingestMessages(const QList<StMessage> &messages, bool notify) {
+    QList<StMessage> receivedMessages;
+    // Sender => count of messages, senders are ordered by their last message
+    QStringList senders;
+    QHash<QString, int> senderMessageCounts;
+    QHash<QString, QString> lastMessages;
+
+    for (const auto &msg : messages) {
+        if (msg.sender == currentUser()) {
+            // Message sent from our account by another client is stored with received ones,
+            // ensure private chat with recipient exists
+            m_sqlChatModel->createPrivateChat(msg.recipient);
+            if (notify) {
+                emit fireNewMessage(msg.sender, msg.message);
+            }
+            continue;
+        }
 
-    // Add sender to contact
-    m_sqlChatModel->createPrivateChat(sender);
-    // Save message to DB
-    m_sqlConversations->receiveMessage(msg->messageId, sender, msg->message, msg->attachment);
-    m_sqlChatModel->updateLastMessage(sender, msg->message);
-    if (sender != m_recipient) {
-        m_sqlChatModel->updateUnreadMessageCount(sender);
+        // Add sender to contact
+        if (!senderMessageCounts.contains(msg.sender)) {
+            m_sqlChatModel->createPrivateChat(msg.sender);
+        }
+        senders.removeOne(msg.sender);
+        senders.append(msg.sender);
+        ++senderMessageCounts[msg.sender];
+        lastMessages[msg.sender] = msg.message;
+        receivedMessages.append(msg);
     }
 
-    if (msg->attachment && msg->attachment->type == Attachment::Type::Picture) {
-        emit downloadThumbnail(*msg, sender, QPrivateSignal());
+    // Save messages to DB, the opened conversation is updated once
+    m_sqlConversations->receiveMessages(messages);
+    if (receivedMessages.isEmpty()) {
+        return;
+    }
+    for (const auto &sender : senders) {
+        m_sqlChatModel->updateLastMessage(sender, lastMessages[sender]);
+        if (sender != m_recipient) {
+            m_sqlChatModel->incrementUnreadMessageCount(sender, senderMessageCounts[sender]);
+        }
+        else {
+            m_sqlChatModel->resetUnreadMessageCount(sender);
+        }
     }
 
-    // Inform system about new message
-    emit fireNewMessage(sender, msg->message);
+    for (const auto &msg : receivedMessages) {
+        if (msg.attachment && msg.attachment->type == Attachment::Type::Picture) {
+            emit downloadThumbnail(msg, msg.sender, QPrivateSignal());
+        }
+
+        // Inform system about new message
+        if (notify) {
+            emit fireNewMessage(msg.sender, msg.message);
+        }
+    }
 }
 
 /******************************************************************************/
 
 VSQMessenger::EnResult
-VSQMessenger::_sendMessageInternal(bool createNew, const QString &messageId, const QString &to, const QString &message, const OptionalAttachment &attachment)
+VSQMessenger::_queueMessage(const QString &messageId, const QString &to, const QString &message, const OptionalAttachment &attachment)
 {
     // Write to database
-    if(createNew) {
-        m_sqlConversations->createMessage(to, message, messageId, attachment);
-    }
+    m_sqlConversations->createMessage(to, message, messageId, attachment);
     m_sqlChatModel->updateLastMessage(to, message);
+    m_outbox->enqueue(messageId, to, attachment ? VSQOutbox::Priority::Attachment : VSQOutbox::Priority::Text);
+    return MRES_OK;
+}
+
+/******************************************************************************/
+
+VSQOutbox::Result
+VSQMessenger::_sendQueuedMessage(const QString &messageId)
+{
+    const auto storedMessage = m_sqlConversations->getMessage(messageId);
+    if (!storedMessage) {
+        qCWarning(lcMessenger) << "Queued message doesn't exist:" << messageId;
+        return VSQOutbox::Result::Dropped;
+    }
+    const QString &to = storedMessage->recipient;
+    const QString &message = storedMessage->message;
 
     OptionalAttachment updloadedAttacment;
-    if (attachment) {
+    if (storedMessage->attachment) {
         qCDebug(lcMessenger) << "Trying to upload the attachment";
-        updloadedAttacment = uploadAttachment(messageId, to, *attachment);
+        updloadedAttacment = uploadAttachment(messageId, to, *storedMessage->attachment);
         if (!updloadedAttacment) {
             qCDebug(lcMessenger) << "Attachment was NOT uploaded";
-            return MRES_OK; // don't send message
+            return VSQOutbox::Result::Failed; // don't send message
         }
         qCDebug(lcMessenger) << "Everything was uploaded. Continue to send message";
     }
 
-    QMutexLocker _guard(&m_messageGuard);
-    static const size_t _encryptedMsgSzMax = 20 * 1024;
-    uint8_t encryptedMessage[_encryptedMsgSzMax];
-    size_t encryptedMessageSz = 0;
-
-    // Create JSON-formatted message to be sent
-    const QString internalJson = createJson(message, updloadedAttacment);
-    qDebug() << "Json for encryption:" << internalJson;
+    // Create envelope in format understood by the recipient
+    StMessage envelopeMessage;
+    envelopeMessage.message = message;
+    envelopeMessage.attachment = updloadedAttacment;
+    const auto format = m_peerCapabilities->envelopeFormat(to);
+    const QByteArray envelope = VSQMessageEnvelope::encode(envelopeMessage, format);
+    qCDebug(lcMessenger) << "Envelope for encryption:" << envelope.size() << "bytes, CBOR:"
+                         << (format == VSQMessageEnvelope::Format::Cbor);
 
     // Encrypt message
-    auto plaintext = internalJson.toStdString();
-    if (VS_CODE_OK != vs_messenger_virgil_encrypt_msg(
-                     to.toStdString().c_str(),
-                     reinterpret_cast<const uint8_t*>(plaintext.c_str()),
-                     plaintext.length(),
-                     encryptedMessage,
-                     _encryptedMsgSzMax,
-                     &encryptedMessageSz)) {
-        VS_LOG_WARNING("Cannot encrypt message to be sent");
-
+    const auto encryptedStr = _encryptMessage(to, envelope);
+    if (!encryptedStr) {
         // Mark message as failed
         m_sqlConversations->setMessageStatus(messageId, StMessage::Status::MST_FAILED);
-        return MRES_ERR_ENCRYPTION;
+        return VSQOutbox::Result::Failed;
     }
 
     // Send encrypted message
     QString toJID = to + "@" + _xmppURL();
     QString fromJID = currentUser() + "@" + _xmppURL();
-    QString encryptedStr = QString::fromLatin1(reinterpret_cast<char*>(encryptedMessage), encryptedMessageSz);
 
-    QXmppMessage msg(fromJID, toJID, encryptedStr);
+    QXmppMessage msg(fromJID, toJID, *encryptedStr);
     msg.setReceiptRequested(true);
     msg.setId(messageId);
 
-    // Send message and update status
-    if (m_xmpp.sendPacket(msg)) {
+    // Send message and update status. Outbox sends next message of the lane after this one
+    // is handed to XMPP client, so order of lane messages is kept
+    if (_sendPacket(msg)) {
         m_sqlConversations->setMessageStatus(messageId, StMessage::Status::MST_SENT);
-    } else {
-        m_sqlConversations->setMessageStatus(messageId, StMessage::Status::MST_FAILED);
+        return VSQOutbox::Result::Sent;
+    }
+    m_sqlConversations->setMessageStatus(messageId, StMessage::Status::MST_FAILED);
+    return VSQOutbox::Result::Failed;
+}
+
+/******************************************************************************/
+
+Optional<QString>
+VSQMessenger::_encryptMessage(const QString &recipient, const QByteArray &plaintext)
+{
+    // Outbox workers prepare messages in parallel, buffer is taken from the pool per call.
+    // Library call itself is serialized
+    auto encryptedMessage = m_cryptoBuffers.acquire(VSQCryptoBufferPool::encryptedSize(plaintext.size()));
+    size_t encryptedMessageSz = 0;
+
+    QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
+    if (VS_CODE_OK != vs_messenger_virgil_encrypt_msg(
+                     recipient.toUtf8().constData(),
+                     reinterpret_cast<const uint8_t*>(plaintext.constData()),
+                     plaintext.size(),
+                     encryptedMessage.data(),
+                     encryptedMessage.size(),
+                     &encryptedMessageSz)) {
+        VS_LOG_WARNING("Cannot encrypt message to be sent");
+        return NullOptional;
+    }
+    return QString::fromLatin1(reinterpret_cast<const char*>(encryptedMessage.data()), static_cast<int>(encryptedMessageSz));
+}
+
+/******************************************************************************/
+
+bool
+VSQMessenger::_sendPacket(const QXmppMessage &packet)
+{
+    if (QThread::currentThread() == m_xmpp.thread()) {
+        return m_xmpp.sendPacket(packet);
+    }
+    // Client thread doesn't process events during shutdown, so the wait is given up when messenger stops.
+    // Pending call is dropped with the client
+    struct Call
+    {
+        QSemaphore finished;
+        bool sent = false;
+    };
+    const auto call = std::make_shared<Call>();
+    QMetaObject::invokeMethod(&m_xmpp, [this, packet, call]() {
+        call->sent = m_xmpp.sendPacket(packet);
+        call->finished.release();
+    }, Qt::QueuedConnection);
+    while (!call->finished.tryAcquire(1, kStopPollIntervalMs)) {
+        if (m_stopping.loadAcquire()) {
+            return false;
+        }
+    }
+    return call->sent;
+}
+
+void
+VSQMessenger::_execWorkerLoop(QEventLoop &loop)
+{
+    QTimer stopTimer;
+    stopTimer.setInterval(kStopPollIntervalMs);
+    connect(&stopTimer, &QTimer::timeout, &loop, [this, &loop]() {
+        if (m_stopping.loadAcquire()) {
+            loop.quit();
+        }
+    });
+    stopTimer.start();
+    if (!m_stopping.loadAcquire()) {
+        loop.exec();
     }
-    return MRES_OK;
 }
 
 void VSQMessenger::downloadAndProcess(StMessage message, const Function &func)
@@ -1240,7 +1298,7 @@ QFuture<VSQMessenger::EnResult>
 VSQMessenger::createSendMessage(const QString messageId, const QString to, const QString message)
 {
     return QtConcurrent::run([=]() -> EnResult {
-        return _sendMessageInternal(true, messageId, to, message, NullOptional);
+        return _queueMessage(messageId, to, message, NullOptional);
     });
 }
 
@@ -1256,7 +1314,7 @@ VSQMessenger::createSendAttachment(const QString messageId, const QString to,
             fireWarning(warningText);
             return MRES_ERR_ATTACHMENT;
         }
-        return _sendMessageInternal(true, messageId, to, attachment->displayName, attachment);
+        return _queueMessage(messageId, to, attachment->displayName, attachment);
     });
 }
 
@@ -0,0 +1,321 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQOutbox.h"
+
+#include <QDateTime>
+#include <QRandomGenerator>
+#include <QRegExp>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+#include <QtConcurrent>
+
+#include "VSQSqlConversationModel.h"
+#include "VSQSqlMigrator.h"
+#include "VSQSqlStatementCache.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+
+Q_LOGGING_CATEGORY(lcOutbox, "outbox");
+
+// Recipients that are sent to at the same time. Encryption is serialized by the Virgil library lock,
+// workers overlap envelope encoding, uploads and waiting for the network with it
+static const int kMinConcurrentSends = 2;
+static const int kMaxConcurrentSends = 8;
+// First retry delay, it's doubled for every next failure
+static const qint64 kRetryBaseDelayMs = 1000;
+static const qint64 kRetryMaxDelayMs = 5 * 60 * 1000;
+// Message is parked after this count of failed attempts
+static const int kMaxSendAttempts = 10;
+
+VSQOutbox::VSQOutbox(VSQStorage *storage, VSQSqlConversationModel *conversations, const Sender &sender, QObject *parent)
+    : QObject(parent)
+    , m_storage(storage)
+    , m_writeQueue(storage->writeQueue())
+    , m_conversations(conversations)
+    , m_sender(sender)
+    , m_retryTimer(this)
+{
+    m_pool.setMaxThreadCount(qBound(kMinConcurrentSends, QThread::idealThreadCount(), kMaxConcurrentSends));
+    m_retryTimer.setSingleShot(true);
+    connect(&m_retryTimer, &QTimer::timeout, this, &VSQOutbox::schedule);
+}
+
+VSQOutbox::~VSQOutbox()
+{
+    // Nothing is started or retried anymore, results of running sends are ignored
+    m_online = false;
+    ++m_generation;
+    m_retryTimer.stop();
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+void VSQOutbox::setUser(const QString &user)
+{
+    if (user == m_user) {
+        return;
+    }
+    m_user = user;
+    ++m_generation;
+    m_inFlightCount = 0;
+    m_recipients.clear();
+    m_parkedMessages.clear();
+    m_retryTimer.stop();
+
+    const QString table = tableName();
+    const QString messagesTable = m_conversations->tableName();
+    const QString attachmentsTable = m_conversations->attachmentsTableName();
+    VSQSqlMigrator migrator(m_writeQueue, table);
+    migrator.addStep(1, [=](QSqlDatabase &database) {
+        QSqlQuery query(database);
+        if (!query.exec(QString("CREATE TABLE %1 ("
+                                "message_id TEXT NOT NULL PRIMARY KEY,"
+                                "recipient TEXT NOT NULL,"
+                                "priority INTEGER NOT NULL"
+                                ")").arg(table))) {
+            qCWarning(lcOutbox) << "Failed to create outbox:" << query.lastError().text();
+            return false;
+        }
+        // Messages that were created or failed before the outbox existed are queued in order of creation
+        query.prepare(QString("INSERT INTO %1 (message_id, recipient, priority)"
+                              " SELECT m.message_id, m.recipient,"
+                              " CASE WHEN a.message_id IS NULL AND m.attachment_id IS NULL THEN %4 ELSE %5 END"
+                              " FROM %2 m LEFT JOIN %3 a ON a.message_id = m.message_id"
+                              " WHERE m.author = ? AND m.status IN (?, ?) ORDER BY m.rowid")
+                      .arg(table, messagesTable, attachmentsTable)
+                      .arg(static_cast<int>(Priority::Text))
+                      .arg(static_cast<int>(Priority::Attachment)));
+        query.addBindValue(user);
+        query.addBindValue(static_cast<int>(StMessage::Status::MST_CREATED));
+        query.addBindValue(static_cast<int>(StMessage::Status::MST_FAILED));
+        if (!query.exec()) {
+            qCWarning(lcOutbox) << "Failed to queue unsent messages:" << query.lastError().text();
+            return false;
+        }
+        return true;
+    });
+    if (!migrator.migrate()) {
+        qCCritical(lcOutbox) << "Failed to migrate table" << table;
+        return;
+    }
+
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(
+            QString("SELECT message_id, recipient, priority FROM %1 ORDER BY rowid").arg(table));
+    int count = 0;
+    if (query.exec()) {
+        while (query.next()) {
+            const int lane = qBound(0, query.value(2).toInt(), 1);
+            m_recipients[query.value(1).toString()].lanes[lane].messageIds.push_back(query.value(0).toString());
+            ++count;
+        }
+    }
+    else {
+        qCWarning(lcOutbox) << "Failed to load outbox:" << query.lastError().text();
+    }
+    query.finish();
+    qCDebug(lcOutbox) << "Queued messages:" << count;
+    schedule();
+}
+
+void VSQOutbox::enqueue(const QString &messageId, const QString &recipient, Priority priority)
+{
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [=]() { enqueue(messageId, recipient, priority); }, Qt::QueuedConnection);
+        return;
+    }
+    m_writeQueue->insert(tableName(), "message_id", {
+        { "message_id", messageId },
+        { "recipient", recipient },
+        { "priority", static_cast<int>(priority) }
+    });
+    m_recipients[recipient].lanes[static_cast<int>(priority)].messageIds.push_back(messageId);
+    schedule();
+}
+
+void VSQOutbox::setOnline(bool online)
+{
+    m_online = online;
+    if (!online) {
+        m_retryTimer.stop();
+        return;
+    }
+    for (auto &recipient : m_recipients) {
+        for (auto &lane : recipient.lanes) {
+            lane.failureCount = 0;
+            lane.nextAttemptTime = 0;
+        }
+    }
+    for (const auto &parked : m_parkedMessages) {
+        qCDebug(lcOutbox) << "Failed message is queued again:" << parked.messageId;
+        m_recipients[parked.recipient].lanes[parked.laneIndex].messageIds.push_back(parked.messageId);
+    }
+    m_parkedMessages.clear();
+    schedule();
+}
+
+QString VSQOutbox::tableName() const
+{
+    QString name(m_user);
+    name.remove(QRegExp("[^a-z0-9_]"));
+    return QString("Outbox_") + name;
+}
+
+void VSQOutbox::schedule()
+{
+    if (!m_online) {
+        return;
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while (m_inFlightCount < m_pool.maxThreadCount()) {
+        // Text lanes go first, lanes of the same priority are served in turn
+        QString nextRecipient;
+        int nextLane = -1;
+        quint64 nextSequence = 0;
+        for (auto it = m_recipients.cbegin(); it != m_recipients.cend(); ++it) {
+            for (int laneIndex = 0; laneIndex < 2; ++laneIndex) {
+                const auto &lane = it.value().lanes[laneIndex];
+                if (lane.inFlight || lane.messageIds.empty() || lane.nextAttemptTime > now) {
+                    continue;
+                }
+                if (nextLane < 0 || laneIndex < nextLane || (laneIndex == nextLane && lane.servedSequence < nextSequence)) {
+                    nextRecipient = it.key();
+                    nextLane = laneIndex;
+                    nextSequence = lane.servedSequence;
+                }
+                break;
+            }
+        }
+        if (nextLane < 0) {
+            break;
+        }
+        start(nextRecipient, nextLane);
+    }
+
+    // Wake up when the nearest backoff expires
+    qint64 nextAttemptTime = 0;
+    for (const auto &recipient : m_recipients) {
+        for (const auto &lane : recipient.lanes) {
+            if (!lane.inFlight && !lane.messageIds.empty() && lane.nextAttemptTime > now
+                    && (nextAttemptTime == 0 || lane.nextAttemptTime < nextAttemptTime)) {
+                nextAttemptTime = lane.nextAttemptTime;
+            }
+        }
+    }
+    if (nextAttemptTime > 0) {
+        m_retryTimer.start(static_cast<int>(nextAttemptTime - now));
+    }
+    else {
+        m_retryTimer.stop();
+    }
+}
+
+void VSQOutbox::start(const QString &recipientName, int laneIndex)
+{
+    auto &lane = m_recipients[recipientName].lanes[laneIndex];
+    lane.inFlight = true;
+    lane.servedSequence = ++m_servedSequence;
+    ++m_inFlightCount;
+
+    const QString messageId = lane.messageIds.front();
+    const int generation = m_generation;
+    const Sender sender = m_sender;
+    QtConcurrent::run(&m_pool, [=]() {
+        const Result result = sender(messageId);
+        QMetaObject::invokeMethod(this, [=]() {
+            onSendFinished(generation, recipientName, laneIndex, messageId, result);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void VSQOutbox::onSendFinished(int generation, const QString &recipientName, int laneIndex, const QString &messageId, Result result)
+{
+    if (generation != m_generation) {
+        return;
+    }
+    --m_inFlightCount;
+    const auto it = m_recipients.find(recipientName);
+    if (it == m_recipients.end()) {
+        schedule();
+        return;
+    }
+
+    auto &lane = it.value().lanes[laneIndex];
+    lane.inFlight = false;
+    if (result == Result::Failed) {
+        ++lane.failureCount;
+        const qint64 delay = retryDelay(lane.failureCount);
+        lane.nextAttemptTime = QDateTime::currentMSecsSinceEpoch() + delay;
+        qCDebug(lcOutbox) << "Failed to send message:" << messageId << "retry in" << delay << "ms";
+        if (++lane.attemptCount < kMaxSendAttempts) {
+            schedule();
+            return;
+        }
+        // Parked message stays in the outbox, so it's queued again after restart too.
+        // Next message of the lane keeps the backoff
+        qCWarning(lcOutbox) << "Message failed" << lane.attemptCount << "times, it's parked:" << messageId;
+        m_conversations->setMessageStatus(messageId, StMessage::Status::MST_FAILED);
+        m_parkedMessages.push_back({ messageId, recipientName, laneIndex });
+    }
+    else {
+        if (result == Result::Dropped) {
+            qCWarning(lcOutbox) << "Message is dropped from outbox:" << messageId;
+        }
+        m_writeQueue->exec(QString("DELETE FROM %1 WHERE message_id = ?").arg(tableName()), { messageId });
+        lane.failureCount = 0;
+        lane.nextAttemptTime = 0;
+    }
+
+    lane.attemptCount = 0;
+    auto &queue = lane.messageIds;
+    if (!queue.empty() && queue.front() == messageId) {
+        queue.pop_front();
+    }
+    const auto &lanes = it.value().lanes;
+    if (lanes[0].messageIds.empty() && lanes[1].messageIds.empty() && !lanes[0].inFlight && !lanes[1].inFlight) {
+        m_recipients.erase(it);
+    }
+    schedule();
+}
+
+qint64 VSQOutbox::retryDelay(int failureCount)
+{
+    const int exponent = qBound(0, failureCount - 1, 16);
+    const qint64 delay = qMin(kRetryBaseDelayMs << exponent, kRetryMaxDelayMs);
+    // Half of the delay is random, so failed recipients aren't retried at once
+    return delay / 2 + QRandomGenerator::global()->bounded(static_cast<int>(delay / 2) + 1);
+}
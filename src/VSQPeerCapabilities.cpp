@@ -0,0 +1,158 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQPeerCapabilities.h"
+
+#include <QDateTime>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include "VSQSqlMigrator.h"
+#include "VSQSqlStatementCache.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+
+// Device that didn't send anything for this time is considered gone
+static const qint64 kDeviceLifetimeSecs = 30 * 24 * 60 * 60;
+// Seen time of a device is written at most once in this period, not for every message
+static const qint64 kSeenAtUpdateSecs = 24 * 60 * 60;
+
+VSQPeerCapabilities::VSQPeerCapabilities(VSQStorage *storage, QObject *parent)
+    : QObject(parent)
+    , m_storage(storage)
+    , m_writeQueue(storage->writeQueue())
+{}
+
+void VSQPeerCapabilities::setUser(const QString &user)
+{
+    QMutexLocker locker(&m_mutex);
+    if (user == m_user) {
+        return;
+    }
+    m_user = user;
+    m_devices.clear();
+
+    const QString table = tableName();
+    VSQSqlMigrator migrator(m_writeQueue, table);
+    migrator.addStep(1, {
+        QString("CREATE TABLE %1 ("
+                "peer TEXT NOT NULL PRIMARY KEY,"
+                "envelope_format INTEGER NOT NULL"
+                ")").arg(table)
+    });
+    // Formats were kept per peer, so one device switched all devices of the peer to CBOR.
+    // Devices learn formats again from next messages
+    migrator.addStep(2, {
+        QString("DROP TABLE %1").arg(table),
+        QString("CREATE TABLE %1 ("
+                "peer TEXT NOT NULL,"
+                "device TEXT NOT NULL,"
+                "envelope_format INTEGER NOT NULL,"
+                "seen_at INTEGER NOT NULL,"
+                "PRIMARY KEY (peer, device)"
+                ")").arg(table)
+    });
+    if (!migrator.migrate()) {
+        qCCritical(lcMessageEnvelope) << "Failed to migrate table" << table;
+        return;
+    }
+
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(QString("SELECT peer, device, envelope_format, seen_at FROM %1").arg(table));
+    if (query.exec()) {
+        while (query.next()) {
+            Device device;
+            device.format = static_cast<VSQMessageEnvelope::Format>(query.value(2).toInt());
+            device.seenAt = query.value(3).toLongLong();
+            m_devices[query.value(0).toString()].insert(query.value(1).toString(), device);
+        }
+    }
+    else {
+        qCWarning(lcMessageEnvelope) << "Failed to load peer capabilities:" << query.lastError().text();
+    }
+    query.finish();
+}
+
+VSQMessageEnvelope::Format VSQPeerCapabilities::envelopeFormat(const QString &peer) const
+{
+    QMutexLocker locker(&m_mutex);
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    // Other devices of the user get a carbon copy, the user may have none
+    if (understandCbor(m_devices.value(peer), now, false) && understandCbor(m_devices.value(m_user), now, true)) {
+        return VSQMessageEnvelope::Format::Cbor;
+    }
+    return VSQMessageEnvelope::Format::Json;
+}
+
+void VSQPeerCapabilities::setEnvelopeFormat(const QString &peer, const QString &deviceName,
+                                            VSQMessageEnvelope::Format format)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_user.isEmpty() || deviceName.isEmpty()) {
+        return;
+    }
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    auto &device = m_devices[peer][deviceName];
+    if (device.seenAt != 0 && device.format == format && now - device.seenAt < kSeenAtUpdateSecs) {
+        return;
+    }
+    device.format = format;
+    device.seenAt = now;
+    m_writeQueue->exec(QString("INSERT OR REPLACE INTO %1 (peer, device, envelope_format, seen_at) VALUES (?, ?, ?, ?)")
+                       .arg(tableName()), { peer, deviceName, static_cast<int>(format), now });
+}
+
+bool VSQPeerCapabilities::understandCbor(const Devices &devices, qint64 now, bool withoutDevices)
+{
+    bool hasDevices = false;
+    for (const auto &device : devices) {
+        if (now - device.seenAt >= kDeviceLifetimeSecs) {
+            continue;
+        }
+        if (device.format != VSQMessageEnvelope::Format::Cbor) {
+            return false;
+        }
+        hasDevices = true;
+    }
+    return hasDevices || withoutDevices;
+}
+
+QString VSQPeerCapabilities::tableName() const
+{
+    QString name(m_user);
+    name.remove(QRegExp("[^a-z0-9_]"));
+    return QString("Capabilities_") + name;
+}
@@ -0,0 +1,142 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQReceivePipeline.h"
+
+#include <QThread>
+#include <QtConcurrent>
+
+Q_LOGGING_CATEGORY(lcReceivePipeline, "receive-pipeline");
+
+// Decryption is CPU bound, so workers are bound to cores
+static const int kMinDecryptThreads = 2;
+static const int kMaxDecryptThreads = 8;
+// Delivered messages are held for a frame or so, a full batch is emitted at once
+static const int kBatchIntervalMs = 50;
+static const int kMaxBatchSize = 100;
+
+VSQReceivePipeline::VSQReceivePipeline(const Decryptor &decryptor, QObject *parent)
+    : QObject(parent)
+    , m_decryptor(decryptor)
+    , m_flushTimer(this)
+{
+    m_pool.setMaxThreadCount(qBound(kMinDecryptThreads, QThread::idealThreadCount(), kMaxDecryptThreads));
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(kBatchIntervalMs);
+    connect(&m_flushTimer, &QTimer::timeout, this, &VSQReceivePipeline::flush);
+}
+
+VSQReceivePipeline::~VSQReceivePipeline()
+{
+    // Workers don't wait for this thread, results posted after destruction are discarded with the object
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+void VSQReceivePipeline::submit(const QString &messageId, const QString &senderName, const QString &device,
+                                const QString &recipient, const QString &body)
+{
+    const quint64 sequence = m_senders[senderName].nextSequence++;
+    const int generation = m_generation;
+    const Decryptor decryptor = m_decryptor;
+    QtConcurrent::run(&m_pool, [=]() {
+        auto message = decryptor(senderName, device, body);
+        if (message) {
+            message->messageId = messageId;
+            message->sender = senderName;
+            message->recipient = recipient;
+        }
+        QMetaObject::invokeMethod(this, [=]() {
+            onDecrypted(generation, senderName, sequence, message);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void VSQReceivePipeline::reset()
+{
+    ++m_generation;
+    m_pool.clear();
+    m_senders.clear();
+    m_batch.clear();
+    m_flushTimer.stop();
+}
+
+void VSQReceivePipeline::onDecrypted(int generation, const QString &senderName, quint64 sequence,
+                                     const Optional<StMessage> &message)
+{
+    if (generation != m_generation) {
+        return;
+    }
+    const auto it = m_senders.find(senderName);
+    if (it == m_senders.end()) {
+        return;
+    }
+    if (!message) {
+        qCWarning(lcReceivePipeline) << "Message of" << senderName << "can't be decrypted";
+    }
+
+    // Deliver the message and the following ones that are already decrypted
+    auto &sender = it.value();
+    sender.completed.insert(sequence, message);
+    auto completedIt = sender.completed.begin();
+    while (completedIt != sender.completed.end() && completedIt.key() == sender.deliveredSequence) {
+        if (completedIt.value()) {
+            m_batch.push_back(*completedIt.value());
+        }
+        completedIt = sender.completed.erase(completedIt);
+        ++sender.deliveredSequence;
+    }
+    if (sender.deliveredSequence == sender.nextSequence) {
+        m_senders.erase(it);
+    }
+
+    if (m_batch.size() >= kMaxBatchSize) {
+        flush();
+    }
+    else if (!m_batch.isEmpty() && !m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void VSQReceivePipeline::flush()
+{
+    m_flushTimer.stop();
+    if (m_batch.isEmpty()) {
+        return;
+    }
+    QList<StMessage> messages;
+    messages.swap(m_batch);
+    qCDebug(lcReceivePipeline) << "Delivering messages:" << messages.size();
+    emit received(messages);
+}
@@ -34,19 +34,28 @@
 
 #include "VSQSqlChatModel.h"
 
+#include <QDateTime>
 #include <QDebug>
 #include <QSqlError>
 #include <QSqlQuery>
-#include <QSqlRecord>
-#include <QDateTime>
+
+#include <algorithm>
 
 #include "VSQSqlConversationModel.h"
+#include "VSQSqlMigrator.h"
+#include "VSQSqlStatementCache.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+#include "VSQUtils.h"
 
 /******************************************************************************/
-VSQSqlChatModel::VSQSqlChatModel(QObject *parent) :
-    QSqlTableModel(parent)
+VSQSqlChatModel::VSQSqlChatModel(VSQStorage *storage, QObject *parent) :
+    QAbstractListModel(parent),
+    m_storage(storage),
+    m_writeQueue(storage->writeQueue())
 {
     connect(this, &VSQSqlChatModel::updateLastMessage, this, &VSQSqlChatModel::onUpdateLastMessage);
+    connect(m_writeQueue, &VSQSqlWriteQueue::flushed, this, &VSQSqlChatModel::onFlushed);
 }
 
 /******************************************************************************/
@@ -62,46 +71,206 @@ VSQSqlChatModel::init(const QString &userId) {
     m_userId = userId;
     m_tableName = "Chats_" + userId;
 
-    QString queryString =
-            "CREATE TABLE IF NOT EXISTS '%1' ("
+    VSQSqlMigrator migrator(m_writeQueue, m_tableName);
+    migrator.addStep(1, {
+        QString("CREATE TABLE IF NOT EXISTS '%1' ("
             "  'id' INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
             "  'name' TEXT NOT NULL,"
             "  'last_message' TEXT,"
             "  'last_message_time' TEXT,"
             "  'unread_message_count' INTEGER NOT NULL"
-            ")";
+            ")").arg(m_tableName)
+    });
+    // Version 2: last_message_time is UTC epoch milliseconds. Chat list is short, so it's rebuilt at once
+    migrator.addStep(2, {
+        QString("ALTER TABLE '%1' RENAME TO '%1_legacy'").arg(m_tableName),
+        QString("CREATE TABLE '%1' ("
+            "  'id' INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+            "  'name' TEXT NOT NULL,"
+            "  'last_message' TEXT,"
+            "  'last_message_time' INTEGER,"
+            "  'unread_message_count' INTEGER NOT NULL"
+            ")").arg(m_tableName),
+        QString("INSERT INTO '%1' (id, name, last_message, last_message_time, unread_message_count)"
+            " SELECT id, name, last_message, CAST(strftime('%s', last_message_time, 'utc') AS INTEGER) * 1000,"
+            " unread_message_count FROM '%1_legacy'").arg(m_tableName),
+        QString("DROP TABLE '%1_legacy'").arg(m_tableName)
+    });
+    // Version 3: unread message count is maintained by deltas, last read cursor is used for reconciliation.
+    // Cursor starts from the newest message that was marked as read
+    migrator.addStep(3, {
+        QString("ALTER TABLE '%1' ADD COLUMN 'last_read_timestamp' INTEGER NOT NULL DEFAULT 0").arg(m_tableName),
+        QString("UPDATE '%1' SET last_read_timestamp = IFNULL(("
+            "SELECT MAX(timestamp) FROM '%2' WHERE author = name AND status = %3"
+            "), 0)").arg(m_tableName, _conversationsTableName()).arg(static_cast<int>(StMessage::Status::MST_READ))
+    });
+    if (!migrator.migrate()) {
+        qFatal("Failed to migrate table %s", qPrintable(m_tableName));
+    }
+
+    // Chats of the previous user aren't shown while chats are loaded
+    beginResetModel();
+    m_chats.clear();
+    m_rows.clear();
+    endResetModel();
+
+    // Ids are assigned here, so created chats can be shown before they are written
+    VSQStorage::Reader reader(m_storage);
+    auto idQuery = reader.statements().query(QString("SELECT MAX(id) FROM %1").arg(_quotedTableName()));
+    if (idQuery.exec() && idQuery.next()) {
+        m_lastId = idQuery.value(0).toLongLong();
+    }
+    idQuery.finish();
+
+    // Chats are loaded with reconciled counts
+    m_filter.clear();
+    reconcileUnreadMessageCounts();
+}
+
+/******************************************************************************/
+void
+VSQSqlChatModel::_load() {
+    m_loadSequence = m_writeQueue->lastSequence();
+    if (m_writeQueue->writtenSequence() >= m_loadSequence) {
+        _read();
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlChatModel::onFlushed() {
+    if (m_loadSequence > 0 && m_writeQueue->writtenSequence() >= m_loadSequence) {
+        _read();
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlChatModel::_queued() {
+    // Loaded rows are replaced only when the mutation is visible to readers
+    if (m_loadSequence > 0) {
+        m_loadSequence = m_writeQueue->lastSequence();
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlChatModel::_read() {
+    m_loadSequence = 0;
+
+    QString queryString = QString("SELECT id, name, last_message, last_message_time, unread_message_count FROM %1")
+            .arg(_quotedTableName());
+    QVariantList bindValues;
+    if (!m_filter.isEmpty()) {
+        queryString += " WHERE instr(lower(name), lower(?)) > 0";
+        bindValues << m_filter;
+    }
+    // Chats without messages are at the end, in order of creation
+    queryString += " ORDER BY last_message_time DESC, id";
+
+    beginResetModel();
+    m_chats.clear();
+    m_rows.clear();
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(queryString, bindValues);
+    if (query.exec()) {
+        while (query.next()) {
+            Chat chat;
+            chat.id = query.value(0).toLongLong();
+            chat.name = query.value(1).toString();
+            chat.lastMessage = query.value(2).toString();
+            chat.lastMessageTime = query.value(3).toLongLong();
+            chat.unreadMessageCount = query.value(4).toInt();
+            m_rows.insert(chat.name, m_chats.size());
+            m_chats.push_back(chat);
+        }
+    }
+    else {
+        qWarning() << "Failed to load chats:" << query.lastError().text();
+    }
+    query.finish();
+    endResetModel();
+}
+
+/******************************************************************************/
+bool
+VSQSqlChatModel::_matchesFilter(const QString &name) const {
+    return m_filter.isEmpty() || name.contains(m_filter, Qt::CaseInsensitive);
+}
+
+/******************************************************************************/
+int
+VSQSqlChatModel::_findRow(const QString &name) const {
+    return m_rows.value(name, -1);
+}
 
-    QSqlQuery query(queryString.arg(m_tableName));
-    if (!query.exec()) {
-        qFatal("Failed to query database: %s", qPrintable(query.lastError().text()));
+/******************************************************************************/
+void
+VSQSqlChatModel::_moveToTop(int row) {
+    if (row <= 0) {
+        return;
     }
+    // Only rows above the chat are shifted
+    beginMoveRows(QModelIndex(), row, row, QModelIndex(), 0);
+    std::rotate(m_chats.begin(), m_chats.begin() + row, m_chats.begin() + row + 1);
+    for (int i = 0; i <= row; ++i) {
+        m_rows[m_chats[i].name] = i;
+    }
+    endMoveRows();
+}
 
-    setTable(m_tableName);
-    setEditStrategy(EditStrategy::OnRowChange);
-    setSort(3, Qt::DescendingOrder); // last_message_time
-    select();
+/******************************************************************************/
+void
+VSQSqlChatModel::_emitRowChanged(int row, const QVector<int> &roles) {
+    const auto modelIndex = index(row, 0);
+    emit dataChanged(modelIndex, modelIndex, roles);
+}
+
+/******************************************************************************/
+int
+VSQSqlChatModel::rowCount(const QModelIndex &parent) const {
+    if (parent.isValid()) {
+        return 0;
+    }
+    return m_chats.size();
 }
 
 /******************************************************************************/
 QVariant
 VSQSqlChatModel::data(const QModelIndex &index, int role) const {
-    if (role < Qt::UserRole) {
-        return QSqlTableModel::data(index, role);
-   }
+    if (!index.isValid() || index.row() >= m_chats.size()) {
+        return QVariant();
+    }
 
-   const QSqlRecord currRecord = record(index.row());
-   return currRecord.value(role - Qt::UserRole);
+    const Chat &chat = m_chats[index.row()];
+    switch (role) {
+    case IdRole:
+        return chat.id;
+    case NameRole:
+        return chat.name;
+    case LastMessageRole:
+        return chat.lastMessage;
+    case LastMessageTimeRole:
+        if (chat.lastMessageTime == 0) {
+            return QVariant();
+        }
+        return QDateTime::fromMSecsSinceEpoch(chat.lastMessageTime);
+    case UnreadMessageCountRole:
+        return chat.unreadMessageCount;
+    default:
+        return QVariant();
+    }
 }
 
 /******************************************************************************/
 QHash<int, QByteArray>
 VSQSqlChatModel::roleNames() const {
     QHash<int, QByteArray> names;
-    names[Qt::UserRole] = "id";
-    names[Qt::UserRole + 1] = "name";
-    names[Qt::UserRole + 2] = "lastMessage";
-    names[Qt::UserRole + 3] = "lastMessageTime";
-    names[Qt::UserRole + 4] = "unreadMessageCount";
+    names[IdRole] = "id";
+    names[NameRole] = "name";
+    names[LastMessageRole] = "lastMessage";
+    names[LastMessageTimeRole] = "lastMessageTime";
+    names[UnreadMessageCountRole] = "unreadMessageCount";
 
     return names;
 }
@@ -109,111 +278,130 @@ VSQSqlChatModel::roleNames() const {
 /******************************************************************************/
 void
 VSQSqlChatModel::clearFilter() {
-    setFilter("");
+    applyFilter(QString());
 }
 
 /******************************************************************************/
 void
 VSQSqlChatModel::refresh() {
-    select();
+    _load();
 }
 
 /******************************************************************************/
 void
 VSQSqlChatModel::applyFilter(const QString &filter) {
-
-    const QString filterString = QString::fromLatin1(
-        "name LIKE '%%1%'").arg(filter);
-
-    setFilter(filterString);
+    if (filter == m_filter) {
+        return;
+    }
+    m_filter = filter;
+    _load();
 }
 
 /******************************************************************************/
 void
 VSQSqlChatModel::createPrivateChat(const QString &recipientId) {
-
-    qDebug() << "Create private chat with: " << recipientId;
-
-    QSqlQueryModel selectModel;
-    QString selectQuery =
-            "SELECT COUNT(*) AS 'count' "
-            "  FROM '%1' "
-            " WHERE name = '%2'";
-
-    QSqlQuery query1(selectQuery.arg(m_tableName, recipientId));
-    selectModel.setQuery(query1);
-    int count = selectModel.record(0).value("count").toInt();
-
-    if (count > 0) {
+    if (_findRow(recipientId) >= 0) {
         return;
     }
 
-    QSqlRecord newRecord = record();
-    newRecord.setValue("name", recipientId);
-    newRecord.setValue("unread_message_count", 0);
+    qDebug() << "Create private chat with: " << recipientId;
 
-    if (!insertRowIntoTable(newRecord)) {
-        qWarning() << "Failed to send message:" << lastError().text();
+    // Chat can exist if it's filtered out
+    const qint64 id = ++m_lastId;
+    const QString insertQuery =
+            "INSERT INTO %1 (id, name, unread_message_count) "
+            "SELECT ?, ?, 0 "
+            " WHERE NOT EXISTS (SELECT 1 FROM %1 WHERE name = ?)";
+    m_writeQueue->exec(insertQuery.arg(_quotedTableName()), { id, recipientId, recipientId });
+    _queued();
+
+    // All chats matching the filter are loaded, so the chat is new
+    if (!_matchesFilter(recipientId)) {
         return;
     }
-
-    submitAll();
-    select();
+    Chat chat;
+    chat.id = id;
+    chat.name = recipientId;
+    const int row = m_chats.size();
+    beginInsertRows(QModelIndex(), row, row);
+    m_chats.push_back(chat);
+    m_rows.insert(recipientId, row);
+    endInsertRows();
 }
 
 /******************************************************************************/
 void VSQSqlChatModel::onUpdateLastMessage(QString chatId, QString message) {
 
-    const QString timestamp = QDateTime::currentDateTime().toString(Qt::ISODate);
-
-    QString updateQuery =
-            "UPDATE '%1'"
-            "   SET last_message = ?,"
-            "       last_message_time = ?"
-            " WHERE "
-            "       name = '%2'";
+    const qint64 timestamp = QDateTime::currentMSecsSinceEpoch();
 
-    QSqlQuery query(updateQuery.arg(m_tableName, chatId));
+    // Repeated updates of the same chat are merged by the queue
+    m_writeQueue->update(_quotedTableName(), "name", chatId, {
+        { "last_message", message },
+        { "last_message_time", timestamp }
+    });
+    _queued();
 
-    query.bindValue(0, message);
-    query.bindValue(1, timestamp);
-
-    if (!query.exec()) {
-        qDebug() << query.lastQuery();
-        qFatal("Failed to update last message: %s", qPrintable(query.lastError().text()));
+    const int row = _findRow(chatId);
+    if (row < 0) {
+        return;
     }
-
-    submitAll();
-    select();
+    Chat &chat = m_chats[row];
+    chat.lastMessage = message;
+    chat.lastMessageTime = timestamp;
+    _moveToTop(row);
+    _emitRowChanged(0, { LastMessageRole, LastMessageTimeRole });
 }
 
 /******************************************************************************/
-void VSQSqlChatModel::updateUnreadMessageCount(QString chatId) {
-    QSqlQueryModel selectModel;
-    QString selectQuery =
-            "SELECT COUNT(*) AS 'count' "
-            "  FROM '%1' "
-            " WHERE status = %3 AND author = '%2'";
-
-    QSqlQuery query1(selectQuery
-                     .arg("Conversations_" + m_userId, chatId)
-                     .arg(static_cast<int>(StMessage::Status::MST_RECEIVED)));
-    selectModel.setQuery(query1);
-    int count = selectModel.record(0).value("count").toInt();
+void VSQSqlChatModel::incrementUnreadMessageCount(const QString &chatId, int count) {
+    const QString updateQuery = "UPDATE %1 SET unread_message_count = unread_message_count + ? WHERE name = ?";
+    m_writeQueue->exec(updateQuery.arg(_quotedTableName()), { count, chatId });
+    _queued();
+
+    const int row = _findRow(chatId);
+    if (row >= 0) {
+        m_chats[row].unreadMessageCount += count;
+        _emitRowChanged(row, { UnreadMessageCountRole });
+    }
+}
 
-    QString updateQuery =
-            "UPDATE '%1'"
-            "   SET unread_message_count = '%2'"
-            " WHERE "
-            "       name = '%3'";
+/******************************************************************************/
+void VSQSqlChatModel::resetUnreadMessageCount(const QString &chatId) {
+    // Messages received before the cursor are read
+    m_writeQueue->update(_quotedTableName(), "name", chatId, {
+        { "unread_message_count", 0 },
+        { "last_read_timestamp", QDateTime::currentMSecsSinceEpoch() }
+    });
+    _queued();
+
+    const int row = _findRow(chatId);
+    if (row >= 0 && m_chats[row].unreadMessageCount != 0) {
+        m_chats[row].unreadMessageCount = 0;
+        _emitRowChanged(row, { UnreadMessageCountRole });
+    }
+}
 
-    QSqlQuery query(updateQuery.arg(m_tableName, QString::number(count), chatId));
+/******************************************************************************/
+void VSQSqlChatModel::reconcileUnreadMessageCounts() {
+    // Counts messages received after the last read cursor, (recipient, author, timestamp) index is used
+    const QString updateQuery =
+            "UPDATE %1"
+            "   SET unread_message_count = ("
+            "       SELECT COUNT(*) FROM '%2'"
+            "        WHERE recipient = ? AND author = name AND timestamp > last_read_timestamp"
+            "   )";
+
+    m_writeQueue->exec(updateQuery.arg(_quotedTableName(), _conversationsTableName()), { m_userId });
+    _load();
+}
 
-    if (!query.exec()) {
-        qDebug() << query.lastQuery();
-        qFatal("Failed to update unread message count: %s", qPrintable(query.lastError().text()));
-    }
+/******************************************************************************/
+QString VSQSqlChatModel::_conversationsTableName() const {
+    // Same name as VSQSqlConversationModel::tableName()
+    return "Conversations_" + VSQUtils::escapedUserName(m_userId);
+}
 
-    submitAll();
-    select();
+/******************************************************************************/
+QString VSQSqlChatModel::_quotedTableName() const {
+    return QString("'%1'").arg(m_tableName);
 }
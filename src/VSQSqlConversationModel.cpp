@@ -36,20 +36,51 @@
 
 #include <QDateTime>
 #include <QDebug>
+#include <QMutexLocker>
+#include <QSqlDatabase>
+#include <QSqlDriver>
 #include <QSqlError>
 #include <QSqlRecord>
 #include <QSqlQuery>
 
+#include <algorithm>
+#include <iterator>
+
 #include "VSQCryptoTransferManager.h"
+#include "VSQSettings.h"
+#include "VSQSqlMigrator.h"
+#include "VSQSqlStatementCache.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
 #include "VSQUtils.h"
 
 Q_DECLARE_METATYPE(StMessage::Status)
 
+// Rows loaded per page of the conversation window
+static const int kPageSize = 50;
+// Rows kept above the newest page when the window is released
+static const int kPrefetchMargin = 50;
+// Rows moved per transaction by background migrations
+static const int kMigrationBatchSize = 500;
+// Messages kept in the message cache
+static const int kMessageCacheCapacity = 256;
+// Message ids looked up by a single query
+static const int kExistingIdsChunkSize = 50;
+// Columns of the attachments table besides message_id
+static const char *kAttachmentColumns =
+        "attachment_id, attachment_bytes_total, attachment_type, attachment_file_path, attachment_remote_url,"
+        " attachment_thumbnail_path, attachment_thumbnail_width, attachment_thumbnail_height,"
+        " attachment_remote_thumbnail_url, attachment_status";
+
 /******************************************************************************/
-void
-VSQSqlConversationModel::_createTable() {
-    QSqlQuery query;
-    if (!query.exec(
+bool
+VSQSqlConversationModel::migrate(const QString &user) const {
+    const QString table = _tableName(user);
+    const QString contactsTable = _contactsTableName(user);
+    const QString legacyTable = table + QLatin1String("_legacy");
+
+    VSQSqlMigrator migrator(m_writeQueue, table);
+    migrator.addStep(1, {
         QString("CREATE TABLE IF NOT EXISTS %1 ("
         "'author' TEXT NOT NULL,"
         "'recipient' TEXT NOT NULL,"
@@ -71,41 +102,738 @@ VSQSqlConversationModel::_createTable() {
         ""
         "FOREIGN KEY('author') REFERENCES %2 ( name ),"
         "FOREIGN KEY('recipient') REFERENCES %3 ( name )"
-        ")").arg(_tableName())
-            .arg(_contactsTableName())
-            .arg(_contactsTableName()))) {
-        qFatal("Failed to query database: %s", qPrintable(query.lastError().text()));
+        ")").arg(table)
+            .arg(contactsTable)
+            .arg(contactsTable),
+        QString("CREATE UNIQUE INDEX IF NOT EXISTS idx_%1_message_id ON %1 (message_id);").arg(table)
+    });
+
+    // Version 2: timestamp is UTC epoch milliseconds.
+    // Rows are moved from the legacy table at once, before anything reads or writes them.
+    // Login migrates in background, so the move doesn't block the GUI thread
+    const QString legacyMoveColumns =
+            "author, recipient, %1, message, status, message_id,"
+            " attachment_id, attachment_bytes_total, attachment_type, attachment_file_path, attachment_remote_url,"
+            " attachment_thumbnail_path, attachment_thumbnail_width, attachment_thumbnail_height,"
+            " attachment_remote_thumbnail_url, attachment_status";
+    const QString convertedTimestamp = "COALESCE(CAST(strftime('%s', timestamp, 'utc') AS INTEGER), 0) * 1000";
+    const QStringList legacyMoveStatements {
+        QString("INSERT OR IGNORE INTO %1 (rowid, %2) SELECT rowid, %3 FROM %4")
+            .arg(table, legacyMoveColumns.arg("timestamp"), legacyMoveColumns.arg(convertedTimestamp), legacyTable),
+        QString("DROP TABLE %1").arg(legacyTable)
+    };
+    migrator.addStep(2, QStringList {
+        QString("DROP INDEX IF EXISTS idx_%1_message_id").arg(table),
+        QString("ALTER TABLE %1 RENAME TO %2").arg(table, legacyTable),
+        QString("CREATE TABLE %1 ("
+        "'author' TEXT NOT NULL,"
+        "'recipient' TEXT NOT NULL,"
+        "'timestamp' INTEGER NOT NULL,"
+        "'message' TEXT NOT NULL,"
+        "'status' int NOT NULL,"
+        "'message_id' TEXT NOT NULL,"
+        ""
+        "attachment_id TEXT,"
+        "attachment_bytes_total INTEGER,"
+        "attachment_type INTEGER,"
+        "attachment_file_path TEXT,"
+        "attachment_remote_url TEXT,"
+        "attachment_thumbnail_path TEXT,"
+        "attachment_thumbnail_width INTEGER,"
+        "attachment_thumbnail_height INTEGER,"
+        "attachment_remote_thumbnail_url TEXT,"
+        "attachment_status INT,"
+        ""
+        "FOREIGN KEY('author') REFERENCES %2 ( name ),"
+        "FOREIGN KEY('recipient') REFERENCES %3 ( name )"
+        ")").arg(table)
+            .arg(contactsTable)
+            .arg(contactsTable),
+        QString("CREATE UNIQUE INDEX idx_%1_message_id ON %1 (message_id)").arg(table),
+        QString("CREATE INDEX idx_%1_conversation ON %1 (recipient, author, timestamp)").arg(table),
+        QString("CREATE INDEX idx_%1_author_status ON %1 (author, status)").arg(table)
+    } + legacyMoveStatements);
+
+    // Version 3: attachments are stored in a separate table, so text-only scans read narrow rows
+    // and attachment updates don't rewrite message rows. Attachments are moved in background,
+    // until then they are read from the columns of the messages table. Pending rows are
+    // found with a partial index, that is dropped when nothing is left
+    const QString attachmentsTable = _attachmentsTableName(user);
+    const QString pendingAttachmentsIndex = QString("idx_%1_pending_attachments").arg(table);
+    migrator.addStep(3, {
+        QString("CREATE TABLE %1 ("
+        "message_id TEXT NOT NULL PRIMARY KEY,"
+        "attachment_id TEXT NOT NULL,"
+        "attachment_bytes_total INTEGER,"
+        "attachment_type INTEGER,"
+        "attachment_file_path TEXT,"
+        "attachment_remote_url TEXT,"
+        "attachment_thumbnail_path TEXT,"
+        "attachment_thumbnail_width INTEGER,"
+        "attachment_thumbnail_height INTEGER,"
+        "attachment_remote_thumbnail_url TEXT,"
+        "attachment_status INT,"
+        ""
+        "FOREIGN KEY(message_id) REFERENCES %2 ( message_id )"
+        ")").arg(attachmentsTable, table),
+        QString("CREATE INDEX %1 ON %2 (attachment_id) WHERE attachment_id IS NOT NULL").arg(pendingAttachmentsIndex, table)
+    });
+
+    return migrator.migrate();
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_createTable() {
+    const QString table = _tableName();
+    if (!migrate(m_user)) {
+        qFatal("Failed to migrate table %s", qPrintable(table));
+    }
+    const QString pendingAttachmentsIndex = QString("idx_%1_pending_attachments").arg(table);
+
+    // Search index is maintained by triggers. Rows that existed before the index are indexed
+    // in background, newest first
+    m_searchAvailable = _createSearchIndex();
+    const QString searchTable = _searchTableName();
+    const QStringList backfillStatements {
+        QString("INSERT INTO %1 (rowid, message) SELECT rowid, message FROM %2"
+                " WHERE rowid >= (SELECT lower_rowid FROM SearchBackfill WHERE name = '%1')"
+                " AND rowid < (SELECT upper_rowid FROM SearchBackfill WHERE name = '%1')"
+                " ORDER BY rowid DESC LIMIT %3").arg(searchTable, table).arg(kMigrationBatchSize),
+        QString("UPDATE SearchBackfill SET upper_rowid = IFNULL((SELECT rowid FROM %2"
+                " WHERE rowid >= lower_rowid AND rowid < upper_rowid ORDER BY rowid DESC LIMIT 1 OFFSET %3), lower_rowid)"
+                " WHERE name = '%1' AND upper_rowid > lower_rowid").arg(searchTable, table).arg(kMigrationBatchSize - 1)
+    };
+    const QStringList backfillFinishStatements {
+        QString("DELETE FROM SearchBackfill WHERE name = '%1'").arg(searchTable)
+    };
+    if (m_searchAvailable) {
+        VSQSqlMigrator::runBatches(m_writeQueue, backfillStatements, backfillFinishStatements);
     }
 
-    QSqlQuery indexQuery;
-    if (!indexQuery.exec(
-        QString("CREATE UNIQUE INDEX IF NOT EXISTS idx_%1_message_id ON %1 (message_id);").arg(_tableName()))) {
-        qFatal("Failed to query database: %s", qPrintable(indexQuery.lastError().text()));
+    VSQStorage::Reader reader(m_storage);
+    QSqlQuery pendingQuery(reader.database());
+    pendingQuery.prepare("SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = ?");
+    pendingQuery.addBindValue(pendingAttachmentsIndex);
+    m_attachmentsPending = pendingQuery.exec() && pendingQuery.next();
+    pendingQuery.finish();
+    if (m_attachmentsPending) {
+        qDebug() << "Moving attachments in background:" << table;
+        const QString attachmentsTable = _attachmentsTableName();
+        QStringList clearColumns;
+        for (const auto &column : QString(kAttachmentColumns).split(", ")) {
+            clearColumns << column + QLatin1String(" = NULL");
+        }
+        // Attachments that are already in the attachments table are newer, they are kept
+        const QStringList moveStatements {
+            QString("INSERT OR IGNORE INTO %1 (message_id, %2) SELECT message_id, %2 FROM %3"
+                    " WHERE attachment_id IS NOT NULL LIMIT %4")
+                .arg(attachmentsTable, kAttachmentColumns, table).arg(kMigrationBatchSize),
+            QString("UPDATE %1 SET %2 WHERE rowid IN (SELECT m.rowid FROM %1 m WHERE m.attachment_id IS NOT NULL"
+                    " AND EXISTS (SELECT 1 FROM %3 a WHERE a.message_id = m.message_id) LIMIT %4)")
+                .arg(table, clearColumns.join(", "), attachmentsTable).arg(kMigrationBatchSize)
+        };
+        const QString user = m_user;
+        VSQSqlMigrator::runBatches(m_writeQueue, moveStatements, { QString("DROP INDEX %1").arg(pendingAttachmentsIndex) }, [this, user]() {
+            QMetaObject::invokeMethod(this, [this, user]() {
+                if (user == m_user) {
+                    m_attachmentsPending = false;
+                }
+            }, Qt::QueuedConnection);
+        });
+    }
+
+    // Row ids are assigned here, so inserted rows can be shown before they are written
+    QSqlQuery rowIdQuery(reader.database());
+    if (!rowIdQuery.exec(QString("SELECT MAX(rowid) FROM %1").arg(_tableName())) || !rowIdQuery.next()) {
+        qFatal("Failed to query database: %s", qPrintable(rowIdQuery.lastError().text()));
     }
+    m_lastRowId = rowIdQuery.value(0).toLongLong();
+}
+
+/******************************************************************************/
+template <class Values>
+VSQConversationRows::RowData
+VSQSqlConversationModel::_readRow(qint64 rowId, const Values &values, int offset) {
+    const auto column = [offset](int role) { return role - Qt::UserRole + offset; };
+
+    VSQConversationRows::RowData row;
+    row.rowId = rowId;
+    row.author = values.value(column(AuthorRole)).toString();
+    row.recipient = values.value(column(RecipientRole)).toString();
+    row.timestamp = values.value(column(TimestampRole)).toLongLong();
+    row.message = values.value(column(MessageRole)).toString();
+    row.status = values.value(column(StatusRole)).toInt();
+    row.messageId = values.value(column(MessageIdRole)).toString();
+    row.hasAttachment = !values.isNull(column(AttachmentIdRole));
+    if (row.hasAttachment) {
+        auto &attachment = row.attachment;
+        attachment.id = values.value(column(AttachmentIdRole)).toString();
+        attachment.bytesTotal = values.value(column(AttachmentBytesTotalRole)).toLongLong();
+        attachment.type = values.value(column(AttachmentTypeRole)).toInt();
+        attachment.filePath = values.value(column(AttachmentFilePathRole)).toString();
+        attachment.remoteUrl = values.value(column(AttachmentRemoteUrlRole)).toString();
+        attachment.thumbnailPath = values.value(column(AttachmentThumbnailPathRole)).toString();
+        attachment.thumbnailWidth = values.value(column(AttachmentThumbnailWidthRole)).toInt();
+        attachment.thumbnailHeight = values.value(column(AttachmentThumbnailHeightRole)).toInt();
+        attachment.remoteThumbnailUrl = values.value(column(AttachmentRemoteThumbnailUrlRole)).toString();
+        attachment.status = values.value(column(AttachmentStatusRole)).toInt();
+    }
+    return row;
 }
 
 /******************************************************************************/
 void
 VSQSqlConversationModel::_update() {
-    setTable(_tableName());
-    setSort(2, Qt::DescendingOrder);
-    // Ensures that the model is sorted correctly after submitting a new row.
-    setEditStrategy(QSqlTableModel::OnManualSubmit);
-
-    setFilter("(recipient = '')");
-    select();
+    m_recordTemplate = VSQStorage::Reader(m_storage).database().record(_tableName());
+    _resetWindow();
 
     emit recipientChanged();
 }
 
 /******************************************************************************/
-VSQSqlConversationModel::VSQSqlConversationModel(QObject *parent) :
-    QSqlTableModel(parent) {
+VSQConversationRows::RowsData
+VSQSqlConversationModel::_selectPage(bool before, int limit) const {
+    // Keyset pagination: rows are read backwards from the (timestamp, rowid) of the
+    // oldest loaded row, so the cost doesn't depend on the conversation length.
+    QString queryString = _selectMessagesQuery() +
+            " WHERE ((m.recipient = ? AND m.author = ?) OR (m.recipient = ? AND m.author = ?))";
+    if (before) {
+        queryString += " AND (m.timestamp < ? OR (m.timestamp = ? AND m.rowid < ?))";
+    }
+    queryString += " ORDER BY m.timestamp DESC, m.rowid DESC LIMIT ?";
+
+    QVariantList bindValues { m_recipient, m_user, m_user, m_recipient };
+    if (before) {
+        const auto timestamp = m_rows.timestamp(0);
+        bindValues << timestamp << timestamp << m_rows.rowId(0);
+    }
+    bindValues << limit;
+
+    const auto unwritten = _unwrittenMutations();
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(queryString, bindValues);
+    VSQConversationRows::RowsData rows;
+    if (!query.exec()) {
+        qWarning() << "Failed to select conversation page:" << query.lastError().text();
+        return rows;
+    }
+
+    rows.reserve(limit);
+    QSet<QString> storedIds;
+    while (query.next()) {
+        rows.push_back(_readRow(query.value(0).toLongLong(), query, 1));
+        _applyUnwritten(unwritten, rows.back());
+        storedIds.insert(rows.back().messageId);
+    }
+    query.finish();
+    std::reverse(rows.begin(), rows.end());
+
+    // Unwritten rows of the conversation are merged into the page
+    const auto isBeforeFirst = [this](const VSQConversationRows::RowData &row) {
+        const auto timestamp = m_rows.timestamp(0);
+        return row.timestamp < timestamp || (row.timestamp == timestamp && row.rowId < m_rows.rowId(0));
+    };
+    const int storedCount = rows.size();
+    for (auto it = unwritten.messages.cbegin(); it != unwritten.messages.cend(); ++it) {
+        const auto &row = it->row;
+        if (row && _isCurrentConversation(row->author, row->recipient) && !storedIds.contains(row->messageId)
+                && (!before || isBeforeFirst(*row))) {
+            rows.push_back(*row);
+            _applyUnwritten(unwritten, rows.back());
+        }
+    }
+    if (rows.size() > storedCount) {
+        std::sort(rows.begin(), rows.end(), [](const VSQConversationRows::RowData &a, const VSQConversationRows::RowData &b) {
+            return (a.timestamp < b.timestamp) || (a.timestamp == b.timestamp && a.rowId < b.rowId);
+        });
+        if (rows.size() > limit) {
+            rows.remove(0, rows.size() - limit);
+        }
+    }
+    return rows;
+}
+
+/******************************************************************************/
+QHash<QString, VSQConversationRows::RowData>
+VSQSqlConversationModel::_selectRows(const QStringList &messageIds) const {
+    // Statement has a single shape, so it's prepared once. Unused placeholders are bound to NULL
+    QStringList placeholders;
+    for (int i = 0; i < kExistingIdsChunkSize; ++i) {
+        placeholders << QLatin1String("?");
+    }
+    const QString queryString = _selectMessagesQuery() + QString(" WHERE m.message_id IN (%1)").arg(placeholders.join(", "));
+
+    QHash<QString, VSQConversationRows::RowData> rows;
+    VSQStorage::Reader reader(m_storage);
+    for (int first = 0; first < messageIds.size(); first += kExistingIdsChunkSize) {
+        QVariantList bindValues;
+        for (int i = first; i < first + kExistingIdsChunkSize; ++i) {
+            bindValues << ((i < messageIds.size()) ? QVariant(messageIds[i]) : QVariant(QVariant::String));
+        }
+        auto query = reader.statements().query(queryString, bindValues);
+        if (query.exec()) {
+            while (query.next()) {
+                const auto row = _readRow(query.value(0).toLongLong(), query, 1);
+                rows.insert(row.messageId, row);
+            }
+        }
+        else {
+            qWarning() << "Failed to select messages:" << query.lastError().text();
+        }
+        query.finish();
+    }
+    return rows;
+}
+
+/******************************************************************************/
+Optional<VSQConversationRows::RowData>
+VSQSqlConversationModel::_selectLastRow(const QString &recipient) const {
+    const QString queryString = QString("SELECT rowid, timestamp, message FROM %1"
+                                        " WHERE recipient = ? ORDER BY timestamp DESC, rowid DESC LIMIT 1").arg(_tableName());
+
+    const auto unwritten = _unwrittenMutations();
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(queryString, { recipient });
+    Optional<VSQConversationRows::RowData> lastRow;
+    if (query.exec() && query.next()) {
+        VSQConversationRows::RowData row;
+        row.rowId = query.value(0).toLongLong();
+        row.timestamp = query.value(1).toLongLong();
+        row.message = query.value(2).toString();
+        lastRow = row;
+    }
+    query.finish();
+
+    for (const auto &message : unwritten.messages) {
+        const auto &row = message.row;
+        if (row && row->recipient == recipient && (!lastRow || row->timestamp > lastRow->timestamp
+                || (row->timestamp == lastRow->timestamp && row->rowId > lastRow->rowId))) {
+            lastRow = row;
+        }
+    }
+    return lastRow;
+}
+
+/******************************************************************************/
+VSQSqlConversationModel::Unwritten
+VSQSqlConversationModel::_unwrittenMutations() const {
+    QMutexLocker locker(&m_unwrittenMutex);
+    return m_unwritten;
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_addUnwrittenMutation(const QString &messageId, const Optional<VSQConversationRows::RowData> &row,
+                                               const QVariantMap &values) {
+    const auto sequence = m_writeQueue->lastSequence();
+    QMutexLocker locker(&m_unwrittenMutex);
+    auto &message = m_unwritten.messages[messageId];
+    message.sequence = sequence;
+    if (row) {
+        message.row = row;
+    }
+    for (auto it = values.cbegin(); it != values.cend(); ++it) {
+        message.values.insert(it.key(), it.value());
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_dropWrittenMutations() {
+    const auto writtenSequence = m_writeQueue->writtenSequence();
+    QMutexLocker locker(&m_unwrittenMutex);
+    for (auto it = m_unwritten.messages.begin(); it != m_unwritten.messages.end();) {
+        it = (it->sequence <= writtenSequence) ? m_unwritten.messages.erase(it) : std::next(it);
+    }
+    for (auto it = m_unwritten.reads.begin(); it != m_unwritten.reads.end();) {
+        it = (it->sequence <= writtenSequence) ? m_unwritten.reads.erase(it) : std::next(it);
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_applyUnwrittenReads(const Unwritten &unwritten, VSQConversationRows::RowData &row) {
+    const auto it = unwritten.reads.constFind(row.author);
+    if (it != unwritten.reads.constEnd() && row.rowId <= it->lastRowId
+            && row.status == static_cast<int>(StMessage::Status::MST_RECEIVED)) {
+        row.status = static_cast<int>(StMessage::Status::MST_READ);
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_applyUnwritten(const Unwritten &unwritten, VSQConversationRows::RowData &row) {
+    _applyUnwrittenReads(unwritten, row);
+    const auto it = unwritten.messages.constFind(row.messageId);
+    if (it == unwritten.messages.constEnd()) {
+        return;
+    }
+
+    auto &attachment = row.attachment;
+    for (auto valueIt = it->values.cbegin(); valueIt != it->values.cend(); ++valueIt) {
+        const auto &column = valueIt.key();
+        const auto &value = valueIt.value();
+        if (column == QLatin1String("status")) {
+            row.status = value.toInt();
+        }
+        else if (!row.hasAttachment) {
+            continue;
+        }
+        else if (column == QLatin1String("attachment_status")) {
+            attachment.status = value.toInt();
+        }
+        else if (column == QLatin1String("attachment_bytes_total")) {
+            attachment.bytesTotal = value.toLongLong();
+        }
+        else if (column == QLatin1String("attachment_file_path")) {
+            attachment.filePath = value.toString();
+        }
+        else if (column == QLatin1String("attachment_remote_url")) {
+            attachment.remoteUrl = value.toString();
+        }
+        else if (column == QLatin1String("attachment_thumbnail_path")) {
+            attachment.thumbnailPath = value.toString();
+        }
+        else if (column == QLatin1String("attachment_remote_thumbnail_url")) {
+            attachment.remoteThumbnailUrl = value.toString();
+        }
+        else {
+            qWarning() << "Unwritten column is not applied:" << column;
+        }
+    }
+}
+
+/******************************************************************************/
+StMessage
+VSQSqlConversationModel::_messageFromRow(const VSQConversationRows::RowData &row) {
+    StMessage message;
+    message.messageId = row.messageId;
+    message.message = row.message;
+    message.sender = row.author;
+    message.recipient = row.recipient;
+    if (row.hasAttachment) {
+        const auto &fields = row.attachment;
+        Attachment attachment;
+        attachment.id = fields.id;
+        attachment.bytesTotal = fields.bytesTotal;
+        attachment.type = static_cast<Attachment::Type>(fields.type);
+        attachment.filePath = fields.filePath;
+        attachment.remoteUrl = fields.remoteUrl;
+        if (attachment.type == Attachment::Type::Picture) {
+            attachment.thumbnailPath = fields.thumbnailPath;
+            attachment.thumbnailSize = QSize(fields.thumbnailWidth, fields.thumbnailHeight);
+            attachment.remoteThumbnailUrl = fields.remoteThumbnailUrl;
+        }
+        attachment.status = static_cast<Attachment::Status>(fields.status);
+        attachment.displayName = message.message;
+        message.attachment = attachment;
+    }
+    return message;
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_resetWindow() {
+    beginResetModel();
+    m_rows.clear();
+    m_grouping.clear();
+    m_positions.clear();
+    m_firstPosition = 0;
+    m_hasOlderRows = false;
+    if (!m_recipient.isEmpty() && !m_user.isEmpty()) {
+        m_rows.prepend(_selectPage(false, kPageSize));
+        m_grouping.resize(m_rows.size());
+        m_hasOlderRows = (m_rows.size() == kPageSize);
+        _indexRows(0, m_rows.size() - 1);
+        _updateGrouping(0, m_rows.size() - 1);
+        _checkFilePresence(0, m_rows.size() - 1);
+    }
+    endResetModel();
+}
+
+/******************************************************************************/
+bool
+VSQSqlConversationModel::_isCurrentConversation(const QString &author, const QString &recipient) const {
+    if (m_recipient.isEmpty()) {
+        return false;
+    }
+    return (author == m_user && recipient == m_recipient) || (author == m_recipient && recipient == m_user);
+}
+
+/******************************************************************************/
+QSqlRecord
+VSQSqlConversationModel::_createRecord(const QString &author, const QString &recipient, const QString &messageId,
+                                       const QString &message, StMessage::Status status,
+                                       const OptionalAttachment &attachment, qint64 timestamp) const {
+    QSqlRecord record = m_recordTemplate;
+    record.setValue("author", author);
+    record.setValue("recipient", recipient);
+    record.setValue("timestamp", (timestamp > 0) ? timestamp : QDateTime::currentMSecsSinceEpoch());
+    record.setValue("message", message);
+    record.setValue("status", static_cast<int>(status));
+    record.setValue("message_id", messageId);
+    if (attachment) {
+        record.setValue("attachment_id", attachment->id);
+        record.setValue("attachment_bytes_total", attachment->bytesTotal);
+        record.setValue("attachment_type", static_cast<int>(attachment->type));
+        record.setValue("attachment_file_path", attachment->filePath);
+        record.setValue("attachment_remote_url", attachment->remoteUrl.toString());
+        if (attachment->type == Attachment::Type::Picture) {
+            record.setValue("attachment_thumbnail_path", attachment->thumbnailPath);
+            record.setValue("attachment_thumbnail_width", attachment->thumbnailSize.width());
+            record.setValue("attachment_thumbnail_height", attachment->thumbnailSize.height());
+            record.setValue("attachment_remote_thumbnail_url", attachment->remoteThumbnailUrl.toString());
+        }
+        record.setValue("attachment_status", static_cast<int>(attachment->status));
+    }
+    return record;
+}
+
+/******************************************************************************/
+bool
+VSQSqlConversationModel::_insertMessage(const QSqlRecord &record) {
+    return _insertMessages({ record }) == 1;
+}
+
+/******************************************************************************/
+int
+VSQSqlConversationModel::_insertMessages(const QVector<QSqlRecord> &records) {
+    const auto isUnwrittenRow = [this](const QString &messageId) {
+        QMutexLocker locker(&m_unwrittenMutex);
+        const auto it = m_unwritten.messages.constFind(messageId);
+        return it != m_unwritten.messages.constEnd() && it->row;
+    };
+
+    VSQConversationRows::RowsData windowRows;
+    int insertedCount = 0;
+    for (const auto &record : records) {
+        const auto messageId = record.value("message_id").toString();
+        // Stored duplicates outside of the window and the cache are rolled back by the write queue
+        if (_findRow(messageId) >= 0 || m_messageCache.get(messageId) || isUnwrittenRow(messageId)) {
+            qWarning() << "Message already exists:" << messageId;
+            continue;
+        }
+
+        const auto row = _readRow(++m_lastRowId, record, 0);
+
+        QVariantMap values;
+        QVariantMap attachmentValues;
+        values.insert("rowid", row.rowId);
+        for (int i = 0, count = record.count(); i < count; ++i) {
+            if (record.isNull(i)) {
+                continue;
+            }
+            const auto fieldName = record.fieldName(i);
+            if (fieldName.startsWith(QLatin1String("attachment_"))) {
+                attachmentValues.insert(fieldName, record.value(i));
+            }
+            else {
+                values.insert(fieldName, record.value(i));
+            }
+        }
+        // Attachment goes first, so its rejection is known when the message is rejected
+        if (!attachmentValues.isEmpty()) {
+            attachmentValues.insert("message_id", messageId);
+            m_writeQueue->insert(_attachmentsTableName(), "message_id", attachmentValues);
+        }
+        m_writeQueue->insert(_tableName(), "message_id", values);
+        _addUnwrittenMutation(messageId, row, {});
+        m_messageCache.insert(messageId, getMessage(record));
+        ++insertedCount;
+
+        if (_isCurrentConversation(row.author, row.recipient)) {
+            windowRows.push_back(row);
+        }
+    }
+
+    // Archived rows can be older than loaded ones, the window is reloaded then
+    qint64 lastTimestamp = m_rows.isEmpty() ? 0 : m_rows.timestamp(m_rows.size() - 1);
+    for (const auto &row : windowRows) {
+        if (row.timestamp < lastTimestamp) {
+            _resetWindow();
+            return insertedCount;
+        }
+        lastTimestamp = row.timestamp;
+    }
+
+    // Rows of the opened conversation are appended at once
+    if (!windowRows.isEmpty()) {
+        const int first = m_rows.size();
+        const int last = first + windowRows.size() - 1;
+        beginInsertRows(QModelIndex(), first, last);
+        for (const auto &row : windowRows) {
+            m_rows.append(row);
+            m_grouping.push_back(Grouping());
+        }
+        _indexRows(first, last);
+        _updateGrouping(first - 1, last);
+        endInsertRows();
+        if (first > 0) {
+            // Previous message may become a part of the row
+            const auto prevIndex = index(first - 1, 0);
+            emit dataChanged(prevIndex, prevIndex, { InRowRole });
+        }
+    }
+    return insertedCount;
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_updateMessage(const QString &messageId, const QString &column, const QVariant &value) {
+    m_writeQueue->update(_tableName(), "message_id", messageId, { { column, value } });
+    _addUnwrittenMutation(messageId, NullOptional, { { column, value } });
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_updateAttachment(const QString &messageId, const QString &column, const QVariant &value) {
+    m_writeQueue->update(_attachmentsTableName(), "message_id", messageId, { { column, value } });
+    if (m_attachmentsPending) {
+        // Attachment can be still read from the messages table and moved with this value
+        m_writeQueue->update(_tableName(), "message_id", messageId, { { column, value } });
+    }
+    _addUnwrittenMutation(messageId, NullOptional, { { column, value } });
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_indexRows(int first, int last) {
+    for (int i = first; i <= last; ++i) {
+        m_positions.insert(m_rows.messageId(i), m_firstPosition + i);
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_updateGrouping(int first, int last) {
+    const int rowCount = m_rows.size();
+    for (int i = qMax(first, 0), end = qMin(last, rowCount - 1); i <= end; ++i) {
+        const qint64 timestamp = m_rows.timestamp(i);
+
+        Grouping &grouping = m_grouping[i];
+        grouping.day = QDateTime::fromMSecsSinceEpoch(timestamp).date();
+
+        // Message is considered to be the first in a row when it's from another author
+        // than the previous message or sent more than 5 min later
+        if (i > 0) {
+            const bool isSameAuthor = m_rows.hasSameAuthor(i - 1, i);
+            const bool isInFiveMinRange = m_rows.timestamp(i - 1) + 5 * 60 * 1000 > timestamp;
+            grouping.firstInRow = !isSameAuthor || !isInFiveMinRange;
+        }
+        else {
+            grouping.firstInRow = true;
+        }
+
+        grouping.inRow = (i + 1 < rowCount) && m_rows.hasSameAuthor(i, i + 1);
+    }
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_checkFilePresence(int first, int last) {
+    // Presence of loaded attachments is checked in background before the view asks for it
+    for (int i = first; i <= last; ++i) {
+        if (const auto attachment = m_rows.attachment(i)) {
+            m_filePresence.exists(m_rows.messageId(i), attachment->filePath);
+        }
+    }
+}
+
+/******************************************************************************/
+int
+VSQSqlConversationModel::_findRow(const QString &messageId) const {
+    const auto it = m_positions.constFind(messageId);
+    if (it == m_positions.constEnd()) {
+        return -1;
+    }
+    return static_cast<int>(it.value() - m_firstPosition);
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_setCachedValue(const QString &messageId, int role, const QVariant &value,
+                                         const QVector<int> &roles) {
+    const int row = _findRow(messageId);
+    if (row < 0) {
+        return;
+    }
+    if (role == StatusRole) {
+        m_rows.setStatus(row, value.toInt());
+    }
+    else if (auto attachment = m_rows.attachment(row)) {
+        switch (role) {
+        case AttachmentBytesTotalRole:
+            attachment->bytesTotal = value.toLongLong();
+            break;
+        case AttachmentFilePathRole:
+            attachment->filePath = value.toString();
+            break;
+        case AttachmentRemoteUrlRole:
+            attachment->remoteUrl = value.toString();
+            break;
+        case AttachmentThumbnailPathRole:
+            attachment->thumbnailPath = value.toString();
+            break;
+        case AttachmentRemoteThumbnailUrlRole:
+            attachment->remoteThumbnailUrl = value.toString();
+            break;
+        case AttachmentStatusRole:
+            attachment->status = value.toInt();
+            break;
+        default:
+            qWarning() << "Role can't be changed:" << role;
+            return;
+        }
+    }
+    else {
+        return;
+    }
+    const auto modelIndex = index(row, 0);
+    emit dataChanged(modelIndex, modelIndex, roles.isEmpty() ? QVector<int>{ role } : roles);
+}
+
+/******************************************************************************/
+void
+VSQSqlConversationModel::_emitRowChanged(const QString &messageId, const QVector<int> &roles) {
+    const int row = _findRow(messageId);
+    if (row < 0) {
+        return;
+    }
+    const auto modelIndex = index(row, 0);
+    emit dataChanged(modelIndex, modelIndex, roles);
+}
+
+/******************************************************************************/
+template <class Function>
+void
+VSQSqlConversationModel::_updateCachedAttachment(const QString &messageId, Function function) {
+    m_messageCache.update(messageId, [&function](StMessage &message) {
+        if (message.attachment) {
+            function(*message.attachment);
+        }
+    });
+}
+
+/******************************************************************************/
+VSQSqlConversationModel::VSQSqlConversationModel(VSQStorage *storage, VSQSettings *settings, QObject *parent) :
+    QAbstractListModel(parent),
+    m_storage(storage),
+    m_writeQueue(storage->writeQueue()),
+    m_filePresence(this),
+    m_messageCache(kMessageCacheCapacity) {
+
+    m_filePresence.watchDirectory(settings->downloadsDir());
+    m_filePresence.watchDirectory(settings->attachmentCacheDir());
+    connect(&m_filePresence, &VSQFilePresenceCache::presenceChanged, this, [this](const QString &messageId) {
+        _emitRowChanged(messageId, { AttachmentDownloadedRole });
+    });
 
     qRegisterMetaType<StMessage::Status>("StMessage::Status");
 
     connect(this, &VSQSqlConversationModel::createMessage, this, &VSQSqlConversationModel::onCreateMessage);
     connect(this, &VSQSqlConversationModel::receiveMessage, this, &VSQSqlConversationModel::onReceiveMessage);
+    connect(this, &VSQSqlConversationModel::receiveMessages, this, &VSQSqlConversationModel::onReceiveMessages);
     connect(this, &VSQSqlConversationModel::setMessageStatus, this, &VSQSqlConversationModel::onSetMessageStatus);
     connect(this, &VSQSqlConversationModel::setAttachmentStatus, this, &VSQSqlConversationModel::onSetAttachmentStatus);
     connect(this, &VSQSqlConversationModel::setAttachmentFilePath, this, &VSQSqlConversationModel::onSetAttachmentFilePath);
@@ -114,6 +842,11 @@ VSQSqlConversationModel::VSQSqlConversationModel(QObject *parent) :
     connect(this, &VSQSqlConversationModel::setAttachmentRemoteUrl, this, &VSQSqlConversationModel::onSetAttachmentRemoteUrl);
     connect(this, &VSQSqlConversationModel::setAttachmentThumbnailRemoteUrl, this, &VSQSqlConversationModel::onSetAttachmentThumbnailRemoteUrl);
     connect(this, &VSQSqlConversationModel::setAttachmentBytesTotal, this, &VSQSqlConversationModel::onSetAttachmentBytesTotal);
+    connect(m_writeQueue, &VSQSqlWriteQueue::insertFailed, this, &VSQSqlConversationModel::onInsertFailed);
+    connect(m_writeQueue, &VSQSqlWriteQueue::flushed, this, [this]() {
+        m_rejectedAttachments.clear();
+        _dropWrittenMutations();
+    });
 }
 
 /******************************************************************************/
@@ -129,111 +862,176 @@ VSQSqlConversationModel::setRecipient(const QString &recipient) {
         return;
     }
 
-    // TODO: Prevent SQL injection !!!
     m_recipient = recipient;
-
-    const QString filterString = QString::fromLatin1(
-        "(recipient = '%1' AND author = '%2') OR (recipient = '%2' AND author='%1')").arg(m_recipient, user());
-
-    setSort(2, Qt::AscendingOrder);
-    setFilter(filterString);
-
-        // select();
+    _resetWindow();
 
     emit recipientChanged();
 }
 
 /******************************************************************************/
-QVariant
-VSQSqlConversationModel::data(const QModelIndex &index, int role) const {
-    if (role < Qt::UserRole) {
-        return QSqlTableModel::data(index, role);
-   }
+int
+VSQSqlConversationModel::rowCount(const QModelIndex &parent) const {
+    if (parent.isValid()) {
+        return 0;
+    }
+    return m_rows.size();
+}
 
-    const QSqlRecord currRecord = record(index.row());
-    const int authorColumn = AuthorRole - Qt::UserRole;
-    const int timestampColumn = TimestampRole - Qt::UserRole;
+/******************************************************************************/
+bool
+VSQSqlConversationModel::canFetchMore(const QModelIndex &parent) const {
+    if (parent.isValid()) {
+        return false;
+    }
+    return hasOlderRows();
+}
 
-    if (role == FirstInRowRole) {
-        const QSqlRecord prevRecord = record(index.row() - 1);
-        const QVariant prevMsgAuthor = prevRecord.value(authorColumn);
-        const QVariant currMsgAuthor = currRecord.value(authorColumn);
-        const QVariant prevTimestamp = prevRecord.value(timestampColumn);
-        const QVariant currTimestamp = currRecord.value(timestampColumn);
+/******************************************************************************/
+void
+VSQSqlConversationModel::fetchMore(const QModelIndex &parent) {
+    if (!parent.isValid()) {
+        fetchOlderRows();
+    }
+}
+
+/******************************************************************************/
+bool
+VSQSqlConversationModel::hasOlderRows() const {
+    return m_hasOlderRows;
+}
 
-        // Check if previous message is from the same author
-        const bool isAuthor = currMsgAuthor.toString() != prevMsgAuthor.toString();
+/******************************************************************************/
+void
+VSQSqlConversationModel::fetchOlderRows() {
+    if (!m_hasOlderRows || m_rows.isEmpty()) {
+        return;
+    }
 
-        // Check if the message was sent in last 5 min
-        const bool isInFiveMinRange = prevTimestamp.toDateTime().addSecs(5 * 60) > currTimestamp.toDateTime();
+    const auto rows = _selectPage(true, kPageSize);
+    m_hasOlderRows = (rows.size() == kPageSize);
+    if (rows.isEmpty()) {
+        return;
+    }
 
-        // Message is considered to be the first in a row when it
-        // sends in a range of 1 min with previous message and
-        // from the same author
-        return isAuthor || !isInFiveMinRange;
+    const bool hadRows = !m_rows.isEmpty();
+    beginInsertRows(QModelIndex(), 0, rows.size() - 1);
+    m_rows.prepend(rows);
+    m_grouping = QVector<Grouping>(rows.size()) + m_grouping;
+    m_firstPosition -= rows.size();
+    _indexRows(0, rows.size() - 1);
+    _updateGrouping(0, rows.size());
+    _checkFilePresence(0, rows.size() - 1);
+    endInsertRows();
+    if (hadRows) {
+        // Formerly oldest message has got a predecessor
+        const auto oldestIndex = index(rows.size(), 0);
+        emit dataChanged(oldestIndex, oldestIndex, { FirstInRowRole });
     }
+}
 
-    if (role == InRowRole) {
-        const QSqlRecord nextRecord = record(index.row() + 1);
-        const QVariant nextMsgAuthor = nextRecord.value(authorColumn);
-        const QVariant currMsgAuthor = currRecord.value(authorColumn);
+/******************************************************************************/
+void
+VSQSqlConversationModel::releaseOlderRows() {
+    const int keepCount = kPageSize + kPrefetchMargin;
+    const int removeCount = m_rows.size() - keepCount;
+    if (removeCount <= 0) {
+        return;
+    }
 
-        return currMsgAuthor.toString() == nextMsgAuthor.toString();
+    beginRemoveRows(QModelIndex(), 0, removeCount - 1);
+    for (int i = 0; i < removeCount; ++i) {
+        m_positions.remove(m_rows.messageId(i));
     }
+    m_rows.removeFirst(removeCount);
+    m_grouping.remove(0, removeCount);
+    _updateGrouping(0, 0);
+    m_firstPosition += removeCount;
+    m_hasOlderRows = true;
+    endRemoveRows();
+
+    const auto oldestIndex = index(0, 0);
+    emit dataChanged(oldestIndex, oldestIndex, { FirstInRowRole });
+}
 
-    if (role == DayRole) {
-        const QVariant timestamp = currRecord.value(timestampColumn);
-        return timestamp.toDate();
+/******************************************************************************/
+QVariant
+VSQSqlConversationModel::data(const QModelIndex &index, int role) const {
+    if (!index.isValid() || index.row() >= m_rows.size() || role < Qt::UserRole) {
+        return QVariant();
     }
 
-    const auto attachmentId = currRecord.value(AttachmentIdRole - Qt::UserRole).toString();
+    const int row = index.row();
+    switch (role) {
+    case AuthorRole:
+        return m_rows.author(row);
+    case RecipientRole:
+        return m_rows.recipient(row);
+    case TimestampRole:
+        return QDateTime::fromMSecsSinceEpoch(m_rows.timestamp(row));
+    case MessageRole:
+        return m_rows.message(row);
+    case StatusRole:
+        return m_rows.status(row);
+    case MessageIdRole:
+        return m_rows.messageId(row);
+    case FirstInRowRole:
+        return m_grouping[row].firstInRow;
+    case InRowRole:
+        return m_grouping[row].inRow;
+    case DayRole:
+        return m_grouping[row].day;
+    default:
+        break;
+    }
 
-    if (role == AttachmentDisplaySizeRole) {
-        if (attachmentId.isEmpty()) {
+    // Text messages have no attachment fields, defaults are returned
+    static const VSQConversationRows::AttachmentFields noAttachment;
+    const auto attachmentPtr = m_rows.attachment(row);
+    const auto &attachment = attachmentPtr ? *attachmentPtr : noAttachment;
+
+    switch (role) {
+    case AttachmentIdRole:
+        return attachment.id;
+    case AttachmentBytesTotalRole:
+        return attachment.bytesTotal;
+    case AttachmentTypeRole:
+        return attachment.type;
+    case AttachmentFilePathRole:
+        return attachmentPtr ? QUrl::fromLocalFile(attachment.filePath) : QUrl();
+    case AttachmentRemoteUrlRole:
+        return attachment.remoteUrl;
+    case AttachmentThumbnailPathRole:
+        return attachmentPtr ? QUrl::fromLocalFile(attachment.thumbnailPath) : QUrl();
+    case AttachmentThumbnailWidthRole:
+        return attachment.thumbnailWidth;
+    case AttachmentThumbnailHeightRole:
+        return attachment.thumbnailHeight;
+    case AttachmentRemoteThumbnailUrlRole:
+        return attachment.remoteThumbnailUrl;
+    case AttachmentDisplaySizeRole:
+        if (!attachmentPtr) {
             return QString();
         }
-        const auto bytesTotal = currRecord.value(AttachmentBytesTotalRole - Qt::UserRole).toInt();
-        return (bytesTotal > 0) ? VSQUtils::formattedDataSize(bytesTotal) : " ";
-    }
-
-    if (role == AttachmentStatusRole) {
-        if (attachmentId.isEmpty()) {
+        return (attachment.bytesTotal > 0) ? VSQUtils::formattedDataSize(attachment.bytesTotal) : " ";
+    case AttachmentStatusRole: {
+        if (!attachmentPtr) {
             return 0;
         }
-        const auto messageId = currRecord.value(MessageIdRole - Qt::UserRole).toString();
-        const auto it = m_transferMap.find(messageId);
-        if (it == m_transferMap.end()) {
-            return currRecord.value(AttachmentStatusRole - Qt::UserRole).toInt();
-        }
-        return static_cast<int>(it->second.status);
+        const auto it = m_transferMap.find(m_rows.messageId(row));
+        return (it == m_transferMap.end()) ? attachment.status : static_cast<int>(it->second.status);
     }
-
-    if (role == AttachmentBytesLoadedRole) {
-        if (attachmentId.isEmpty()) {
+    case AttachmentBytesLoadedRole: {
+        if (!attachmentPtr) {
             return 0;
         }
-        const auto messageId = currRecord.value(MessageIdRole - Qt::UserRole).toString();
-        const auto it = m_transferMap.find(messageId);
+        const auto it = m_transferMap.find(m_rows.messageId(row));
         return (it == m_transferMap.end()) ? 0 : it->second.bytesReceived;
     }
-
-    if (role == AttachmentDownloadedRole) {
-        if (attachmentId.isEmpty()) {
-            return false;
-        }
-        const auto filePath = currRecord.value(AttachmentFilePathRole - Qt::UserRole).toString();
-        return QFile::exists(filePath);
-    }
-
-    if (role == AttachmentFilePathRole || role == AttachmentThumbnailPathRole) {
-        if (attachmentId.isEmpty()) {
-            return QUrl();
-        }
-        const auto filePath = currRecord.value(role - Qt::UserRole).toString();
-        return QUrl::fromLocalFile(filePath);
+    case AttachmentDownloadedRole:
+        return attachmentPtr && m_filePresence.exists(m_rows.messageId(row), attachment.filePath);
+    default:
+        return QVariant();
     }
-
-    return currRecord.value(role - Qt::UserRole);
 }
 
 /******************************************************************************/
@@ -279,6 +1077,14 @@ VSQSqlConversationModel::setUser(const QString &user) {
     }
 
     m_user = user;
+    m_storage->resetReaders();
+    m_filePresence.clear();
+    m_messageCache.clear();
+    {
+        // Mutations of the previous user are written by the migration
+        QMutexLocker locker(&m_unwrittenMutex);
+        m_unwritten = Unwritten();
+    }
 
     _createTable();
     _update();
@@ -286,48 +1092,76 @@ VSQSqlConversationModel::setUser(const QString &user) {
 
 /******************************************************************************/
 void VSQSqlConversationModel::setAsRead(const QString &author) {
-    QSqlQuery model;
-    QString query;
-
-    query = QString("UPDATE %1 SET status = %2 WHERE author = \"%3\"")
-            .arg(_tableName()).arg(static_cast<int>(StMessage::Status::MST_READ)).arg(author);
-
-    model.prepare(query);
-
-    qDebug() << query << model.exec();
+    // Only unread messages are touched, (author, status) index is used
+    const QString query = QString("UPDATE %1 SET status = ? WHERE author = ? AND status = ?").arg(_tableName());
+    m_writeQueue->exec(query, {
+        static_cast<int>(StMessage::Status::MST_READ), author, static_cast<int>(StMessage::Status::MST_RECEIVED)
+    });
+    const auto sequence = m_writeQueue->lastSequence();
+    QMutexLocker locker(&m_unwrittenMutex);
+    m_unwritten.reads[author] = { sequence, m_lastRowId };
 }
 
 /******************************************************************************/
 int
 VSQSqlConversationModel::getCountOfUnread(const QString &user) {
-    QSqlQueryModel model;
-    QString query;
-
-    query = QString("SELECT COUNT(*) AS C FROM %1 WHERE status = %2 AND recipient = \"%3\"")
-            .arg(_tableName()).arg(static_cast<int>(StMessage::Status::MST_RECEIVED)).arg(user);
-
-    model.setQuery(query);
-    int c = model.record(0).value("C").toInt();
-
-    qDebug() << c << user << query;
-
-    return c;
+    return getMessageCount(user, StMessage::Status::MST_RECEIVED);
 }
 
 
 /******************************************************************************/
 int
 VSQSqlConversationModel::getMessageCount(const QString &user, const StMessage::Status status) {
-    QSqlQueryModel model;
-    QString query;
-
-    query = QString("SELECT COUNT(*) AS C FROM %1 WHERE status = %2 AND recipient = \"%3\"")
-            .arg(_tableName()).arg(static_cast<int>(status)).arg(user);
+    const QString queryString = QString("SELECT COUNT(*) FROM %1 WHERE status = ? AND recipient = ?").arg(_tableName());
+
+    const auto unwritten = _unwrittenMutations();
+    VSQStorage::Reader reader(m_storage);
+    auto query = reader.statements().query(queryString, { static_cast<int>(status), user });
+    int c = 0;
+    if (query.exec() && query.next()) {
+        c = query.value(0).toInt();
+    }
+    query.finish();
+
+    // Stored messages that unwritten markings turn from received to read
+    const bool isReceived = (status == StMessage::Status::MST_RECEIVED);
+    if (isReceived || status == StMessage::Status::MST_READ) {
+        const QString readQueryString = QString("SELECT COUNT(*) FROM %1"
+                                                " WHERE recipient = ? AND author = ? AND status = ? AND rowid <= ?").arg(_tableName());
+        for (auto it = unwritten.reads.cbegin(); it != unwritten.reads.cend(); ++it) {
+            auto readQuery = reader.statements().query(readQueryString, {
+                user, it.key(), static_cast<int>(StMessage::Status::MST_RECEIVED), it->lastRowId
+            });
+            if (readQuery.exec() && readQuery.next()) {
+                c += isReceived ? -readQuery.value(0).toInt() : readQuery.value(0).toInt();
+            }
+            readQuery.finish();
+        }
+    }
 
-    model.setQuery(query);
-    int c = model.record(0).value("C").toInt();
+    // Stored state of messages with unwritten mutations is replaced by the effective one
+    const auto matches = [&user, status](const VSQConversationRows::RowData &row) {
+        return row.recipient == user && row.status == static_cast<int>(status);
+    };
+    const auto storedRows = _selectRows(unwritten.messages.keys());
+    for (auto it = unwritten.messages.cbegin(); it != unwritten.messages.cend(); ++it) {
+        auto storedIt = storedRows.constFind(it.key());
+        Optional<VSQConversationRows::RowData> row;
+        if (storedIt != storedRows.constEnd()) {
+            row = *storedIt;
+            _applyUnwrittenReads(unwritten, *row);
+            c -= matches(*row) ? 1 : 0;
+        }
+        else {
+            row = it->row;
+        }
+        if (row) {
+            _applyUnwritten(unwritten, *row);
+            c += matches(*row) ? 1 : 0;
+        }
+    }
 
-    qDebug() << c << user << query;
+    qDebug() << c << user << status;
 
     return c;
 }
@@ -335,43 +1169,82 @@ VSQSqlConversationModel::getMessageCount(const QString &user, const StMessage::S
 /******************************************************************************/
 QString
 VSQSqlConversationModel::getLastMessage(const QString &user) const {
-    QSqlQueryModel model;
-    QString query;
+    const auto row = _selectLastRow(user);
+    const QString message = row ? row->message : QString();
 
-    query = QString("SELECT * FROM %1 WHERE recipient = \"%2\" ORDER BY timestamp DESC LIMIT 1").arg(_tableName()).arg(user);
-
-    model.setQuery(query);
-    QString message = model.record(0).value("message").toString();
-
-    qDebug() << message << user << query;
+    qDebug() << message << user;
 
     return message;
 }
 
-QList<StMessage> VSQSqlConversationModel::getMessages(const QString &user, const StMessage::Status status) {
-    QSqlQueryModel model;
-    QString query;
-    query = QString("SELECT * FROM %1 WHERE status = %2 AND author = \"%3\"")
-            .arg(_tableName()).arg(static_cast<int>(status)).arg(user);
-    model.setQuery(query);
-    int c = model.rowCount();
-    qDebug() << c << user << query;
+QSet<QString> VSQSqlConversationModel::existingMessageIds(const QStringList &messageIds) const
+{
+    QSet<QString> existingIds;
+    if (messageIds.isEmpty()) {
+        return existingIds;
+    }
+    // Messages received a moment ago can be still queued
+    const auto unwritten = _unwrittenMutations();
+    for (const auto &messageId : messageIds) {
+        if (unwritten.messages.value(messageId).row) {
+            existingIds.insert(messageId);
+        }
+    }
 
-    QList<StMessage> messages;
-    for (int i = 0; i < c; i++) {
-        messages.append(getMessage(model.record(i)));
+    // Statement has a single shape, so it's prepared once. Unused placeholders are bound to NULL
+    QStringList placeholders;
+    for (int i = 0; i < kExistingIdsChunkSize; ++i) {
+        placeholders << QLatin1String("?");
     }
-    return messages;
+    const QString queryString = QString("SELECT message_id FROM %1 WHERE message_id IN (%2)")
+            .arg(_tableName(), placeholders.join(", "));
+    VSQStorage::Reader reader(m_storage);
+    for (int first = 0; first < messageIds.size(); first += kExistingIdsChunkSize) {
+        QVariantList bindValues;
+        for (int i = first; i < first + kExistingIdsChunkSize; ++i) {
+            bindValues << ((i < messageIds.size()) ? QVariant(messageIds[i]) : QVariant(QVariant::String));
+        }
+        auto query = reader.statements().query(queryString, bindValues);
+        if (query.exec()) {
+            while (query.next()) {
+                existingIds.insert(query.value(0).toString());
+            }
+        }
+        else {
+            qWarning() << "Failed to select existing messages:" << query.lastError().text();
+        }
+        query.finish();
+    }
+    return existingIds;
 }
 
 Optional<StMessage> VSQSqlConversationModel::getMessage(const QString &messageId) const
 {
-    QSqlQueryModel model;
-    model.setQuery(QString("SELECT * FROM %1 WHERE message_id = \"%2\"").arg(_tableName()).arg(messageId));
-    if (model.rowCount() == 0) {
-        return NullOptional;
+    if (auto message = m_messageCache.get(messageId)) {
+        return message;
     }
-    return getMessage(model.record(0));
+
+    const QString queryString = _selectMessagesQuery() + " WHERE m.message_id = ?";
+
+    // Mutation that lands after the read isn't applied to the read message, it's not cached then
+    const auto ticket = m_messageCache.beginFill();
+    const auto unwritten = _unwrittenMutations();
+    Optional<VSQConversationRows::RowData> row = unwritten.messages.value(messageId).row;
+    if (!row) {
+        VSQStorage::Reader reader(m_storage);
+        auto query = reader.statements().query(queryString, { messageId });
+        if (query.exec() && query.next()) {
+            row = _readRow(query.value(0).toLongLong(), query, 1);
+        }
+        query.finish();
+    }
+    Optional<StMessage> message;
+    if (row) {
+        _applyUnwritten(unwritten, *row);
+        message = _messageFromRow(*row);
+    }
+    m_messageCache.endFill(messageId, message, ticket);
+    return message;
 }
 
 StMessage VSQSqlConversationModel::getMessage(const QSqlRecord &record) const
@@ -403,125 +1276,207 @@ StMessage VSQSqlConversationModel::getMessage(const QSqlRecord &record) const
 }
 
 /******************************************************************************/
-QString VSQSqlConversationModel::escapedUserName() const
-{
-    QString name(m_user);
-    name.remove(QRegExp("[^a-z0-9_]"));
-    return name;
+QString
+VSQSqlConversationModel::getLastMessageTime(const QString &user) const {
+    const auto row = _selectLastRow(user);
+    const QString timestamp = row ? QDateTime::fromMSecsSinceEpoch(row->timestamp).toString(Qt::ISODate) : QString();
+
+    qDebug() << timestamp << user;
+
+    return timestamp;
 }
 
 /******************************************************************************/
-QString
-VSQSqlConversationModel::getLastMessageTime(const QString &user) const {
-    QSqlQueryModel model;
-    QString query;
+QString VSQSqlConversationModel::_tableName() const {
+    return _tableName(m_user);
+}
 
-    query = QString("SELECT * FROM %1 WHERE recipient = \"%2\" ORDER BY timestamp DESC LIMIT 1").arg(_tableName()).arg(user);
+/******************************************************************************/
+QString VSQSqlConversationModel::_tableName(const QString &user) {
+    return QString("Conversations_") + VSQUtils::escapedUserName(user);
+}
 
-    model.setQuery(query);
-    QString timestamp = model.record(0).value("timestamp").toString();
+/******************************************************************************/
+QString VSQSqlConversationModel::_contactsTableName(const QString &user) {
+    return QString("Contacts_") + VSQUtils::escapedUserName(user);
+}
 
-    qDebug() << timestamp << user << query;
+/******************************************************************************/
+QString VSQSqlConversationModel::_attachmentsTableName() const {
+    return _attachmentsTableName(m_user);
+}
 
-    return timestamp;
+/******************************************************************************/
+QString VSQSqlConversationModel::_attachmentsTableName(const QString &user) {
+    return QString("Attachments_") + VSQUtils::escapedUserName(user);
 }
 
 /******************************************************************************/
-QString VSQSqlConversationModel::_tableName() const {
-    return QString("Conversations_") + escapedUserName();
+QString VSQSqlConversationModel::_selectMessagesQuery() const {
+    // Columns are in the order of roles, attachment columns are NULL for text messages.
+    // Attachments that aren't moved yet are read from the messages table
+    QStringList attachmentColumns;
+    for (const auto &column : QString(kAttachmentColumns).split(", ")) {
+        attachmentColumns << QString("CASE WHEN a.message_id IS NULL THEN m.%1 ELSE a.%1 END AS %1").arg(column);
+    }
+    return QString("SELECT m.rowid, m.author, m.recipient, m.timestamp, m.message, m.status, m.message_id, %1"
+                   " FROM %2 m LEFT JOIN %3 a ON a.message_id = m.message_id")
+            .arg(attachmentColumns.join(", "), _tableName(), _attachmentsTableName());
+}
+
+/******************************************************************************/
+QString VSQSqlConversationModel::_searchTableName() const {
+    return QString("Search_") + VSQUtils::escapedUserName(m_user);
+}
+
+/******************************************************************************/
+QString VSQSqlConversationModel::tableName() const {
+    return _tableName();
+}
+
+/******************************************************************************/
+QString VSQSqlConversationModel::attachmentsTableName() const {
+    return _attachmentsTableName();
 }
 
 /******************************************************************************/
-QString VSQSqlConversationModel::_contactsTableName() const {
-    return QString("Contacts_") + escapedUserName();
+QString VSQSqlConversationModel::searchTableName() const {
+    return m_searchAvailable ? _searchTableName() : QString();
+}
+
+/******************************************************************************/
+bool
+VSQSqlConversationModel::_createSearchIndex() {
+    const QString table = _tableName();
+    const QString searchTable = _searchTableName();
+
+    // External content index: message text is not duplicated, snippets are read from the messages table.
+    // Attachment display name is stored in the message column, so it's indexed too
+    VSQSqlMigrator migrator(m_writeQueue, searchTable);
+    migrator.addStep(1, {
+        QString("CREATE VIRTUAL TABLE %1 USING fts5(message, content='%2', content_rowid='rowid', prefix='2 3')")
+            .arg(searchTable, table),
+        QString("CREATE TRIGGER %1_insert AFTER INSERT ON %2 BEGIN"
+                " INSERT INTO %1 (rowid, message) VALUES (new.rowid, new.message);"
+                " END").arg(searchTable, table),
+        QString("CREATE TRIGGER %1_delete AFTER DELETE ON %2 BEGIN"
+                " INSERT INTO %1 (%1, rowid, message) VALUES ('delete', old.rowid, old.message);"
+                " END").arg(searchTable, table),
+        QString("CREATE TRIGGER %1_update AFTER UPDATE OF message ON %2 BEGIN"
+                " INSERT INTO %1 (%1, rowid, message) VALUES ('delete', old.rowid, old.message);"
+                " INSERT INTO %1 (rowid, message) VALUES (new.rowid, new.message);"
+                " END").arg(searchTable, table),
+        QLatin1String("CREATE TABLE IF NOT EXISTS SearchBackfill ("
+                      "name TEXT NOT NULL PRIMARY KEY, lower_rowid INTEGER NOT NULL, upper_rowid INTEGER NOT NULL)"),
+        QString("INSERT OR REPLACE INTO SearchBackfill (name, lower_rowid, upper_rowid)"
+                " SELECT '%1', IFNULL(MIN(rowid), 0), IFNULL(MAX(rowid), 0) + 1 FROM %2").arg(searchTable, table)
+    });
+    if (!migrator.migrate()) {
+        qWarning() << "Message search is not available, FTS5 is required:" << searchTable;
+        return false;
+    }
+    return true;
 }
 
 void VSQSqlConversationModel::onCreateMessage(const QString recipient, const QString message, const QString messageId,
                                               const OptionalAttachment attachment)
 {
-    const QString timestamp = QDateTime::currentDateTime().toString(Qt::ISODate);
-
-    QSqlRecord newRecord = record();
-    newRecord.setValue("author", user());
-    newRecord.setValue("recipient", recipient);
-    newRecord.setValue("timestamp", timestamp);
-    newRecord.setValue("message", message);
-    newRecord.setValue("status", static_cast<int>(StMessage::Status::MST_CREATED));
-    newRecord.setValue("message_id", messageId);
-    if (attachment) {
-        newRecord.setValue("attachment_id", attachment->id);
-        newRecord.setValue("attachment_bytes_total", attachment->bytesTotal);
-        newRecord.setValue("attachment_type", static_cast<int>(attachment->type));
-        newRecord.setValue("attachment_file_path", attachment->filePath);
-        newRecord.setValue("attachment_remote_url", attachment->remoteUrl.toString());
-        if (attachment->type == Attachment::Type::Picture) {
-            newRecord.setValue("attachment_thumbnail_path", attachment->thumbnailPath);
-            newRecord.setValue("attachment_thumbnail_width", attachment->thumbnailSize.width());
-            newRecord.setValue("attachment_thumbnail_height", attachment->thumbnailSize.height());
-            newRecord.setValue("attachment_remote_thumbnail_url", attachment->remoteThumbnailUrl.toString());
-        }
-        newRecord.setValue("attachment_status", static_cast<int>(attachment->status));
-    }
-    if (!insertRowIntoTable(newRecord)) {
-        qWarning() << "Failed to create message:" << lastError().text();
-        return;
+    const auto record = _createRecord(user(), recipient, messageId, message, StMessage::Status::MST_CREATED, attachment);
+    if (!_insertMessage(record)) {
+        qWarning() << "Failed to create message:" << messageId;
     }
-
-    submitAll();
-    select();
 }
 
 void VSQSqlConversationModel::onReceiveMessage(const QString messageId, const QString author, const QString message, const OptionalAttachment attachment)
 {
-    const QString timestamp = QDateTime::currentDateTime().toString(Qt::ISODate);
-
-    QSqlRecord newRecord = record();
-    newRecord.setValue("author", author);
-    newRecord.setValue("recipient", user());
-    newRecord.setValue("timestamp", timestamp);
-    newRecord.setValue("message", message);
-    newRecord.setValue("status", static_cast<int>(StMessage::Status::MST_RECEIVED));
-    newRecord.setValue("message_id", messageId);
-    if (attachment) {
-        // TODO(fpohtmeh): merge with onCreateMessage
-        newRecord.setValue("attachment_id", attachment->id);
-        newRecord.setValue("attachment_bytes_total", attachment->bytesTotal);
-        newRecord.setValue("attachment_type", static_cast<int>(attachment->type));
-        newRecord.setValue("attachment_file_path", attachment->filePath);
-        newRecord.setValue("attachment_remote_url", attachment->remoteUrl.toString());
-        if (attachment->type == Attachment::Type::Picture) {
-            newRecord.setValue("attachment_thumbnail_path", attachment->thumbnailPath);
-            newRecord.setValue("attachment_thumbnail_width", attachment->thumbnailSize.width());
-            newRecord.setValue("attachment_thumbnail_height", attachment->thumbnailSize.height());
-            newRecord.setValue("attachment_remote_thumbnail_url", attachment->remoteThumbnailUrl.toString());
+    const auto record = _createRecord(author, user(), messageId, message, StMessage::Status::MST_RECEIVED, attachment);
+    if (!_insertMessage(record)) {
+        qWarning() << "Failed to save received message:" << messageId;
+    }
+}
+
+void VSQSqlConversationModel::onReceiveMessages(const QList<StMessage> messages)
+{
+    // Archived messages can race with the same messages received live
+    QStringList archivedIds;
+    for (const auto &message : messages) {
+        if (message.timestamp > 0) {
+            archivedIds << message.messageId;
         }
-        newRecord.setValue("attachment_status", static_cast<int>(attachment->status));
     }
-    if (!insertRowIntoTable(newRecord)) {
-        qWarning() << "Failed to save received message:" << lastError().text();
+    const auto existingIds = archivedIds.isEmpty() ? QSet<QString>() : existingMessageIds(archivedIds);
+
+    QVector<QSqlRecord> records;
+    records.reserve(messages.size());
+    for (const auto &message : messages) {
+        if (existingIds.contains(message.messageId)) {
+            continue;
+        }
+        if (message.sender == user()) {
+            records.push_back(_createRecord(user(), message.recipient, message.messageId, message.message,
+                                            StMessage::Status::MST_SENT, message.attachment, message.timestamp));
+        }
+        else {
+            records.push_back(_createRecord(message.sender, user(), message.messageId, message.message,
+                                            StMessage::Status::MST_RECEIVED, message.attachment, message.timestamp));
+        }
+    }
+    const int insertedCount = _insertMessages(records);
+    if (insertedCount != records.size()) {
+        qWarning() << "Failed to save received messages:" << (records.size() - insertedCount);
+    }
+}
+
+void VSQSqlConversationModel::onInsertFailed(const QString &table, const QVariantMap &values)
+{
+    const auto messageId = values.value("message_id").toString();
+    if (table == _attachmentsTableName()) {
+        m_rejectedAttachments.insert(messageId);
         return;
     }
+    if (table != _tableName()) {
+        return;
+    }
+    qWarning() << "Message was not stored:" << messageId;
+
+    // Row of the rejected insertion isn't applied to reads, the stored message keeps its mutations
+    Optional<StMessage> message = m_messageCache.get(messageId);
+    {
+        QMutexLocker locker(&m_unwrittenMutex);
+        const auto it = m_unwritten.messages.find(messageId);
+        if (it != m_unwritten.messages.end() && it->row && it->row->rowId == values.value("rowid").toLongLong()) {
+            if (!message) {
+                message = _messageFromRow(*it->row);
+            }
+            it->row = NullOptional;
+        }
+    }
+
+    // Attachment of the rejected message is removed unless it was rejected too
+    if (message && message->attachment && !m_rejectedAttachments.contains(messageId)) {
+        m_writeQueue->exec(QString("DELETE FROM %1 WHERE message_id = ? AND attachment_id = ?").arg(_attachmentsTableName()),
+                           { messageId, message->attachment->id });
+    }
+    m_rejectedAttachments.remove(messageId);
+    m_messageCache.remove(messageId);
 
-    submitAll();
+    const int row = _findRow(messageId);
+    if (row >= 0 && m_rows.rowId(row) == values.value("rowid").toLongLong()) {
+        _resetWindow();
+    }
 }
 
 void VSQSqlConversationModel::onSetMessageStatus(const QString messageId, const StMessage::Status status)
 {
     qDebug() << "SQL message status:" << messageId << "=>" << status;
-    QString query = QString("UPDATE %1 SET status = %2 WHERE message_id = '%3'")
-            .arg(_tableName()).arg(static_cast<int>(status)).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
+    _updateMessage(messageId, "status", static_cast<int>(status));
+    _setCachedValue(messageId, StatusRole, static_cast<int>(status));
 }
 
 void VSQSqlConversationModel::onSetAttachmentStatus(const QString messageId, const Enums::AttachmentStatus status)
 {
     qDebug() << "SQL attachment status:" << messageId << "=>" << status;
-    QString query = QString("UPDATE %1 SET attachment_status = %2 WHERE message_id = '%3'")
-            .arg(_tableName()).arg(static_cast<int>(status)).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
-
+    _updateAttachment(messageId, "attachment_status", static_cast<int>(status));
     if (status == Attachment::Status::Loading) {
         m_transferMap[messageId] = TransferInfo();
     }
@@ -531,44 +1486,44 @@ void VSQSqlConversationModel::onSetAttachmentStatus(const QString messageId, con
             m_transferMap.erase(it);
         }
     }
-    emit dataChanged(index(0, 0), index(rowCount() - 1, 0), { AttachmentBytesLoadedRole, AttachmentStatusRole });
+    _updateCachedAttachment(messageId, [status](Attachment &attachment) { attachment.status = status; });
+    _setCachedValue(messageId, AttachmentStatusRole, static_cast<int>(status),
+                    { AttachmentBytesLoadedRole, AttachmentStatusRole });
 }
 
 void VSQSqlConversationModel::onSetAttachmentRemoteUrl(const QString messageId, const QUrl url)
 {
-    QString query = QString("UPDATE %1 SET attachment_remote_url = '%2' WHERE message_id = '%3'")
-            .arg(_tableName()).arg(url.toString()).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
+    _updateAttachment(messageId, "attachment_remote_url", url.toString());
+    _updateCachedAttachment(messageId, [&url](Attachment &attachment) { attachment.remoteUrl = url; });
+    _setCachedValue(messageId, AttachmentRemoteUrlRole, url.toString());
     qDebug() << "SQL attachment remote url:" << messageId << "=>" << url.toString();
 }
 
 void VSQSqlConversationModel::onSetAttachmentThumbnailRemoteUrl(const QString messageId, const QUrl url)
 {
-    QString query = QString("UPDATE %1 SET attachment_remote_thumbnail_url = '%2' WHERE message_id = '%3'")
-            .arg(_tableName()).arg(url.toString()).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
+    _updateAttachment(messageId, "attachment_remote_thumbnail_url", url.toString());
+    _updateCachedAttachment(messageId, [&url](Attachment &attachment) { attachment.remoteThumbnailUrl = url; });
+    _setCachedValue(messageId, AttachmentRemoteThumbnailUrlRole, url.toString());
     qDebug() << "SQL attachment remote thumbnail url:" << messageId << "=>" << url.toString();
 }
 
 void VSQSqlConversationModel::onSetAttachmentBytesTotal(const QString messageId, const DataSize size)
 {
-    QString query = QString("UPDATE %1 SET attachment_bytes_total = %2 WHERE message_id = '%3'")
-            .arg(_tableName()).arg(size).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
+    _updateAttachment(messageId, "attachment_bytes_total", size);
+    _updateCachedAttachment(messageId, [size](Attachment &attachment) { attachment.bytesTotal = size; });
+    _setCachedValue(messageId, AttachmentBytesTotalRole, size,
+                    { AttachmentBytesTotalRole, AttachmentDisplaySizeRole });
     qDebug() << "SQL attachment filesize:" << messageId << "=>" << size;
 }
 
 void VSQSqlConversationModel::onSetAttachmentFilePath(const QString messageId, const QString filePath)
 {
-    QString query = QString("UPDATE %1 SET attachment_file_path = '%2' WHERE message_id = '%3'")
-            .arg(_tableName()).arg(filePath).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
+    _updateAttachment(messageId, "attachment_file_path", filePath);
+    m_filePresence.setFilePath(messageId, filePath);
+    _updateCachedAttachment(messageId, [&filePath](Attachment &attachment) { attachment.filePath = filePath; });
+    _setCachedValue(messageId, AttachmentFilePathRole, filePath,
+                    { AttachmentFilePathRole, AttachmentDownloadedRole });
     qDebug() << "SQL attachment filePath:" << messageId << "=>" << filePath;
-    emit dataChanged(index(0, 0), index(rowCount() - 1, 0), { AttachmentDownloadedRole });
 }
 
 void VSQSqlConversationModel::onSetAttachmentProgress(const QString messageId, const DataSize bytesReceived, const DataSize bytesTotal)
@@ -579,15 +1534,13 @@ void VSQSqlConversationModel::onSetAttachmentProgress(const QString messageId, c
     if (it != m_transferMap.end()) {
         it->second.bytesReceived = bytesReceived;
     }
-    emit dataChanged(index(0, 0), index(rowCount() - 1, 0), { AttachmentBytesLoadedRole });
+    _emitRowChanged(messageId, { AttachmentBytesLoadedRole });
 }
 
 void VSQSqlConversationModel::onSetAttachmentThumbnailPath(const QString messageId, const QString filePath)
 {
-    QString query = QString("UPDATE %1 SET attachment_thumbnail_path = '%2' WHERE message_id = '%3'")
-            .arg(_tableName()).arg(filePath).arg(messageId);
-    QSqlQuery().exec(query);
-    select();
+    _updateAttachment(messageId, "attachment_thumbnail_path", filePath);
+    _updateCachedAttachment(messageId, [&filePath](Attachment &attachment) { attachment.thumbnailPath = filePath; });
+    _setCachedValue(messageId, AttachmentThumbnailPathRole, filePath);
     qDebug() << "SQL attachment thumbnail path:" << messageId << "=>" << filePath;
-    emit dataChanged(index(0, 0), index(rowCount() - 1, 0), { AttachmentThumbnailPathRole });
 }
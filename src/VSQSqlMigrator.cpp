@@ -0,0 +1,154 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQSqlMigrator.h"
+
+#include <QSqlError>
+#include <QSqlQuery>
+
+Q_LOGGING_CATEGORY(lcSqlMigrator, "sqlmigrator");
+
+VSQSqlMigrator::VSQSqlMigrator(VSQSqlWriteQueue *writeQueue, const QString &table)
+    : m_writeQueue(writeQueue)
+    , m_table(table)
+{
+}
+
+void VSQSqlMigrator::addStep(int version, const QStringList &statements)
+{
+    addStep(version, [statements](QSqlDatabase &database) {
+        return execStatements(database, statements);
+    });
+}
+
+void VSQSqlMigrator::addStep(int version, const Step &step)
+{
+    m_steps.insert(version, step);
+}
+
+bool VSQSqlMigrator::migrate()
+{
+    bool migrated = false;
+    m_writeQueue->call([this, &migrated](QSqlDatabase &database) {
+        migrated = applySteps(database);
+        return migrated;
+    });
+    m_writeQueue->flush();
+    return migrated;
+}
+
+void VSQSqlMigrator::runBatches(VSQSqlWriteQueue *writeQueue, const QStringList &batchStatements,
+                                const QStringList &finishStatements, const std::function<void ()> &finished)
+{
+    writeQueue->call([=](QSqlDatabase &database) {
+        int rowsAffected = 0;
+        if (!execStatements(database, batchStatements, &rowsAffected)) {
+            // Remaining batches are retried on the next start
+            return false;
+        }
+        if (rowsAffected > 0) {
+            runBatches(writeQueue, batchStatements, finishStatements, finished);
+            return true;
+        }
+        if (!execStatements(database, finishStatements)) {
+            return false;
+        }
+        if (finished) {
+            finished();
+        }
+        return true;
+    });
+}
+
+bool VSQSqlMigrator::execStatements(QSqlDatabase &database, const QStringList &statements, int *lastRowsAffected)
+{
+    QSqlQuery query(database);
+    for (const auto &statement : statements) {
+        if (!query.exec(statement)) {
+            qCWarning(lcSqlMigrator) << "Statement failed:" << statement << query.lastError().text();
+            return false;
+        }
+    }
+    if (lastRowsAffected) {
+        *lastRowsAffected = query.numRowsAffected();
+    }
+    return true;
+}
+
+bool VSQSqlMigrator::applySteps(QSqlDatabase &database)
+{
+    QSqlQuery query(database);
+    if (!query.exec(QLatin1String("CREATE TABLE IF NOT EXISTS SchemaVersions ("
+                                  "name TEXT NOT NULL PRIMARY KEY, version INTEGER NOT NULL)"))) {
+        qCCritical(lcSqlMigrator) << "Unable to create versions table:" << query.lastError().text();
+        return false;
+    }
+
+    int version = 0;
+    query.prepare(QLatin1String("SELECT version FROM SchemaVersions WHERE name = ?"));
+    query.addBindValue(m_table);
+    if (query.exec() && query.next()) {
+        version = query.value(0).toInt();
+    }
+    query.finish();
+
+    auto it = m_steps.upperBound(version);
+    if (it == m_steps.end()) {
+        return true;
+    }
+
+    // Steps are applied all together or not at all
+    query.exec(QLatin1String("SAVEPOINT migration"));
+    for (; it != m_steps.end(); ++it) {
+        if (!it.value()(database)) {
+            qCCritical(lcSqlMigrator) << "Unable to migrate" << m_table << "to version" << it.key();
+            query.exec(QLatin1String("ROLLBACK TO migration"));
+            query.exec(QLatin1String("RELEASE migration"));
+            return false;
+        }
+        qCDebug(lcSqlMigrator) << m_table << "migrated from version" << version << "to" << it.key();
+        version = it.key();
+    }
+
+    query.prepare(QLatin1String("INSERT OR REPLACE INTO SchemaVersions (name, version) VALUES (?, ?)"));
+    query.addBindValue(m_table);
+    query.addBindValue(version);
+    const bool saved = query.exec();
+    if (!saved) {
+        qCCritical(lcSqlMigrator) << "Unable to save version:" << query.lastError().text();
+        query.exec(QLatin1String("ROLLBACK TO migration"));
+    }
+    query.exec(QLatin1String("RELEASE migration"));
+    return saved;
+}
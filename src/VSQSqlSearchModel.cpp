@@ -0,0 +1,255 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQSqlSearchModel.h"
+
+#include <QFutureWatcher>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QtConcurrent>
+
+#include "VSQSqlConversationModel.h"
+#include "VSQSqlStatementCache.h"
+#include "VSQStorage.h"
+
+Q_LOGGING_CATEGORY(lcSqlSearch, "sqlsearch");
+
+// Results loaded per page
+static const int kSearchPageSize = 30;
+// Query is started when typing pauses for this interval
+static const int kSearchDelayMs = 150;
+// Words of context around matches in snippet
+static const int kSnippetTokens = 16;
+
+// Snippet match markers, replaced with rich text after escaping
+static const QChar kMatchBegin(0x02);
+static const QChar kMatchEnd(0x03);
+
+VSQSqlSearchModel::VSQSqlSearchModel(VSQStorage *storage, VSQSqlConversationModel *conversations, QObject *parent)
+    : QAbstractListModel(parent)
+    , m_storage(storage)
+    , m_conversations(conversations)
+    , m_debounceTimer(this)
+{
+    m_debounceTimer.setSingleShot(true);
+    m_debounceTimer.setInterval(kSearchDelayMs);
+    connect(&m_debounceTimer, &QTimer::timeout, this, &VSQSqlSearchModel::loadPage);
+}
+
+QString VSQSqlSearchModel::query() const
+{
+    return m_query;
+}
+
+void VSQSqlSearchModel::setQuery(const QString &query)
+{
+    if (query == m_query) {
+        return;
+    }
+    m_query = query;
+
+    ++m_generation;
+    beginResetModel();
+    m_results.clear();
+    m_hasMoreResults = false;
+    endResetModel();
+    setSearching(false);
+
+    if (toMatchExpression(m_query).isEmpty()) {
+        m_debounceTimer.stop();
+    }
+    else {
+        m_debounceTimer.start();
+    }
+    emit queryChanged(query);
+}
+
+bool VSQSqlSearchModel::searching() const
+{
+    return m_searching;
+}
+
+void VSQSqlSearchModel::clear()
+{
+    setQuery(QString());
+}
+
+int VSQSqlSearchModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_results.size();
+}
+
+QVariant VSQSqlSearchModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_results.size()) {
+        return QVariant();
+    }
+
+    const auto &result = m_results[index.row()];
+    switch (role) {
+    case MessageIdRole:
+        return result.messageId;
+    case ChatRole:
+        return result.chat;
+    case SnippetRole:
+        return result.snippet;
+    case TimestampRole:
+        return result.timestamp;
+    default:
+        return QVariant();
+    }
+}
+
+QHash<int, QByteArray> VSQSqlSearchModel::roleNames() const
+{
+    return {
+        { MessageIdRole, "messageId" },
+        { ChatRole, "chat" },
+        { SnippetRole, "snippet" },
+        { TimestampRole, "timestamp" }
+    };
+}
+
+bool VSQSqlSearchModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && m_hasMoreResults && !m_searching;
+}
+
+void VSQSqlSearchModel::fetchMore(const QModelIndex &parent)
+{
+    if (canFetchMore(parent)) {
+        loadPage();
+    }
+}
+
+void VSQSqlSearchModel::loadPage()
+{
+    Request request;
+    request.user = m_conversations->user();
+    request.table = m_conversations->tableName();
+    request.searchTable = m_conversations->searchTableName();
+    request.matchExpression = toMatchExpression(m_query);
+    request.offset = m_results.size();
+    if (request.searchTable.isEmpty() || request.matchExpression.isEmpty()) {
+        return;
+    }
+
+    setSearching(true);
+    const auto generation = m_generation;
+    auto watcher = new QFutureWatcher<Results>(this);
+    connect(watcher, &QFutureWatcher<Results>::finished, this, [this, watcher, generation]() {
+        onPageLoaded(generation, watcher->result());
+        watcher->deleteLater();
+    });
+    auto storage = m_storage;
+    watcher->setFuture(QtConcurrent::run([storage, request]() {
+        return selectPage(storage, request);
+    }));
+}
+
+void VSQSqlSearchModel::setSearching(bool searching)
+{
+    if (searching == m_searching) {
+        return;
+    }
+    m_searching = searching;
+    emit searchingChanged(searching);
+}
+
+void VSQSqlSearchModel::onPageLoaded(quint64 generation, const Results &results)
+{
+    if (generation != m_generation) {
+        return;
+    }
+    setSearching(false);
+    m_hasMoreResults = results.size() == kSearchPageSize;
+    if (results.isEmpty()) {
+        return;
+    }
+    const int first = m_results.size();
+    beginInsertRows(QModelIndex(), first, first + results.size() - 1);
+    m_results += results;
+    endInsertRows();
+}
+
+QString VSQSqlSearchModel::toMatchExpression(const QString &query)
+{
+    // Every word is quoted, so FTS5 syntax can't be injected. The last word is a prefix
+    // to find messages while typing
+    QStringList terms;
+    for (auto term : query.simplified().split(QLatin1Char(' '), QString::SkipEmptyParts)) {
+        term.replace(QLatin1Char('"'), QLatin1String("\"\""));
+        terms << QLatin1Char('"') + term + QLatin1Char('"');
+    }
+    if (!terms.isEmpty()) {
+        terms.last() += QLatin1Char('*');
+    }
+    return terms.join(QLatin1Char(' '));
+}
+
+VSQSqlSearchModel::Results VSQSqlSearchModel::selectPage(VSQStorage *storage, const Request &request)
+{
+    // Ranking and paging are done by the index, only the page rows are joined with messages
+    const QString queryString = QString(
+            "SELECT c.message_id, CASE WHEN c.author = ? THEN c.recipient ELSE c.author END, s.snippet, c.timestamp"
+            " FROM (SELECT rowid, snippet(%2, 0, char(2), char(3), '...', %3) AS snippet, rank FROM %2"
+            "       WHERE %2 MATCH ? ORDER BY rank LIMIT ? OFFSET ?) AS s"
+            " JOIN %1 AS c ON c.rowid = s.rowid"
+            " ORDER BY s.rank").arg(request.table, request.searchTable).arg(kSnippetTokens);
+
+    VSQStorage::Reader reader(storage);
+    auto query = reader.statements().query(queryString, {
+        request.user, request.matchExpression, kSearchPageSize, request.offset
+    });
+    Results results;
+    if (!query.exec()) {
+        qCWarning(lcSqlSearch) << "Search failed:" << query.lastError().text();
+        return results;
+    }
+
+    results.reserve(kSearchPageSize);
+    while (query.next()) {
+        Result result;
+        result.messageId = query.value(0).toString();
+        result.chat = query.value(1).toString();
+        result.snippet = query.value(2).toString().toHtmlEscaped()
+                .replace(kMatchBegin, QLatin1String("<b>"))
+                .replace(kMatchEnd, QLatin1String("</b>"));
+        result.timestamp = QDateTime::fromMSecsSinceEpoch(query.value(3).toLongLong());
+        results.push_back(result);
+    }
+    query.finish();
+    qCDebug(lcSqlSearch) << "Found" << results.size() << "messages at offset" << request.offset;
+    return results;
+}
@@ -0,0 +1,97 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQSqlStatementCache.h"
+
+#include <QDebug>
+#include <QSqlError>
+
+// Distinct statements of a connection are few, the bound protects from statements built from data
+static const int kMaxCachedQueries = 64;
+
+VSQSqlStatementCache::VSQSqlStatementCache(const QString &connectionName)
+    : m_connectionName(connectionName)
+{}
+
+VSQSqlStatementCache::~VSQSqlStatementCache()
+{
+    clear();
+}
+
+QSqlQuery VSQSqlStatementCache::query(const QString &statement, const QVariantList &bindValues)
+{
+    const auto it = m_index.constFind(statement);
+    if (it != m_index.constEnd()) {
+        m_entries.splice(m_entries.begin(), m_entries, it.value());
+    }
+    else {
+        QSqlQuery query(QSqlDatabase::database(m_connectionName));
+        query.setForwardOnly(true);
+        if (!query.prepare(statement)) {
+            qWarning() << "Failed to prepare statement:" << statement << query.lastError().text();
+        }
+        m_entries.emplace_front(statement, query);
+        m_index.insert(statement, m_entries.begin());
+        if (m_index.size() > kMaxCachedQueries) {
+            m_index.remove(m_entries.back().first);
+            m_entries.pop_back();
+        }
+    }
+
+    auto &query = m_entries.front().second;
+    // Release result of the previous execution
+    query.finish();
+    for (int i = 0; i < bindValues.size(); ++i) {
+        query.bindValue(i, bindValues[i]);
+    }
+    return query;
+}
+
+void VSQSqlStatementCache::finishAll()
+{
+    for (auto &entry : m_entries) {
+        entry.second.finish();
+    }
+}
+
+void VSQSqlStatementCache::clear()
+{
+    m_index.clear();
+    m_entries.clear();
+}
+
+QString VSQSqlStatementCache::connectionName() const
+{
+    return m_connectionName;
+}
@@ -0,0 +1,296 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQSqlWriteQueue.h"
+
+#include <QMutexLocker>
+#include <QSqlError>
+#include <QStringList>
+#include <QThread>
+
+Q_LOGGING_CATEGORY(lcSqlWriteQueue, "sqlwritequeue");
+
+// Pending mutations are written not later than this interval
+static const int kFlushIntervalMs = 100;
+// Pending mutations are written immediately when this count is reached
+static const int kMaxBatchSize = 256;
+
+VSQSqlWriteQueue::VSQSqlWriteQueue(const QString &connectionName, QObject *parent)
+    : QObject(parent)
+    , m_connectionName(connectionName)
+    , m_statements(connectionName)
+    , m_timer(this)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setInterval(kFlushIntervalMs);
+    connect(&m_timer, &QTimer::timeout, this, &VSQSqlWriteQueue::writePending);
+}
+
+VSQSqlWriteQueue::~VSQSqlWriteQueue()
+{
+    if (hasPending()) {
+        qCWarning(lcSqlWriteQueue) << "Queue was destroyed with pending mutations, writing them";
+        writePending();
+    }
+}
+
+void VSQSqlWriteQueue::insert(const QString &table, const QString &keyColumn, const QVariantMap &values)
+{
+    Operation operation;
+    operation.type = OperationType::Insert;
+    operation.table = table;
+    operation.keyColumn = keyColumn;
+    operation.key = values.value(keyColumn);
+    operation.values = values;
+    enqueue(operation);
+}
+
+void VSQSqlWriteQueue::update(const QString &table, const QString &keyColumn, const QVariant &key, const QVariantMap &values)
+{
+    Operation operation;
+    operation.type = OperationType::Update;
+    operation.table = table;
+    operation.keyColumn = keyColumn;
+    operation.key = key;
+    operation.values = values;
+    enqueue(operation);
+}
+
+void VSQSqlWriteQueue::exec(const QString &statement, const QVariantList &bindValues)
+{
+    Operation operation;
+    operation.type = OperationType::Statement;
+    operation.statement = statement;
+    operation.bindValues = bindValues;
+    enqueue(operation);
+}
+
+void VSQSqlWriteQueue::call(const Function &function)
+{
+    Operation operation;
+    operation.type = OperationType::Function;
+    operation.function = function;
+    enqueue(operation);
+}
+
+bool VSQSqlWriteQueue::flush()
+{
+    if (QThread::currentThread() == thread()) {
+        return writePending();
+    }
+    bool written = false;
+    QMetaObject::invokeMethod(this, [this, &written]() { written = writePending(); }, Qt::BlockingQueuedConnection);
+    return written;
+}
+
+bool VSQSqlWriteQueue::hasPending() const
+{
+    QMutexLocker locker(&m_mutex);
+    return !m_operations.isEmpty();
+}
+
+quint64 VSQSqlWriteQueue::lastSequence() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lastSequence;
+}
+
+quint64 VSQSqlWriteQueue::writtenSequence() const
+{
+    return m_writtenSequence.loadAcquire();
+}
+
+void VSQSqlWriteQueue::enqueue(const Operation &operation)
+{
+    int pendingCount = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        ++m_lastSequence;
+        if (operation.type == OperationType::Statement || operation.type == OperationType::Function) {
+            // Statement can depend on any previous mutation, so nothing is merged across it
+            m_operations.push_back(operation);
+            m_mergeIndices.clear();
+        }
+        else {
+            const auto key = mergeKey(operation.table, operation.keyColumn, operation.key);
+            const auto it = m_mergeIndices.constFind(key);
+            if (operation.type == OperationType::Update && it != m_mergeIndices.constEnd()) {
+                auto &pending = m_operations[it.value()];
+                for (auto valueIt = operation.values.cbegin(); valueIt != operation.values.cend(); ++valueIt) {
+                    pending.values.insert(valueIt.key(), valueIt.value());
+                }
+            }
+            else {
+                m_operations.push_back(operation);
+                m_mergeIndices.insert(key, m_operations.size() - 1);
+            }
+        }
+        pendingCount = m_operations.size();
+    }
+    scheduleFlush(pendingCount);
+}
+
+void VSQSqlWriteQueue::scheduleFlush(int pendingCount)
+{
+    if (pendingCount >= kMaxBatchSize) {
+        QMetaObject::invokeMethod(this, [this]() { writePending(); }, Qt::QueuedConnection);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (m_flushScheduled) {
+        return;
+    }
+    m_flushScheduled = true;
+    QMetaObject::invokeMethod(&m_timer, "start", Qt::QueuedConnection);
+}
+
+bool VSQSqlWriteQueue::writePending()
+{
+    Operations operations;
+    quint64 sequence = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        operations.swap(m_operations);
+        sequence = m_lastSequence;
+        m_mergeIndices.clear();
+        m_flushScheduled = false;
+    }
+    m_timer.stop();
+    if (operations.isEmpty()) {
+        return true;
+    }
+
+    auto database = QSqlDatabase::database(m_connectionName);
+    const bool inTransaction = database.transaction();
+    if (!inTransaction) {
+        qCWarning(lcSqlWriteQueue) << "Unable to start transaction:" << database.lastError().text();
+    }
+
+    int failedCount = 0;
+    for (const auto &operation : operations) {
+        // Partially applied mutation isn't committed with the rest of the batch
+        const bool inSavepoint = inTransaction && execStatement(QLatin1String("SAVEPOINT mutation"));
+        if (writeOperation(operation)) {
+            if (inSavepoint) {
+                execStatement(QLatin1String("RELEASE mutation"));
+            }
+            continue;
+        }
+        ++failedCount;
+        if (inSavepoint) {
+            execStatement(QLatin1String("ROLLBACK TO mutation"));
+            execStatement(QLatin1String("RELEASE mutation"));
+        }
+        if (operation.type == OperationType::Insert) {
+            emit insertFailed(operation.table, operation.values);
+        }
+    }
+
+    bool committed = true;
+    if (inTransaction && !database.commit()) {
+        qCCritical(lcSqlWriteQueue) << "Unable to commit transaction:" << database.lastError().text();
+        database.rollback();
+        committed = false;
+    }
+    if (failedCount > 0) {
+        qCCritical(lcSqlWriteQueue) << "Rolled back mutations:" << failedCount << "of" << operations.size();
+    }
+    qCDebug(lcSqlWriteQueue) << "Written mutations:" << operations.size() << "failed:" << failedCount;
+    m_writtenSequence.storeRelease(sequence);
+    emit flushed();
+    return committed && failedCount == 0;
+}
+
+bool VSQSqlWriteQueue::writeOperation(const Operation &operation)
+{
+    QString statement;
+    QVariantList bindValues;
+    switch (operation.type) {
+    case OperationType::Insert: {
+        const QStringList columns = operation.values.keys();
+        QStringList placeholders;
+        for (int i = 0; i < columns.size(); ++i) {
+            placeholders << QLatin1String("?");
+        }
+        statement = QString("INSERT INTO %1 (%2) VALUES (%3)")
+                .arg(operation.table, columns.join(", "), placeholders.join(", "));
+        bindValues = operation.values.values();
+        break;
+    }
+    case OperationType::Update: {
+        QStringList assignments;
+        for (const auto &column : operation.values.keys()) {
+            assignments << column + QLatin1String(" = ?");
+        }
+        statement = QString("UPDATE %1 SET %2 WHERE %3 = ?")
+                .arg(operation.table, assignments.join(", "), operation.keyColumn);
+        bindValues = operation.values.values();
+        bindValues << operation.key;
+        break;
+    }
+    case OperationType::Statement:
+        statement = operation.statement;
+        bindValues = operation.bindValues;
+        break;
+    case OperationType::Function: {
+        auto database = QSqlDatabase::database(m_connectionName);
+        return operation.function(database);
+    }
+    }
+
+    auto query = m_statements.query(statement, bindValues);
+    if (!query.exec()) {
+        qCWarning(lcSqlWriteQueue) << "Failed to write mutation:" << statement << query.lastError().text();
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+bool VSQSqlWriteQueue::execStatement(const QString &statement)
+{
+    auto query = m_statements.query(statement);
+    if (!query.exec()) {
+        qCWarning(lcSqlWriteQueue) << "Failed to execute:" << statement << query.lastError().text();
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+QString VSQSqlWriteQueue::mergeKey(const QString &table, const QString &keyColumn, const QVariant &key)
+{
+    return table + QLatin1Char('/') + keyColumn + QLatin1Char('/') + key.toString();
+}
@@ -0,0 +1,248 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#include "VSQStorage.h"
+
+#include <QMutexLocker>
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include "VSQSqlStatementCache.h"
+#include "VSQSqlWriteQueue.h"
+
+Q_LOGGING_CATEGORY(lcStorage, "storage");
+
+static const QString kDriverName = QLatin1String("QSQLITE");
+static const QString kWriterConnection = QLatin1String("vsq_writer");
+// Reads are short, a few connections serve the GUI thread and workers
+static const int kMaxReadConnections = 4;
+
+VSQStorage::VSQStorage(QObject *parent)
+    : QObject(parent)
+{
+    m_writerThread.setObjectName("StorageWriter");
+}
+
+VSQStorage::~VSQStorage()
+{
+    close();
+    QMutexLocker locker(&m_readersMutex);
+    qDeleteAll(m_freeConnections);
+    m_freeConnections.clear();
+}
+
+bool VSQStorage::open(const QString &fileName)
+{
+    close();
+    {
+        QMutexLocker locker(&m_readersMutex);
+        m_fileName = fileName;
+    }
+    resetReaders();
+
+    m_writerThread.start();
+    m_writeQueue = new VSQSqlWriteQueue(kWriterConnection);
+    m_writeQueue->moveToThread(&m_writerThread);
+
+    bool opened = false;
+    QMetaObject::invokeMethod(m_writeQueue, [&]() { opened = openWriter(); }, Qt::BlockingQueuedConnection);
+    if (!opened) {
+        close();
+    }
+    return opened;
+}
+
+void VSQStorage::close()
+{
+    if (!m_writeQueue) {
+        return;
+    }
+
+    // Flush barrier: everything queued so far is committed before the writer is closed
+    m_writeQueue->flush();
+    auto closer = new QObject();
+    closer->moveToThread(&m_writerThread);
+    QMetaObject::invokeMethod(closer, [this]() { closeWriter(); }, Qt::BlockingQueuedConnection);
+    m_writerThread.quit();
+    m_writerThread.wait();
+    delete closer;
+    resetReaders();
+}
+
+VSQSqlWriteQueue *VSQStorage::writeQueue() const
+{
+    return m_writeQueue;
+}
+
+void VSQStorage::resetReaders()
+{
+    QMutexLocker locker(&m_readersMutex);
+    ++m_readersGeneration;
+}
+
+VSQStorage::Reader::Reader(VSQStorage *storage)
+    : m_storage(storage)
+    , m_connection(storage->acquireConnection())
+{}
+
+VSQStorage::Reader::~Reader()
+{
+    m_storage->releaseConnection(m_connection);
+}
+
+QSqlDatabase VSQStorage::Reader::database() const
+{
+    return m_connection->database;
+}
+
+VSQSqlStatementCache &VSQStorage::Reader::statements() const
+{
+    return *m_connection->statements;
+}
+
+VSQStorage::Connection::~Connection()
+{
+    delete statements;
+    database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(name);
+}
+
+VSQStorage::Connection *VSQStorage::acquireConnection()
+{
+    const auto threadId = QThread::currentThreadId();
+    Connection *connection = nullptr;
+    int generation = 0;
+    {
+        QMutexLocker locker(&m_readersMutex);
+        const auto leaseIt = m_leases.find(threadId);
+        if (leaseIt != m_leases.end()) {
+            ++leaseIt->depth;
+            return leaseIt->connection;
+        }
+        while (m_freeConnections.isEmpty() && m_connectionCount >= kMaxReadConnections) {
+            m_connectionReleased.wait(&m_readersMutex);
+        }
+        if (m_freeConnections.isEmpty()) {
+            connection = new Connection();
+            connection->name = QString("vsq_reader_%1").arg(m_connectionCount++);
+            connection->generation = -1;
+        }
+        else {
+            connection = m_freeConnections.takeLast();
+        }
+        m_leases.insert(threadId, { connection, 1 });
+        generation = m_readersGeneration;
+    }
+
+    if (connection->generation == generation) {
+        // Driver of a free connection has no thread, it's taken by this one
+        connection->database.driver()->moveToThread(QThread::currentThread());
+    }
+    else {
+        openConnection(connection, generation);
+    }
+    return connection;
+}
+
+void VSQStorage::releaseConnection(Connection *connection)
+{
+    QMutexLocker locker(&m_readersMutex);
+    const auto leaseIt = m_leases.find(QThread::currentThreadId());
+    if (--leaseIt->depth > 0) {
+        return;
+    }
+    m_leases.erase(leaseIt);
+    // Results are released and the driver is detached, so another thread can take the connection
+    connection->statements->finishAll();
+    connection->database.driver()->moveToThread(nullptr);
+    m_freeConnections.push_back(connection);
+    m_connectionReleased.wakeOne();
+}
+
+void VSQStorage::openConnection(Connection *connection, int generation)
+{
+    // Connection of another database file or user is replaced
+    if (connection->statements) {
+        delete connection->statements;
+        connection->statements = nullptr;
+        connection->database = QSqlDatabase();
+        QSqlDatabase::removeDatabase(connection->name);
+    }
+
+    QString fileName;
+    {
+        QMutexLocker locker(&m_readersMutex);
+        fileName = m_fileName;
+    }
+    auto &database = connection->database;
+    database = QSqlDatabase::addDatabase(kDriverName, connection->name);
+    database.setDatabaseName(fileName);
+    database.setConnectOptions(QLatin1String("QSQLITE_OPEN_READONLY"));
+    if (!database.open()) {
+        qCCritical(lcStorage) << "Cannot open read connection:" << database.lastError().text();
+    }
+    connection->statements = new VSQSqlStatementCache(connection->name);
+    connection->generation = generation;
+    qCDebug(lcStorage) << "Read connection opened:" << connection->name;
+}
+
+bool VSQStorage::openWriter()
+{
+    auto database = QSqlDatabase::addDatabase(kDriverName, kWriterConnection);
+    database.setDatabaseName(m_fileName);
+    if (!database.open()) {
+        qCCritical(lcStorage) << "Cannot open database:" << database.lastError().text();
+        return false;
+    }
+
+    QSqlQuery query(database);
+    if (!query.exec(QLatin1String("PRAGMA journal_mode = WAL")) || !query.next()
+        || query.value(0).toString().compare(QLatin1String("wal"), Qt::CaseInsensitive) != 0) {
+        qCWarning(lcStorage) << "Unable to enable WAL mode:" << query.lastError().text();
+    }
+    // Durable in WAL mode, skips fsync on every commit
+    if (!query.exec(QLatin1String("PRAGMA synchronous = NORMAL"))) {
+        qCWarning(lcStorage) << "Unable to set synchronous mode:" << query.lastError().text();
+    }
+    qCDebug(lcStorage) << "Database opened:" << m_fileName;
+    return true;
+}
+
+void VSQStorage::closeWriter()
+{
+    delete m_writeQueue;
+    m_writeQueue = nullptr;
+    QSqlDatabase::removeDatabase(kWriterConnection);
+    qCDebug(lcStorage) << "Database closed:" << m_fileName;
+}
@@ -34,24 +34,16 @@
 
 #include "VSQTransfer.h"
 
+// Progress of a transfer is emitted about 30 times per second, not for every network chunk
+static const qint64 kProgressIntervalMs = 33;
+
 VSQTransfer::VSQTransfer(QNetworkAccessManager *networkAccessManager, const QString &id, QObject *parent)
     : QObject(parent)
     , m_networkAccessManager(networkAccessManager)
     , m_id(id)
+    , m_transferId(TransferId::parse(id))
     , m_status(Attachment::Status::Created)
 {
-    connect(this, &VSQTransfer::progressChanged, [&](const DataSize bytesReceived, const DataSize bytesTotal) {
-        if (bytesTotal == 0) {
-            return; // HACK(fpohtmeh): reply sends zeros finally, ignore it
-        }
-        m_bytesReceived = bytesReceived;
-        m_bytesTotal = bytesTotal;
-        if (m_bytesTotal > 0 && m_bytesReceived >= m_bytesTotal) {
-            qCDebug(lcTransferManager) << "All bytes were processed, mark transfer as completed";
-            closeFileHandle();
-            setStatus(Attachment::Status::Loaded);
-        }
-    });
     connect(this, &VSQTransfer::statusChanged, [=](const Enums::AttachmentStatus status){
         if (status == Attachment::Status::Loaded || status == Attachment::Status::Failed) {
             closeFileHandle();
@@ -73,6 +65,11 @@ QString VSQTransfer::id() const
     return m_id;
 }
 
+TransferId VSQTransfer::transferId() const
+{
+    return m_transferId;
+}
+
 bool VSQTransfer::isRunning() const
 {
     return m_status == Attachment::Status::Loading;
@@ -128,6 +125,25 @@ QList<QMetaObject::Connection> VSQTransfer::connectReply(QNetworkReply *reply, Q
     return res;
 }
 
+void VSQTransfer::updateProgress(const DataSize bytesReceived, const DataSize bytesTotal)
+{
+    if (bytesTotal == 0) {
+        return; // HACK(fpohtmeh): reply sends zeros finally, ignore it
+    }
+    m_bytesReceived = bytesReceived;
+    m_bytesTotal = bytesTotal;
+    const bool completed = m_bytesTotal > 0 && m_bytesReceived >= m_bytesTotal;
+    if (completed || !m_progressTimer.isValid() || m_progressTimer.elapsed() >= kProgressIntervalMs) {
+        m_progressTimer.start();
+        emit progressChanged(bytesReceived, bytesTotal);
+    }
+    if (completed) {
+        qCDebug(lcTransferManager) << "All bytes were processed, mark transfer as completed";
+        closeFileHandle();
+        setStatus(Attachment::Status::Loaded);
+    }
+}
+
 void VSQTransfer::setStatus(const Attachment::Status status)
 {
     if (status == m_status) {
@@ -55,6 +55,7 @@ VSQTransferManager::VSQTransferManager(QXmppClient *client, QNetworkAccessManage
 {
     qRegisterMetaType<QXmppHttpUploadSlotIq>();
     qRegisterMetaType<QXmppHttpUploadRequestIq>();
+    qRegisterMetaType<TransferId>();
 
     connect(this, &VSQTransferManager::startTransfer, this, &VSQTransferManager::onStartTransfer);
 
@@ -218,9 +219,9 @@ void VSQTransferManager::abortTransfer(VSQTransfer *transfer, bool lock)
 void VSQTransferManager::onStartTransfer(VSQTransfer *transfer)
 {
     connect(transfer, &VSQTransfer::progressChanged, this,
-            std::bind(&VSQTransferManager::progressChanged, this, transfer->id(), args::_1, args::_2));
+            std::bind(&VSQTransferManager::progressChanged, this, transfer->transferId(), args::_1, args::_2));
     connect(transfer, &VSQTransfer::statusChanged, this,
-            std::bind(&VSQTransferManager::statusChanged, this, transfer->id(), args::_1));
+            std::bind(&VSQTransferManager::statusChanged, this, transfer->transferId(), args::_1));
     connect(transfer, &VSQTransfer::ended, this,
             std::bind(&VSQTransferManager::removeTransfer, this, transfer, true));
     connect(this, &VSQTransferManager::connectionChanged, transfer, &VSQTransfer::connectionChanged);
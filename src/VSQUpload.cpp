@@ -88,7 +88,7 @@ void VSQUpload::start()
     m_connections = connectReply(reply, &m_guard);
     m_connections << connect(reply, &QNetworkReply::uploadProgress, [=](qint64 bytesSent, qint64 bytesTotal) {
         QMutexLocker locker(&m_guard);
-        emit progressChanged(bytesSent, bytesTotal);
+        updateProgress(bytesSent, bytesTotal);
     });
 }
 
@@ -127,3 +127,9 @@ QUrl VSQUtils::localFileToUrl(const QString &filePath)
     return QUrl::fromLocalFile(filePath);
 #endif
 }
+
+QMutex &VSQUtils::virgilCryptoMutex()
+{
+    static QMutex mutex;
+    return mutex;
+}
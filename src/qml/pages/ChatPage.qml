@@ -115,8 +115,35 @@ Page {
             }
         }
 
-        onCountChanged: {
-            positionViewAtEnd()
+        // Older history is loaded page by page when the top is reached
+        onAtYBeginningChanged: {
+            if (atYBeginning && ConversationsModel.hasOlderRows()) {
+                ConversationsModel.fetchOlderRows()
+            }
+        }
+
+        onAtYEndChanged: {
+            if (atYEnd) {
+                ConversationsModel.releaseOlderRows()
+            }
+        }
+
+        // New messages are followed only if the view was showing the end
+        property bool followEnd: true
+
+        Connections {
+            target: ConversationsModel
+            onModelReset: listView.positionViewAtEnd()
+            onRowsAboutToBeInserted: listView.followEnd = listView.atYEnd
+            onRowsInserted: {
+                if (first === 0 && listView.count > last + 1) {
+                    // Older page is prepended, the formerly first row stays in place
+                    listView.positionViewAtIndex(last + 1, ListView.Beginning)
+                }
+                else if (listView.followEnd) {
+                    listView.positionViewAtEnd()
+                }
+            }
         }
 
         ScrollBar.vertical: ScrollBar { }
@@ -158,7 +185,7 @@ Page {
         ConversationsModel.recipient = recipient
         listView.model = ConversationsModel
         ConversationsModel.setAsRead(recipient)
-        ChatModel.updateUnreadMessageCount(recipient)
+        ChatModel.resetUnreadMessageCount(recipient)
 
         Messenger.openPreviewRequested.connect(openPreview)
     }
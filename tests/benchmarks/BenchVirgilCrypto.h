@@ -0,0 +1,89 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+#ifndef BENCH_VIRGIL_CRYPTO_H
+#define BENCH_VIRGIL_CRYPTO_H
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+
+#include "VSQUtils.h"
+
+// Stand-in of the Virgil messenger library for benchmarks that don't have keys.
+// Calls take the same process-wide lock as the library calls of the messenger, so benchmarks
+// see how encryption and decryption are serialized. Work of a call is simulated by hashing
+namespace BenchVirgilCrypto
+{
+    static const int kHashRounds = 200;
+    // Ciphertext is longer than plaintext by the header with key info of the recipient, nonce and tag
+    static const int kCiphertextOverhead = 300;
+    static const char kKeyByte = 0x5a;
+
+    inline void work(const QByteArray &bytes)
+    {
+        QByteArray digest = bytes;
+        for (int i = 0; i < kHashRounds; ++i) {
+            digest = QCryptographicHash::hash(digest, QCryptographicHash::Sha256);
+        }
+    }
+
+    // Returns base64 text, as the library does
+    inline QByteArray encrypt(const QByteArray &plaintext)
+    {
+        QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
+        work(plaintext);
+        QByteArray ciphertext(kCiphertextOverhead, '\0');
+        ciphertext.reserve(kCiphertextOverhead + plaintext.size());
+        for (const char byte : plaintext) {
+            ciphertext.append(byte ^ kKeyByte);
+        }
+        return ciphertext.toBase64();
+    }
+
+    inline QByteArray decrypt(const QByteArray &encrypted)
+    {
+        QMutexLocker locker(&VSQUtils::virgilCryptoMutex());
+        const auto ciphertext = QByteArray::fromBase64(encrypted);
+        work(ciphertext);
+        QByteArray plaintext;
+        plaintext.reserve(ciphertext.size() - kCiphertextOverhead);
+        for (int i = kCiphertextOverhead; i < ciphertext.size(); ++i) {
+            plaintext.append(ciphertext.at(i) ^ kKeyByte);
+        }
+        return plaintext;
+    }
+}
+
+#endif // BENCH_VIRGIL_CRYPTO_H
@@ -0,0 +1,195 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Grouping and day roles of a loaded conversation: roles precomputed when rows are loaded
+// against the baseline, that compared records of neighbour rows on every data() call and
+// parsed their ISO timestamps. Scrolling of these roles in a ListView is in bench_conversation_scroll.
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QSqlTableModel>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "VSQSettings.h"
+#include "VSQSqlConversationModel.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+
+static const int kMessageCount = 5000;
+static const int kLoadedRowCount = 1000;
+// Authors change every few messages, days change every couple of hundred messages
+static const int kMessagesPerAuthor = 3;
+static const qint64 kMessageIntervalMs = 7 * 60 * 1000;
+static const QString kUser = QLatin1String("alice");
+static const QString kPeer = QLatin1String("bob");
+static const QString kBaselineConnection = QLatin1String("baseline");
+static const QString kBaselineTable = QLatin1String("BaselineMessages");
+
+class ConversationRolesBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void precomputedRoles();
+    void recordRoles();
+
+private:
+    QTemporaryDir m_dir;
+    VSQStorage *m_storage = nullptr;
+    VSQSqlConversationModel *m_model = nullptr;
+};
+
+void ConversationRolesBenchmark::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    registerCommonTypes();
+    QVERIFY(m_dir.isValid());
+
+    m_storage = new VSQStorage(this);
+    QVERIFY(m_storage->open(m_dir.filePath("bench.sqlite3")));
+    m_model = new VSQSqlConversationModel(m_storage, new VSQSettings(this), this);
+    m_model->setUser(kUser);
+
+    const qint64 firstTimestamp = QDateTime::currentMSecsSinceEpoch() - kMessageCount * kMessageIntervalMs;
+    const QString insertStatement =
+            QString("INSERT INTO %1 (author, recipient, timestamp, message, status, message_id) VALUES (?, ?, ?, ?, ?, ?)")
+            .arg(m_model->tableName());
+    for (int i = 0; i < kMessageCount; ++i) {
+        const bool own = (i / kMessagesPerAuthor) % 2;
+        m_storage->writeQueue()->exec(insertStatement, {
+            own ? kUser : kPeer, own ? kPeer : kUser, firstTimestamp + i * kMessageIntervalMs,
+            QString("Message text number %1").arg(i), static_cast<int>(StMessage::Status::MST_READ),
+            QString("message-%1").arg(i)
+        });
+    }
+    QVERIFY(m_storage->writeQueue()->flush());
+
+    m_model->setRecipient(kPeer);
+    while (m_model->rowCount() < kLoadedRowCount && m_model->hasOlderRows()) {
+        m_model->fetchOlderRows();
+    }
+    QVERIFY(m_model->rowCount() >= kLoadedRowCount);
+}
+
+void ConversationRolesBenchmark::cleanupTestCase()
+{
+    QSqlDatabase::removeDatabase(kBaselineConnection);
+}
+
+void ConversationRolesBenchmark::precomputedRoles()
+{
+    const auto roleNames = m_model->roleNames();
+    const int firstInRowRole = roleNames.key("firstMessageInARow");
+    const int inRowRole = roleNames.key("messageInARow");
+    const int dayRole = roleNames.key("day");
+    const int rowCount = m_model->rowCount();
+    int firstInRowCount = 0;
+    QBENCHMARK {
+        firstInRowCount = 0;
+        for (int row = 0; row < rowCount; ++row) {
+            const auto index = m_model->index(row);
+            firstInRowCount += m_model->data(index, firstInRowRole).toBool();
+            m_model->data(index, inRowRole);
+            m_model->data(index, dayRole);
+        }
+    }
+    QVERIFY(firstInRowCount > 0);
+}
+
+void ConversationRolesBenchmark::recordRoles()
+{
+    auto database = QSqlDatabase::addDatabase("QSQLITE", kBaselineConnection);
+    database.setDatabaseName(m_dir.filePath("bench.sqlite3"));
+    QVERIFY(database.open());
+    // Baseline table kept timestamps as ISO text
+    QSqlQuery query(database);
+    QVERIFY(query.exec(QString("DROP TABLE IF EXISTS %1").arg(kBaselineTable)));
+    QVERIFY(query.exec(QString("CREATE TABLE %1 AS SELECT author, recipient, "
+                               "strftime('%Y-%m-%dT%H:%M:%S', timestamp / 1000, 'unixepoch') AS timestamp, "
+                               "message, status, message_id FROM %2").arg(kBaselineTable, m_model->tableName())));
+    query.finish();
+    QSqlTableModel table(nullptr, database);
+    table.setTable(kBaselineTable);
+    table.setSort(table.fieldIndex("timestamp"), Qt::AscendingOrder);
+    QVERIFY(table.select());
+    while (table.canFetchMore()) {
+        table.fetchMore();
+    }
+    const int authorColumn = table.fieldIndex("author");
+    const int timestampColumn = table.fieldIndex("timestamp");
+    const int rowCount = m_model->rowCount();
+    const int firstRow = table.rowCount() - rowCount;
+    const auto dateTime = [&](const QSqlRecord &record) {
+        return record.value(timestampColumn).toDateTime();
+    };
+
+    int firstInRowCount = 0;
+    int inRowCount = 0;
+    int dayCount = 0;
+    QBENCHMARK {
+        firstInRowCount = 0;
+        inRowCount = 0;
+        dayCount = 0;
+        for (int row = firstRow; row < firstRow + rowCount; ++row) {
+            // Same lookups as the baseline data(): a record per role and its neighbours
+            const QSqlRecord record = table.record(row);
+            const QSqlRecord prevRecord = table.record(row - 1);
+            const bool isAuthor = record.value(authorColumn).toString() != prevRecord.value(authorColumn).toString();
+            const bool isInFiveMinRange = dateTime(prevRecord).addSecs(5 * 60) > dateTime(record);
+            firstInRowCount += (isAuthor || !isInFiveMinRange);
+
+            const QSqlRecord inRowRecord = table.record(row);
+            const QSqlRecord nextRecord = table.record(row + 1);
+            inRowCount += (inRowRecord.value(authorColumn).toString() == nextRecord.value(authorColumn).toString());
+
+            const QSqlRecord dayRecord = table.record(row);
+            dayCount += dateTime(dayRecord).date().isValid();
+        }
+    }
+    QVERIFY(firstInRowCount > 0);
+    QVERIFY(inRowCount > 0);
+    QCOMPARE(dayCount, rowCount);
+    table.clear();
+    database.close();
+}
+
+QTEST_GUILESS_MAIN(ConversationRolesBenchmark)
+
+#include "bench_conversation_roles.moc"
@@ -0,0 +1,291 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Scrolling a loaded conversation in a ListView whose delegates bind grouping and day roles, as the
+// chat page does. Precomputed roles of the conversation model against a model with data() of the
+// baseline, that read records of neighbour rows and parsed their ISO timestamps on every call.
+// The view is rendered offscreen by the software scene graph, so no display is needed.
+
+#include <QGuiApplication>
+#include <QQmlComponent>
+#include <QQmlEngine>
+#include <QQuickItem>
+#include <QQuickWindow>
+#include <QSGRendererInterface>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QSqlTableModel>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "VSQSettings.h"
+#include "VSQSqlConversationModel.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+
+static const int kMessageCount = 5000;
+static const int kLoadedRowCount = 1000;
+// Authors change every few messages, days change every couple of hundred messages
+static const int kMessagesPerAuthor = 3;
+static const qint64 kMessageIntervalMs = 7 * 60 * 1000;
+static const QString kUser = QLatin1String("alice");
+static const QString kPeer = QLatin1String("bob");
+static const QString kBaselineConnection = QLatin1String("baseline");
+static const QString kBaselineTable = QLatin1String("BaselineMessages");
+
+// Reduced delegate of the chat page, it binds the same roles
+static const char *kViewQml = R"(
+import QtQuick 2.12
+
+ListView {
+    width: 400
+    height: 600
+    spacing: 5
+    section.property: "day"
+    section.delegate: Text { text: section }
+    delegate: Column {
+        width: ListView.view.width
+        Text {
+            visible: model.firstMessageInARow
+            text: model.author + " " + Qt.formatDateTime(model.timestamp, "hh:mm")
+        }
+        Rectangle {
+            width: parent.width
+            height: body.height + 10
+            radius: model.messageInARow ? 2 : 10
+            Text {
+                id: body
+                text: model.message
+            }
+        }
+    }
+}
+)";
+
+// Conversation model of the baseline, roles are computed from records on every call
+class BaselineConversationModel : public QSqlTableModel
+{
+public:
+    enum Role
+    {
+        AuthorRole = Qt::UserRole,
+        TimestampRole,
+        MessageRole,
+        FirstInRowRole,
+        InRowRole,
+        DayRole
+    };
+
+    using QSqlTableModel::QSqlTableModel;
+
+    QVariant data(const QModelIndex &index, int role) const override
+    {
+        if (role < Qt::UserRole) {
+            return QSqlTableModel::data(index, role);
+        }
+        const QSqlRecord currRecord = record(index.row());
+        switch (role) {
+        case FirstInRowRole: {
+            if (index.row() == 0) {
+                return true;
+            }
+            const QSqlRecord prevRecord = record(index.row() - 1);
+            const bool isAuthor = prevRecord.value("author").toString() != currRecord.value("author").toString();
+            const bool isInFiveMinRange =
+                    prevRecord.value("timestamp").toDateTime().addSecs(5 * 60) > currRecord.value("timestamp").toDateTime();
+            return isAuthor || !isInFiveMinRange;
+        }
+        case InRowRole: {
+            const QSqlRecord nextRecord = record(index.row() + 1);
+            return nextRecord.value("author").toString() == currRecord.value("author").toString();
+        }
+        case DayRole:
+            return currRecord.value("timestamp").toDate();
+        case AuthorRole:
+            return currRecord.value("author");
+        case TimestampRole:
+            return currRecord.value("timestamp");
+        case MessageRole:
+            return currRecord.value("message");
+        default:
+            return QVariant();
+        }
+    }
+
+    QHash<int, QByteArray> roleNames() const override
+    {
+        QHash<int, QByteArray> names;
+        names[AuthorRole] = "author";
+        names[TimestampRole] = "timestamp";
+        names[MessageRole] = "message";
+        names[FirstInRowRole] = "firstMessageInARow";
+        names[InRowRole] = "messageInARow";
+        names[DayRole] = "day";
+        return names;
+    }
+};
+
+class ConversationScrollBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void precomputedRoles();
+    void baselineRoles();
+
+private:
+    static void scroll(QAbstractItemModel *model);
+
+    QTemporaryDir m_dir;
+    VSQStorage *m_storage = nullptr;
+    VSQSqlConversationModel *m_model = nullptr;
+};
+
+void ConversationScrollBenchmark::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    registerCommonTypes();
+    QVERIFY(m_dir.isValid());
+
+    m_storage = new VSQStorage(this);
+    QVERIFY(m_storage->open(m_dir.filePath("bench.sqlite3")));
+    m_model = new VSQSqlConversationModel(m_storage, new VSQSettings(this), this);
+    m_model->setUser(kUser);
+
+    const qint64 firstTimestamp = QDateTime::currentMSecsSinceEpoch() - kMessageCount * kMessageIntervalMs;
+    const QString insertStatement =
+            QString("INSERT INTO %1 (author, recipient, timestamp, message, status, message_id) VALUES (?, ?, ?, ?, ?, ?)")
+            .arg(m_model->tableName());
+    for (int i = 0; i < kMessageCount; ++i) {
+        const bool own = (i / kMessagesPerAuthor) % 2;
+        m_storage->writeQueue()->exec(insertStatement, {
+            own ? kUser : kPeer, own ? kPeer : kUser, firstTimestamp + i * kMessageIntervalMs,
+            QString("Message text number %1").arg(i), static_cast<int>(StMessage::Status::MST_READ),
+            QString("message-%1").arg(i)
+        });
+    }
+    QVERIFY(m_storage->writeQueue()->flush());
+
+    m_model->setRecipient(kPeer);
+    while (m_model->rowCount() < kLoadedRowCount && m_model->hasOlderRows()) {
+        m_model->fetchOlderRows();
+    }
+    QVERIFY(m_model->rowCount() >= kLoadedRowCount);
+}
+
+void ConversationScrollBenchmark::cleanupTestCase()
+{
+    QSqlDatabase::removeDatabase(kBaselineConnection);
+}
+
+void ConversationScrollBenchmark::scroll(QAbstractItemModel *model)
+{
+    // View is destroyed before the window it is shown in
+    QQuickWindow window;
+    QQmlEngine engine;
+    QQmlComponent component(&engine);
+    component.setData(kViewQml, QUrl());
+    QScopedPointer<QQuickItem> listView(qobject_cast<QQuickItem *>(component.create()));
+    QVERIFY2(!listView.isNull(), qPrintable(component.errorString()));
+    listView->setProperty("model", QVariant::fromValue(model));
+
+    window.resize(static_cast<int>(listView->width()), static_cast<int>(listView->height()));
+    listView->setParentItem(window.contentItem());
+    window.show();
+    QVERIFY(QTest::qWaitForWindowExposed(&window));
+
+    int pageCount = 0;
+    QBENCHMARK {
+        QMetaObject::invokeMethod(listView.data(), "positionViewAtBeginning");
+        pageCount = 0;
+        // A page per step, every step creates delegates of the new rows and renders a frame
+        while (!listView->property("atYEnd").toBool() && pageCount < kLoadedRowCount) {
+            listView->setProperty("contentY", listView->property("contentY").toReal() + listView->height());
+            QCoreApplication::processEvents();
+            ++pageCount;
+        }
+    }
+    QVERIFY(pageCount > 1);
+}
+
+void ConversationScrollBenchmark::precomputedRoles()
+{
+    scroll(m_model);
+}
+
+void ConversationScrollBenchmark::baselineRoles()
+{
+    {
+        auto database = QSqlDatabase::addDatabase("QSQLITE", kBaselineConnection);
+        database.setDatabaseName(m_dir.filePath("bench.sqlite3"));
+        QVERIFY(database.open());
+        // Baseline table kept timestamps as ISO text, the same rows as the loaded conversation are shown
+        QSqlQuery query(database);
+        QVERIFY(query.exec(QString("DROP TABLE IF EXISTS %1").arg(kBaselineTable)));
+        QVERIFY(query.exec(QString("CREATE TABLE %1 AS SELECT author, recipient, "
+                                   "strftime('%Y-%m-%dT%H:%M:%S', timestamp / 1000, 'unixepoch') AS timestamp, "
+                                   "message, status, message_id FROM "
+                                   "(SELECT * FROM %2 ORDER BY timestamp DESC LIMIT %3) ORDER BY timestamp")
+                           .arg(kBaselineTable, m_model->tableName()).arg(m_model->rowCount())));
+        query.finish();
+
+        BaselineConversationModel model(nullptr, database);
+        model.setTable(kBaselineTable);
+        QVERIFY(model.select());
+        while (model.canFetchMore()) {
+            model.fetchMore();
+        }
+        QCOMPARE(model.rowCount(), m_model->rowCount());
+        scroll(&model);
+    }
+    QSqlDatabase::database(kBaselineConnection, false).close();
+}
+
+int main(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QQuickWindow::setSceneGraphBackend(QSGRendererInterface::Software);
+    QGuiApplication app(argc, argv);
+    ConversationScrollBenchmark benchmark;
+    return QTest::qExec(&benchmark, argc, argv);
+}
+
+#include "bench_conversation_scroll.moc"
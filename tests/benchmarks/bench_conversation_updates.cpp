@@ -0,0 +1,186 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Status update of a loaded conversation: row-precise update of the model against
+// the former QSqlTableModel path, which ran an UPDATE and select() of the conversation.
+// Conversations of different sizes show that the row-precise update doesn't grow with the conversation.
+
+#include <QSignalSpy>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlTableModel>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "VSQSettings.h"
+#include "VSQSqlConversationModel.h"
+#include "VSQSqlWriteQueue.h"
+#include "VSQStorage.h"
+
+static const int kMessageCounts[] = { 1000, 10000, 100000 };
+static const int kInsertChunkSize = 1000;
+static const QString kUser = QLatin1String("alice");
+static const QString kBaselineConnection = QLatin1String("baseline");
+
+class ConversationUpdatesBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void rowPreciseStatusUpdate_data();
+    void rowPreciseStatusUpdate();
+    void selectStatusUpdate_data();
+    void selectStatusUpdate();
+
+private:
+    static void addRows();
+    // Every conversation size has a peer of its own
+    static QString peer(int messageCount) { return QString("peer%1").arg(messageCount); }
+    static QString messageId(int messageCount, int i) { return QString("%1-message-%2").arg(peer(messageCount)).arg(i); }
+
+    QTemporaryDir m_dir;
+    VSQStorage *m_storage = nullptr;
+    VSQSqlConversationModel *m_model = nullptr;
+};
+
+void ConversationUpdatesBenchmark::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    registerCommonTypes();
+    QVERIFY(m_dir.isValid());
+
+    m_storage = new VSQStorage(this);
+    QVERIFY(m_storage->open(m_dir.filePath("bench.sqlite3")));
+    m_model = new VSQSqlConversationModel(m_storage, new VSQSettings(this), this);
+    m_model->setUser(kUser);
+
+    for (const int messageCount : kMessageCounts) {
+        for (int first = 0; first < messageCount; first += kInsertChunkSize) {
+            QList<StMessage> messages;
+            for (int i = first; i < qMin(first + kInsertChunkSize, messageCount); ++i) {
+                StMessage message;
+                message.messageId = messageId(messageCount, i);
+                message.sender = peer(messageCount);
+                message.recipient = kUser;
+                message.message = QString("Message text number %1").arg(i);
+                messages.push_back(message);
+            }
+            emit m_model->receiveMessages(messages);
+            QVERIFY(m_storage->writeQueue()->flush());
+        }
+    }
+}
+
+void ConversationUpdatesBenchmark::cleanupTestCase()
+{
+    QSqlDatabase::removeDatabase(kBaselineConnection);
+}
+
+void ConversationUpdatesBenchmark::addRows()
+{
+    QTest::addColumn<int>("messageCount");
+    for (const int messageCount : kMessageCounts) {
+        QTest::newRow(qPrintable(QString("%1 messages").arg(messageCount))) << messageCount;
+    }
+}
+
+void ConversationUpdatesBenchmark::rowPreciseStatusUpdate_data()
+{
+    addRows();
+}
+
+void ConversationUpdatesBenchmark::rowPreciseStatusUpdate()
+{
+    QFETCH(int, messageCount);
+    m_model->setRecipient(peer(messageCount));
+    QVERIFY(m_model->rowCount() > 0);
+
+    QSignalSpy resets(m_model, &QAbstractItemModel::modelReset);
+    QSignalSpy changes(m_model, &QAbstractItemModel::dataChanged);
+    const int rowCount = m_model->rowCount();
+    int i = 0;
+    QBENCHMARK {
+        const auto status = (i % 2) ? StMessage::Status::MST_READ : StMessage::Status::MST_RECEIVED;
+        emit m_model->setMessageStatus(messageId(messageCount, messageCount - 1 - i % rowCount), status);
+        m_storage->writeQueue()->flush();
+        ++i;
+    }
+    QCOMPARE(resets.count(), 0);
+    for (const auto &change : changes) {
+        QCOMPARE(change.at(0).toModelIndex().row(), change.at(1).toModelIndex().row());
+    }
+}
+
+void ConversationUpdatesBenchmark::selectStatusUpdate_data()
+{
+    addRows();
+}
+
+void ConversationUpdatesBenchmark::selectStatusUpdate()
+{
+    QFETCH(int, messageCount);
+    auto database = QSqlDatabase::contains(kBaselineConnection) ? QSqlDatabase::database(kBaselineConnection)
+                                                                 : QSqlDatabase::addDatabase("QSQLITE", kBaselineConnection);
+    database.setDatabaseName(m_dir.filePath("bench.sqlite3"));
+    QVERIFY(database.isOpen() || database.open());
+    QSqlTableModel table(nullptr, database);
+    table.setTable(m_model->tableName());
+    table.setFilter(QString("(recipient = '%1' AND author = '%2') OR (recipient = '%2' AND author = '%1')")
+                    .arg(kUser, peer(messageCount)));
+    table.setSort(table.fieldIndex("timestamp"), Qt::AscendingOrder);
+    QVERIFY(table.select());
+
+    int i = 0;
+    QBENCHMARK {
+        const auto status = (i % 2) ? StMessage::Status::MST_READ : StMessage::Status::MST_RECEIVED;
+        QSqlQuery(database).exec(QString("UPDATE %1 SET status = %2 WHERE message_id = '%3'")
+                                 .arg(m_model->tableName()).arg(static_cast<int>(status))
+                                 .arg(messageId(messageCount, i % messageCount)));
+        table.select();
+        // View positioned at the end fetches the whole conversation
+        while (table.canFetchMore()) {
+            table.fetchMore();
+        }
+        ++i;
+    }
+    QCOMPARE(table.rowCount(), messageCount);
+}
+
+QTEST_GUILESS_MAIN(ConversationUpdatesBenchmark)
+
+#include "bench_conversation_updates.moc"
@@ -0,0 +1,159 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Size of messages on the wire: JSON envelope of the baseline against CBOR envelope, which is compressed
+// when it's big. Texts are cut from the project README into chunks of every size. Every envelope is made
+// by VSQMessageEnvelope::encode, encrypted by the crypto stand-in and encoded to base64 as the message
+// body, so the report includes ciphertext and base64 overhead. Ciphertext overhead of the stand-in is
+// an estimate of the recipient key info, nonce and tag of the library.
+
+#include <QFile>
+#include <QtTest>
+
+#include "BenchVirgilCrypto.h"
+#include "VSQMessageEnvelope.h"
+
+class EnvelopeSizesBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void report_data();
+    void report();
+
+private:
+    struct Sizes
+    {
+        qint64 envelope = 0;
+        qint64 ciphertext = 0;
+        qint64 wire = 0;
+    };
+
+    static Sizes sizes(const QVector<StMessage> &messages, VSQMessageEnvelope::Format format);
+    static StMessage attachmentMessage(Attachment::Type type, const QString &displayName);
+
+    QString m_corpus;
+};
+
+void EnvelopeSizesBenchmark::initTestCase()
+{
+    QFile file(QLatin1String(BENCH_CORPUS_FILE));
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    m_corpus = QString::fromUtf8(file.readAll());
+    QVERIFY(!m_corpus.isEmpty());
+}
+
+void EnvelopeSizesBenchmark::report_data()
+{
+    QTest::addColumn<int>("chunkSize");
+    QTest::addColumn<int>("attachmentType");
+    for (const int chunkSize : { 32, 128, 512, 1024, 4096 }) {
+        QTest::newRow(qPrintable(QString("text %1").arg(chunkSize))) << chunkSize << -1;
+    }
+    QTest::newRow("picture") << 0 << static_cast<int>(Attachment::Type::Picture);
+    QTest::newRow("file") << 0 << static_cast<int>(Attachment::Type::File);
+}
+
+void EnvelopeSizesBenchmark::report()
+{
+    QFETCH(int, chunkSize);
+    QFETCH(int, attachmentType);
+    QVector<StMessage> messages;
+    if (attachmentType < 0) {
+        for (int position = 0; position + chunkSize <= m_corpus.size(); position += chunkSize) {
+            StMessage message;
+            message.message = m_corpus.mid(position, chunkSize);
+            messages.push_back(message);
+        }
+    }
+    else if (static_cast<Attachment::Type>(attachmentType) == Attachment::Type::Picture) {
+        messages.push_back(attachmentMessage(Attachment::Type::Picture, QLatin1String("IMG_20200814_153012.jpg")));
+    }
+    else {
+        messages.push_back(attachmentMessage(Attachment::Type::File, QLatin1String("Quarterly report 2020.pdf")));
+    }
+    QVERIFY(!messages.isEmpty());
+
+    const auto json = sizes(messages, VSQMessageEnvelope::Format::Json);
+    const auto cbor = sizes(messages, VSQMessageEnvelope::Format::Cbor);
+    const int count = messages.size();
+    qInfo().noquote() << QString("%1 messages, average bytes per message").arg(count);
+    qInfo().noquote() << QString("  json: envelope %1, ciphertext %2, wire %3")
+                         .arg(json.envelope / count).arg(json.ciphertext / count).arg(json.wire / count);
+    qInfo().noquote() << QString("  cbor: envelope %1, ciphertext %2, wire %3")
+                         .arg(cbor.envelope / count).arg(cbor.ciphertext / count).arg(cbor.wire / count);
+    qInfo().noquote() << QString("  wire size of cbor: %1% of json")
+                         .arg(100.0 * cbor.wire / json.wire, 0, 'f', 1);
+}
+
+EnvelopeSizesBenchmark::Sizes EnvelopeSizesBenchmark::sizes(const QVector<StMessage> &messages,
+                                                            VSQMessageEnvelope::Format format)
+{
+    Sizes sizes;
+    for (const auto &message : messages) {
+        const auto envelope = VSQMessageEnvelope::encode(message, format);
+        const auto wire = BenchVirgilCrypto::encrypt(envelope);
+        // Message must survive the way back
+        const auto decoded = VSQMessageEnvelope::decode(BenchVirgilCrypto::decrypt(wire));
+        if (!decoded || decoded->message != message.message) {
+            qFatal("Envelope isn't decoded back");
+        }
+        sizes.envelope += envelope.size();
+        sizes.ciphertext += envelope.size() + BenchVirgilCrypto::kCiphertextOverhead;
+        sizes.wire += wire.size();
+    }
+    return sizes;
+}
+
+StMessage EnvelopeSizesBenchmark::attachmentMessage(Attachment::Type type, const QString &displayName)
+{
+    Attachment attachment;
+    attachment.type = type;
+    attachment.displayName = displayName;
+    attachment.remoteUrl = QUrl("https://upload.example.com/files/8f1c2e/" + displayName + ".enc");
+    if (type == Attachment::Type::Picture) {
+        attachment.remoteThumbnailUrl = QUrl("https://upload.example.com/files/8f1c2e/thumbnail.png.enc");
+        attachment.thumbnailSize = QSize(240, 180);
+    }
+    attachment.bytesTotal = 2 * 1024 * 1024;
+    StMessage message;
+    message.message = displayName;
+    message.attachment = attachment;
+    return message;
+}
+
+QTEST_GUILESS_MAIN(EnvelopeSizesBenchmark)
+
+#include "bench_envelope_sizes.moc"
@@ -0,0 +1,175 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Message envelopes: CBOR against JSON of the baseline, encoding and decoding of a short text,
+// a picture attachment and a long text that is compressed. Sizes of envelopes are printed.
+// Send and receive cases add encryption by the crypto stand-in, so the share of the envelope in
+// CPU time of a message is seen.
+
+#include <QtTest>
+
+#include "BenchVirgilCrypto.h"
+#include "VSQMessageEnvelope.h"
+
+Q_DECLARE_METATYPE(VSQMessageEnvelope::Format)
+
+class MessageEnvelopeBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void encode_data();
+    void encode();
+    void decode_data();
+    void decode();
+    void send_data();
+    void send();
+    void receive_data();
+    void receive();
+
+private:
+    static void addRows();
+    static StMessage message(const QString &kind);
+};
+
+void MessageEnvelopeBenchmark::addRows()
+{
+    QTest::addColumn<QString>("kind");
+    QTest::addColumn<VSQMessageEnvelope::Format>("format");
+    for (const auto &kind : { QString("text"), QString("picture"), QString("long text") }) {
+        QTest::newRow(qPrintable(kind + " json")) << kind << VSQMessageEnvelope::Format::Json;
+        QTest::newRow(qPrintable(kind + " cbor")) << kind << VSQMessageEnvelope::Format::Cbor;
+    }
+}
+
+StMessage MessageEnvelopeBenchmark::message(const QString &kind)
+{
+    StMessage message;
+    if (kind == QLatin1String("picture")) {
+        Attachment attachment;
+        attachment.type = Attachment::Type::Picture;
+        attachment.displayName = QLatin1String("IMG_20200814_153012.jpg");
+        attachment.remoteUrl = QUrl("https://upload.example.com/files/8f1c2e/IMG_20200814_153012.jpg.enc");
+        attachment.remoteThumbnailUrl = QUrl("https://upload.example.com/files/8f1c2e/thumbnail.png.enc");
+        attachment.thumbnailSize = QSize(240, 180);
+        attachment.bytesTotal = 2 * 1024 * 1024;
+        message.message = attachment.displayName;
+        message.attachment = attachment;
+    }
+    else if (kind == QLatin1String("long text")) {
+        message.message = QString("Some long message text that repeats. ").repeated(100);
+    }
+    else {
+        message.message = QLatin1String("See you tomorrow at 10");
+    }
+    return message;
+}
+
+void MessageEnvelopeBenchmark::encode_data()
+{
+    addRows();
+}
+
+void MessageEnvelopeBenchmark::encode()
+{
+    QFETCH(QString, kind);
+    QFETCH(VSQMessageEnvelope::Format, format);
+    const auto source = message(kind);
+    QByteArray envelope;
+    QBENCHMARK {
+        envelope = VSQMessageEnvelope::encode(source, format);
+    }
+    QVERIFY(!envelope.isEmpty());
+    qInfo() << "Envelope size:" << envelope.size() << "bytes";
+}
+
+void MessageEnvelopeBenchmark::decode_data()
+{
+    addRows();
+}
+
+void MessageEnvelopeBenchmark::decode()
+{
+    QFETCH(QString, kind);
+    QFETCH(VSQMessageEnvelope::Format, format);
+    const auto source = message(kind);
+    const auto envelope = VSQMessageEnvelope::encode(source, format);
+    Optional<StMessage> decoded;
+    QBENCHMARK {
+        decoded = VSQMessageEnvelope::decode(envelope);
+    }
+    QVERIFY(decoded);
+    QCOMPARE(decoded->message, source.message);
+    QCOMPARE(bool(decoded->attachment), bool(source.attachment));
+}
+
+void MessageEnvelopeBenchmark::send_data()
+{
+    addRows();
+}
+
+void MessageEnvelopeBenchmark::send()
+{
+    QFETCH(QString, kind);
+    QFETCH(VSQMessageEnvelope::Format, format);
+    const auto source = message(kind);
+    QByteArray encrypted;
+    QBENCHMARK {
+        encrypted = BenchVirgilCrypto::encrypt(VSQMessageEnvelope::encode(source, format));
+    }
+    QVERIFY(!encrypted.isEmpty());
+}
+
+void MessageEnvelopeBenchmark::receive_data()
+{
+    addRows();
+}
+
+void MessageEnvelopeBenchmark::receive()
+{
+    QFETCH(QString, kind);
+    QFETCH(VSQMessageEnvelope::Format, format);
+    const auto source = message(kind);
+    const auto encrypted = BenchVirgilCrypto::encrypt(VSQMessageEnvelope::encode(source, format));
+    Optional<StMessage> decoded;
+    QBENCHMARK {
+        decoded = VSQMessageEnvelope::decode(BenchVirgilCrypto::decrypt(encrypted));
+    }
+    QVERIFY(decoded);
+    QCOMPARE(decoded->message, source.message);
+}
+
+QTEST_GUILESS_MAIN(MessageEnvelopeBenchmark)
+
+#include "bench_message_envelope.moc"
@@ -0,0 +1,104 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Outgoing messages per second by number of outbox workers. Every message is encoded into an envelope
+// in parallel and encrypted under the lock of the Virgil library, as the outbox does, so the benchmark
+// shows how far sending scales with cores while the library calls are serialized.
+
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <QtTest>
+
+#include "BenchVirgilCrypto.h"
+#include "VSQMessageEnvelope.h"
+
+static const int kMessageCount = 2000;
+
+class OutboxScalingBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void send_data();
+    void send();
+};
+
+void OutboxScalingBenchmark::send_data()
+{
+    QTest::addColumn<int>("threadCount");
+    for (const int threadCount : { 1, 2, 4, 8 }) {
+        QTest::newRow(qPrintable(QString("%1 threads").arg(threadCount))) << threadCount;
+    }
+}
+
+void OutboxScalingBenchmark::send()
+{
+    QFETCH(int, threadCount);
+    QVector<StMessage> messages(kMessageCount);
+    for (int i = 0; i < kMessageCount; ++i) {
+        messages[i].message = QString("Message text number %1").arg(i);
+    }
+    QThreadPool pool;
+    pool.setMaxThreadCount(threadCount);
+
+    QElapsedTimer timer;
+    int runCount = 0;
+    timer.start();
+    QBENCHMARK {
+        // Workers take the next message until all are sent
+        QAtomicInt nextIndex(0);
+        QVector<QFuture<void>> workers;
+        for (int i = 0; i < threadCount; ++i) {
+            workers.push_back(QtConcurrent::run(&pool, [&messages, &nextIndex]() {
+                for (int index = nextIndex.fetchAndAddRelaxed(1); index < kMessageCount;
+                     index = nextIndex.fetchAndAddRelaxed(1)) {
+                    const auto envelope = VSQMessageEnvelope::encode(messages[index], VSQMessageEnvelope::Format::Cbor);
+                    BenchVirgilCrypto::encrypt(envelope);
+                }
+            }));
+        }
+        for (auto &worker : workers) {
+            worker.waitForFinished();
+        }
+        ++runCount;
+    }
+    const qint64 elapsedMs = qMax<qint64>(1, timer.elapsed());
+    qInfo() << "Messages per second:" << (1000 * qint64(runCount) * kMessageCount / elapsedMs)
+            << "ideal thread count:" << QThread::idealThreadCount();
+}
+
+QTEST_GUILESS_MAIN(OutboxScalingBenchmark)
+
+#include "bench_outbox_scaling.moc"
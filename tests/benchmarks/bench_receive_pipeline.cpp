@@ -0,0 +1,128 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// A burst of incoming messages: receive pipeline that decrypts in worker threads and delivers
+// batches in order of arrival, against decryption of every message in the GUI thread, as the
+// baseline did. Decryption is made by the crypto stand-in, it takes the Virgil library lock as the
+// messenger does, so the workers take turns in the library call.
+
+#include <QEventLoop>
+#include <QtTest>
+
+#include "BenchVirgilCrypto.h"
+#include "VSQReceivePipeline.h"
+
+// Multiple of the pipeline batch size, so the last batch isn't held by the batch timer
+static const int kMessageCount = 1000;
+static const int kSenderCount = 10;
+
+static Optional<StMessage> decrypt(const QString &sender, const QString &device, const QString &body)
+{
+    Q_UNUSED(sender)
+    Q_UNUSED(device)
+    StMessage message;
+    message.message = QString::fromUtf8(BenchVirgilCrypto::decrypt(body.toLatin1()));
+    return message;
+}
+
+class ReceivePipelineBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void pipeline();
+    void guiThread();
+
+private:
+    static QString senderName(int i) { return QString("sender-%1").arg(i % kSenderCount); }
+    static QString text(int i) { return QString("Message text number %1").arg(i); }
+
+    // Encrypted once, so benchmarks measure decryption only
+    QStringList m_bodies;
+};
+
+void ReceivePipelineBenchmark::initTestCase()
+{
+    for (int i = 0; i < kMessageCount; ++i) {
+        m_bodies.push_back(QString::fromLatin1(BenchVirgilCrypto::encrypt(text(i).toUtf8())));
+    }
+}
+
+void ReceivePipelineBenchmark::pipeline()
+{
+    VSQReceivePipeline pipeline(decrypt, nullptr);
+    QBENCHMARK {
+        QHash<QString, int> lastIndexes;
+        bool ordered = true;
+        int receivedCount = 0;
+        QEventLoop loop;
+        const auto connection = connect(&pipeline, &VSQReceivePipeline::received, [&](const QList<StMessage> &messages) {
+            for (const auto &message : messages) {
+                const int index = message.messageId.toInt();
+                ordered = ordered && index > lastIndexes.value(message.sender, -1);
+                lastIndexes[message.sender] = index;
+            }
+            receivedCount += messages.size();
+            if (receivedCount == kMessageCount) {
+                loop.quit();
+            }
+        });
+        for (int i = 0; i < kMessageCount; ++i) {
+            pipeline.submit(QString::number(i), senderName(i), QLatin1String("desktop"), QLatin1String("recipient"),
+                                m_bodies.at(i));
+        }
+        loop.exec();
+        disconnect(connection);
+        QVERIFY(ordered);
+    }
+}
+
+void ReceivePipelineBenchmark::guiThread()
+{
+    QBENCHMARK {
+        QList<StMessage> messages;
+        for (int i = 0; i < kMessageCount; ++i) {
+            auto message = decrypt(senderName(i), QLatin1String("desktop"), m_bodies.at(i));
+            QVERIFY(message);
+            QCOMPARE(message->message, text(i));
+            messages.push_back(*message);
+        }
+        QCOMPARE(messages.size(), kMessageCount);
+    }
+}
+
+QTEST_GUILESS_MAIN(ReceivePipelineBenchmark)
+
+#include "bench_receive_pipeline.moc"
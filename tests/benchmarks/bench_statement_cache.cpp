@@ -0,0 +1,141 @@
+//  Copyright (C) 2015-2020 Virgil Security, Inc.
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      (1) Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//
+//      (2) Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//      (3) Neither the name of the copyright holder nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+//  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+//  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+//  Lead Maintainer: Virgil Security Inc. <support@virgilsecurity.com>
+
+// Lookups and updates by message id: cached prepared statements against statements
+// built from strings and parsed on every execution, as the baseline did.
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "VSQSqlStatementCache.h"
+
+static const int kRowCount = 10000;
+static const QString kConnection = QLatin1String("bench");
+
+class StatementCacheBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void cachedLookup();
+    void stringBuiltLookup();
+    void cachedUpdate();
+    void stringBuiltUpdate();
+
+private:
+    static QString messageId(int i) { return QString("message-%1").arg(i); }
+
+    QTemporaryDir m_dir;
+};
+
+void StatementCacheBenchmark::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    auto database = QSqlDatabase::addDatabase("QSQLITE", kConnection);
+    database.setDatabaseName(m_dir.filePath("bench.sqlite3"));
+    QVERIFY(database.open());
+
+    QSqlQuery query(database);
+    QVERIFY(query.exec("CREATE TABLE Messages (message_id TEXT NOT NULL PRIMARY KEY, status INTEGER, message TEXT)"));
+    QVERIFY(database.transaction());
+    QVERIFY(query.prepare("INSERT INTO Messages (message_id, status, message) VALUES (?, 0, ?)"));
+    for (int i = 0; i < kRowCount; ++i) {
+        query.addBindValue(messageId(i));
+        query.addBindValue(QString("Message text number %1").arg(i));
+        QVERIFY2(query.exec(), qPrintable(query.lastError().text()));
+    }
+    QVERIFY(database.commit());
+}
+
+void StatementCacheBenchmark::cleanupTestCase()
+{
+    QSqlDatabase::database(kConnection).close();
+    QSqlDatabase::removeDatabase(kConnection);
+}
+
+void StatementCacheBenchmark::cachedLookup()
+{
+    VSQSqlStatementCache statements(kConnection);
+    int i = 0;
+    QBENCHMARK {
+        auto query = statements.query("SELECT status FROM Messages WHERE message_id = ?", { messageId(i++ % kRowCount) });
+        QVERIFY(query.exec() && query.next());
+        query.finish();
+    }
+}
+
+void StatementCacheBenchmark::stringBuiltLookup()
+{
+    auto database = QSqlDatabase::database(kConnection);
+    int i = 0;
+    QBENCHMARK {
+        QSqlQuery query(database);
+        QVERIFY(query.exec(QString("SELECT status FROM Messages WHERE message_id = '%1'").arg(messageId(i++ % kRowCount))));
+        QVERIFY(query.next());
+    }
+}
+
+void StatementCacheBenchmark::cachedUpdate()
+{
+    VSQSqlStatementCache statements(kConnection);
+    int i = 0;
+    QBENCHMARK {
+        auto query = statements.query("UPDATE Messages SET status = ? WHERE message_id = ?", { i % 4, messageId(i % kRowCount) });
+        QVERIFY(query.exec());
+        query.finish();
+        ++i;
+    }
+}
+
+void StatementCacheBenchmark::stringBuiltUpdate()
+{
+    auto database = QSqlDatabase::database(kConnection);
+    int i = 0;
+    QBENCHMARK {
+        QSqlQuery query(database);
+        QVERIFY(query.exec(QString("UPDATE Messages SET status = %1 WHERE message_id = '%2'")
+                           .arg(i % 4).arg(messageId(i % kRowCount))));
+        ++i;
+    }
+}
+
+QTEST_GUILESS_MAIN(StatementCacheBenchmark)
+
+#include "bench_statement_cache.moc"
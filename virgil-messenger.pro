@@ -88,15 +88,30 @@ HEADERS += \
         include/VSQAttachmentBuilder.h \
         include/VSQClipboardProxy.h \
         include/VSQCommon.h \
+        include/VSQConversationRows.h \
+        include/VSQConnectionManager.h \
+        include/VSQCryptoBufferPool.h \
         include/VSQCryptoTransferManager.h \
         include/VSQDiscoveryManager.h \
         include/VSQDownload.h \
+        include/VSQFilePresenceCache.h \
+        include/VSQHistorySync.h \
         include/VSQLogging.h \
+        include/VSQLruCache.h \
         include/VSQMessenger.h \
         include/VSQSettings.h \
         include/VSQSqlChatModel.h \
         include/VSQSqlConversationModel.h \
+        include/VSQSqlMigrator.h \
+        include/VSQSqlSearchModel.h \
+        include/VSQSqlStatementCache.h \
+        include/VSQSqlWriteQueue.h \
+        include/VSQStorage.h \
         include/VSQNetworkAnalyzer.h \
+        include/VSQMessageEnvelope.h \
+        include/VSQOutbox.h \
+        include/VSQPeerCapabilities.h \
+        include/VSQReceivePipeline.h \
         include/VSQTransfer.h \
         include/VSQTransferManager.h \
         include/VSQUpload.h \
@@ -114,15 +129,29 @@ SOURCES += \
         src/VSQAttachmentBuilder.cpp \
         src/VSQClipboardProxy.cpp \
         src/VSQCommon.cpp \
+        src/VSQConversationRows.cpp \
+        src/VSQConnectionManager.cpp \
+        src/VSQCryptoBufferPool.cpp \
         src/VSQCryptoTransferManager.cpp \
         src/VSQDiscoveryManager.cpp \
         src/VSQDownload.cpp \
+        src/VSQFilePresenceCache.cpp \
+        src/VSQHistorySync.cpp \
         src/VSQMessenger.cpp \
         src/VSQLogging.cpp \
         src/VSQSettings.cpp \
         src/VSQSqlChatModel.cpp \
         src/VSQSqlConversationModel.cpp \
+        src/VSQSqlMigrator.cpp \
+        src/VSQSqlSearchModel.cpp \
+        src/VSQSqlStatementCache.cpp \
+        src/VSQSqlWriteQueue.cpp \
+        src/VSQStorage.cpp \
         src/VSQNetworkAnalyzer.cpp \
+        src/VSQMessageEnvelope.cpp \
+        src/VSQOutbox.cpp \
+        src/VSQPeerCapabilities.cpp \
+        src/VSQReceivePipeline.cpp \
         src/VSQTransfer.cpp \
         src/VSQTransferManager.cpp \
         src/VSQUpload.cpp \